@@ -0,0 +1,89 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "file.h"
+#include "replaygain.h"
+
+#ifndef ctrmus_cache_h
+#define ctrmus_cache_h
+
+/* Folder holding files made from music files, such as MP3 frame indexes and
+ * transcoded copies. */
+#if defined __arm__
+#define CACHE_DIR	"sdmc:/3ds/ctrmus/cache"
+#else
+#define CACHE_DIR	"/tmp/ctrmus"
+#endif
+
+/**
+ * Get the location in CACHE_DIR of a file made from a music file. Files are
+ * named by a hash of the path of the music file, so callers must check that
+ * the file is really made from it.
+ *
+ * \param	file	Music file.
+ * \param	ext		Extension of cached file, without the dot.
+ * \param	path	Location of cached file.
+ * \param	len		Size of path.
+ */
+void cachePath(const char* file, const char* ext, char* path, size_t len);
+
+/**
+ * Create CACHE_DIR and any missing folders above it.
+ */
+void cacheMakeDir(void);
+
+/**
+ * Start transcoding files added with cacheAdd() in a background thread, and
+ * let cacheLookup() find files transcoded earlier. Transcoded files are 16-bit
+ * PCM WAV, which take next to no CPU to play.
+ *
+ * \param	maxBytes	Most space that transcoded files may take. The oldest
+ *						are removed to make space for new ones.
+ * \param	prio		Priority of thread. Should be lower than playback, so
+ *						that only spare CPU time is used.
+ * \param	core		Core to run thread on, -2 for the default core.
+ * \return				0 on success, else failure.
+ */
+int cacheInit(uint64_t maxBytes, int prio, int core);
+
+/**
+ * Stop the transcoding thread. A file being transcoded is abandoned.
+ */
+void cacheExit(void);
+
+/**
+ * Transcode a file in the background, if it is of a type that takes much CPU
+ * to decode and has not been transcoded already. Does nothing unless
+ * cacheInit() was called.
+ *
+ * \param	file	Music file.
+ */
+void cacheAdd(const char* file);
+
+/**
+ * Find the transcoded copy of a file. The copy is only used if the file has
+ * not changed since it was transcoded.
+ *
+ * \param	file	Music file.
+ * \param	path	Location of transcoded copy.
+ * \param	len		Size of path.
+ * \return			true if a copy was found, else false.
+ */
+bool cacheLookup(const char* file, char* path, size_t len);
+
+/**
+ * Get the ReplayGain of the music file that a transcoded copy was made from.
+ * The gain is left as it is for files that are not transcoded copies.
+ *
+ * \param	probe	Open file, which is left at the same position.
+ * \param	gain	ReplayGain to fill in.
+ */
+void cacheReadGain(struct probe_t* probe, struct replaygain_t* gain);
+
+/**
+ * Check whether every file added with cacheAdd() has been dealt with.
+ */
+bool cacheIsIdle(void);
+
+#endif
@@ -1,3 +1,31 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include "platform.h"
+
+#ifndef ctrmus_file_h
+#define ctrmus_file_h
+
+/* Bytes read from the start of a file to find its type. */
+#define PROBE_SIZE	4096
+
+/* Alignment of reads from files, in file offset and in memory. */
+#define IO_ALIGN			4096
+
+/* Default size of each read from a file. */
+#define READ_AHEAD_DEFAULT	(64 * 1024)
+
+/* Default amount of each open file kept read ahead by the I/O thread. */
+#define PREFETCH_DEFAULT	(256 * 1024)
+
+/* Most blocks that may be read ahead of each open file. */
+#define IO_BLOCKS_MAX		16
+
+/* Default memory that may be used to hold whole files. */
+#define MEMORY_BUDGET_DEFAULT	(8 * 1024 * 1024)
+
 enum file_types
 {
 	FILE_TYPE_ERROR = 0,
@@ -9,6 +37,112 @@ enum file_types
 	FILE_TYPE_SID
 };
 
+struct decoder_fn;
+
+/**
+ * Describes a decoder, and how to recognise the files it can play.
+ */
+struct decoder_desc_t
+{
+	const char*			name;
+	enum file_types		type;
+
+	/**
+	 * Signatures found at the start of every file of this type, ending with
+	 * NULL. A match is certain, so the probe is not called. May be NULL.
+	 */
+	const char* const*	magic;
+
+	/**
+	 * Optional. Set to NULL if magic is enough.
+	 * Score the first bytes of a file.
+	 * \param	head	First bytes of file.
+	 * \param	len		Number of bytes in head.
+	 * \return			0 if not recognised, up to 100 if certain.
+	 */
+	int (* probe)(const uint8_t* head, size_t len);
+
+	/**
+	 * Set decoder functions.
+	 * \param	decoder	Structure to store functions.
+	 */
+	void (* set)(struct decoder_fn* decoder);
+};
+
+/**
+ * Block of a file held in memory.
+ */
+struct ioBlock_t
+{
+	uint8_t*		data;
+	int64_t			pos;
+	size_t			len;
+};
+
+/**
+ * An open file with its first bytes already read. Decoders read through
+ * probeRead(), which serves reads from blocks of the file read ahead in
+ * memory. The start of the file is in the first block once it has been
+ * probed, so it is not read again.
+ *
+ * Whilst the I/O thread is running, it keeps the blocks filled ahead of the
+ * decoder so that decoders do not wait on the SD card. Otherwise,
+ * probeRead() fills a single block itself.
+ *
+ * Files that fit in the memory budget are instead read whole into buf, after
+ * which they are closed.
+ */
+struct probe_t
+{
+	FILE*			f;
+	char*			file;
+	struct stat		st;
+
+	/* Decoder for the file, or NULL if it is not supported. */
+	const struct decoder_desc_t*	decoder;
+
+	/* Ring of blocks. The count blocks from head are filled, and follow on
+	 * from each other. */
+	struct ioBlock_t	blocks[IO_BLOCKS_MAX];
+	uint8_t*		buf;
+	unsigned		blocksNum;
+	unsigned		head;
+	unsigned		count;
+	size_t			blockSize;
+
+	/* Position of next block to fill, and whether it is past the end. */
+	int64_t			fillPos;
+	bool			eof;
+
+	/* Whether the whole file is read into buf, up to fillPos so far. */
+	bool			whole;
+
+	/* Changed when the blocks are discarded, so that a block being filled
+	 * at the time is dropped. */
+	unsigned		gen;
+
+	/* Whether blocks are filled by the I/O thread. */
+	bool			async;
+	struct lock_t	lock;
+	struct event_t	filled;
+	struct probe_t*	next;
+
+	/* Position of next read, and position of f. */
+	int64_t			pos;
+	int64_t			fpos;
+};
+
+/**
+ * Counts of file operations, for all files opened with fileOpen().
+ */
+struct ioStats_t
+{
+	unsigned long	opens;
+	unsigned long	reads;
+	unsigned long	seeks;
+	uint64_t		bytes;
+};
+
 /**
  * Obtain file type string from file_types enum.
  *
@@ -24,3 +158,146 @@ const char* fileToStr(enum file_types ft);
  * \return			file_types enum or 0 on error and errno set.
  */
 enum file_types getFileType(const char *file);
+
+/**
+ * Open a file, counting the open in fileOpens().
+ *
+ * \param	file	File location.
+ * \param	mode	Mode as given to fopen().
+ * \return			Open file, or NULL on failure with errno set.
+ */
+FILE* fileOpen(const char* file, const char* mode);
+
+/**
+ * Get number of files opened with fileOpen() so far.
+ *
+ * \return	Number of files opened.
+ */
+unsigned long fileOpens(void);
+
+/**
+ * Get counts of file operations so far.
+ *
+ * \param	stats	Output.
+ */
+void getIoStats(struct ioStats_t* stats);
+
+/**
+ * Set size of each read from files opened after this call.
+ *
+ * \param	bytes	Read size, rounded up to a multiple of IO_ALIGN and to
+ *					at least PROBE_SIZE.
+ */
+void setReadAhead(size_t bytes);
+
+/**
+ * Set how much memory may be used to hold whole files. Files opened after
+ * this call are read whole if they fit in what remains of the budget, so that
+ * the SD card is left idle once they are read.
+ *
+ * \param	bytes	Memory budget, or 0 to never read whole files.
+ */
+void setMemoryBudget(size_t bytes);
+
+/**
+ * Set how much of each file opened after this call is kept read ahead by the
+ * I/O thread.
+ *
+ * \param	bytes	Bytes to read ahead, rounded to whole reads. 0 to read
+ *					only when decoders need more data.
+ */
+void setPrefetch(size_t bytes);
+
+#if !defined __arm__
+/**
+ * Delay every read by a random time, to test playback from slow storage.
+ *
+ * \param	minNs	Shortest delay in nanoseconds.
+ * \param	maxNs	Longest delay in nanoseconds.
+ */
+void setReadDelay(uint64_t minNs, uint64_t maxNs);
+#endif
+
+/**
+ * Start the I/O thread, which reads ahead of decoders.
+ *
+ * \param	prio	Priority of thread.
+ * \param	core	Core to run thread on, -2 for the default core.
+ * \return			0 on success, else failure with errno set.
+ */
+int ioInit(int prio, int core);
+
+/**
+ * Stop the I/O thread. Files opened after this call are read only when
+ * decoders need more data.
+ */
+void ioExit(void);
+
+/**
+ * Open a file in the I/O thread and read its first blocks, so that it is
+ * ready when next opened with probeOpen(). Any file prefetched earlier and not
+ * yet opened is closed.
+ *
+ * \param	file	File location, or NULL to only close a prefetched file.
+ */
+void prefetchFile(const char* file);
+
+/**
+ * Open a file and find its type from its first bytes.
+ *
+ * \param	file	File location.
+ * \return			Probed file positioned at its start, or NULL on failure
+ *					with errno set. Unsupported files are returned with
+ *					decoder set to NULL.
+ */
+struct probe_t* probeOpen(const char* file);
+
+/**
+ * Read from a probed file.
+ *
+ * \param	probe	Probed file.
+ * \param	buf		Output.
+ * \param	size	Bytes to read.
+ * \return			Bytes read. Less than size at end of file or on error.
+ */
+size_t probeRead(struct probe_t* probe, void* buf, size_t size);
+
+/**
+ * Move position of a probed file.
+ *
+ * \param	probe	Probed file.
+ * \param	offset	Offset from whence.
+ * \param	whence	SEEK_SET, SEEK_CUR or SEEK_END.
+ * \return			0 on success, else failure.
+ */
+int probeSeek(struct probe_t* probe, int64_t offset, int whence);
+
+/**
+ * Get position of a probed file.
+ *
+ * \param	probe	Probed file.
+ * \return			Position in bytes.
+ */
+int64_t probeTell(struct probe_t* probe);
+
+/**
+ * Check whether the first packet of an Ogg file starts with a codec
+ * signature.
+ *
+ * \param	head		First bytes of file.
+ * \param	len			Number of bytes in head.
+ * \param	magic		Signature of codec.
+ * \param	magicLen	Length of signature.
+ * \return				true if the file is an Ogg file of the codec.
+ */
+bool oggPacketIs(const uint8_t* head, size_t len, const char* magic,
+		size_t magicLen);
+
+/**
+ * Close and free a probed file.
+ *
+ * \param	probe	Probed file, or NULL.
+ */
+void probeClose(struct probe_t* probe);
+
+#endif
@@ -1,4 +1,4 @@
 #include "playback.h"
 
 void setFlac(struct decoder_fn* decoder);
-int isFlac(const char* in);
+int probeFlac(const uint8_t* head, size_t len);
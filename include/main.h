@@ -23,12 +23,6 @@
  */
 #define MAX_DIRECTORIES 20
 
-struct watchdogInfo
-{
-	PrintConsole*		screen;
-	struct errInfo_t*	errInfo;
-};
-
 struct dirList_t
 {
 	char**	files;
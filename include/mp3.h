@@ -2,4 +2,4 @@
 #include "playback.h"
 
 void setMp3(struct decoder_fn* decoder);
-int isMp3(const char *path);
+int probeMp3(const uint8_t* head, size_t len);
@@ -0,0 +1,68 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef ctrmus_mpsc_h
+#define ctrmus_mpsc_h
+
+/**
+ * Bounded lock-free queue with any number of producer threads and a single
+ * consumer thread. Elements are copied in and out of the queue. An element
+ * only becomes visible to the consumer once every element pushed before it
+ * has been copied in.
+ */
+struct mpsc_t
+{
+	unsigned char*	data;
+	size_t			elemSize;
+
+	/* Number of slots minus one. Number of slots is a power of two. */
+	size_t			mask;
+
+	/* Sequence of each slot. Equal to the index of the push that may fill
+	 * it, one more than that once it is filled, and the index of the push
+	 * after that once it has been emptied. */
+	atomic_size_t*	seqs;
+
+	/* Next slot to read. Only used by the consumer. */
+	size_t			head;
+
+	/* Next slot to claim. Claimed by producers with compare and swap. */
+	atomic_size_t	tail;
+};
+
+/**
+ * Initialise queue.
+ *
+ * \param	q			Queue to initialise.
+ * \param	capacity	Minimum number of elements the queue must hold.
+ * \param	elemSize	Size of each element in bytes.
+ * \return				0 on success, else failure with errno set.
+ */
+int mpscInit(struct mpsc_t* q, size_t capacity, size_t elemSize);
+
+/**
+ * Free queue memory. No thread may be using the queue.
+ */
+void mpscExit(struct mpsc_t* q);
+
+/**
+ * Add an element to the queue. May be called by any thread.
+ *
+ * \param	q		Queue.
+ * \param	elem	Element to copy into queue.
+ * \return			false if the queue is full, else true.
+ */
+bool mpscPush(struct mpsc_t* q, const void* elem);
+
+/**
+ * Remove the oldest element from the queue. Must only be called by the
+ * consumer.
+ *
+ * \param	q		Queue.
+ * \param	elem	Location to copy element to.
+ * \return			false if the queue is empty, else true.
+ */
+bool mpscPop(struct mpsc_t* q, void* elem);
+
+#endif
@@ -2,4 +2,4 @@
 #include "playback.h"
 
 void setOpus(struct decoder_fn* decoder);
-int isOpus(const char* in);
+int probeOpus(const uint8_t* head, size_t len);
@@ -0,0 +1,164 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef ctrmus_output_h
+#define ctrmus_output_h
+
+/**
+ * Formats of samples that an output can play.
+ */
+enum output_format
+{
+	/* Signed 16-bit samples in native byte order. */
+	OUTPUT_FORMAT_PCM16 = 0,
+
+	/* Signed 8-bit samples. */
+	OUTPUT_FORMAT_PCM8
+};
+
+/* Size of each sample of a format in bytes. */
+#define OUTPUT_SAMPLE_SIZE(format)	\
+	((format) == OUTPUT_FORMAT_PCM8 ? sizeof(int8_t) : sizeof(int16_t))
+
+/**
+ * Block of samples to be played by an output.
+ */
+struct outputBuf
+{
+	/* Sample memory, allocated by the output. Holds int8_t samples if the
+	 * format is OUTPUT_FORMAT_PCM8. */
+	int16_t*	data;
+
+	/* Number of samples for each channel in data. */
+	uint32_t	nsamples;
+
+	/* Used by the output. */
+	void*		priv;
+};
+
+struct output_fn
+{
+	/**
+	 * Set function to call when a queued buffer has finished playing. The
+	 * function may be called from any thread. Must be set before init().
+	 * \param	callback	Function to call.
+	 * \param	data		Passed to callback.
+	 */
+	void (* setCallback)(void (* callback)(void* data), void* data);
+
+	/**
+	 * Open output. The output stays open across streams until exit().
+	 * \return	0 on success, else failure with errno set.
+	 */
+	int (* init)(void);
+
+	/**
+	 * Set format of the following buffers. No buffers may be queued.
+	 * \param	rate		Sampling rate.
+	 * \param	channels	Number of channels. Either 1 or 2.
+	 * \param	format		Format of samples.
+	 * \return	0 on success, else failure with errno set.
+	 */
+	int (* setFormat)(uint32_t rate, uint8_t channels,
+			enum output_format format);
+
+	/**
+	 * Get bytes of memory that are available for sample buffers.
+	 */
+	size_t (* spaceFree)(void);
+
+	/**
+	 * Allocate sample memory for a buffer.
+	 * \param	buf		Buffer to allocate.
+	 * \param	size	Size of sample memory in bytes.
+	 * \return	0 on success, else failure.
+	 */
+	int (* alloc)(struct outputBuf* buf, size_t size);
+
+	/**
+	 * Free buffer allocated with alloc().
+	 */
+	void (* free)(struct outputBuf* buf);
+
+	/**
+	 * Queue buffer for playback. Buffers are played in the order that they
+	 * are queued.
+	 */
+	void (* queue)(struct outputBuf* buf);
+
+	/**
+	 * Check whether a queued buffer has finished playing.
+	 * \return	true if the buffer may be reused.
+	 */
+	bool (* done)(const struct outputBuf* buf);
+
+	/**
+	 * Optional. Set to NULL if only whole buffers can be counted.
+	 * Get how much of a queued buffer has been heard, allowing for the time
+	 * that samples take to get from the output to the speakers.
+	 * \param	buf		Queued buffer.
+	 * \param	time	Set to the platformTime() at which the last of the
+	 *					samples returned is heard.
+	 * \return	Number of samples for each channel of buf heard by time.
+	 */
+	uint32_t (* position)(const struct outputBuf* buf, uint64_t* time);
+
+	/**
+	 * Discard queued buffers. All buffers may be reused afterwards, whether
+	 * done() reports them as finished or not.
+	 */
+	void (* flush)(void);
+
+	/**
+	 * Pause or resume playback.
+	 */
+	void (* setPaused)(bool paused);
+
+	/**
+	 * Returns whether playback is paused.
+	 */
+	bool (* isPaused)(void);
+
+	/**
+	 * Stop playback and close output. Queued buffers are discarded.
+	 */
+	void (* exit)(void);
+};
+
+/**
+ * Set output to play through the DSP of the 3DS.
+ */
+void setOutputNdsp(struct output_fn* output);
+
+/**
+ * Set output to discard all samples as soon as they are queued.
+ */
+void setOutputNull(struct output_fn* output);
+
+/**
+ * Set output to write all samples to a WAV file.
+ */
+void setOutputWav(struct output_fn* output);
+
+/**
+ * Set file that the WAV output writes to. Defaults to "out.wav".
+ *
+ * \param	file	Location of file to write. Must remain valid whilst the
+ *					output is open.
+ */
+void setOutputWavFile(const char* file);
+
+/**
+ * Set output to discard samples at the rate that the DSP would play them.
+ */
+void setOutputSim(struct output_fn* output);
+
+/**
+ * Set how many times faster than real time the simulated output plays.
+ *
+ * \param	speed	Speed multiplier. Must be at least 1.
+ */
+void setOutputSimSpeed(unsigned speed);
+
+#endif
@@ -0,0 +1,120 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined __arm__
+#include <3ds.h>
+#else
+#include <pthread.h>
+#endif
+
+#ifndef ctrmus_platform_h
+#define ctrmus_platform_h
+
+/**
+ * Thread and synchronisation wrappers, so that the playback engine may be run
+ * on the 3DS and on Linux.
+ */
+
+struct thread_t
+{
+#if defined __arm__
+	Thread			thread;
+#else
+	pthread_t		thread;
+	void			(* entry)(void*);
+	void*			arg;
+#endif
+};
+
+/**
+ * Auto-resetting event. A signal wakes a single waiting thread, or the next
+ * thread to wait if none are waiting.
+ */
+struct event_t
+{
+#if defined __arm__
+	LightEvent		event;
+#else
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	bool			signalled;
+#endif
+};
+
+/**
+ * Mutual exclusion lock.
+ */
+struct lock_t
+{
+#if defined __arm__
+	LightLock		lock;
+#else
+	pthread_mutex_t	lock;
+#endif
+};
+
+/**
+ * Start a new thread.
+ *
+ * \param	thread		Thread to initialise.
+ * \param	entry		Function to run in new thread.
+ * \param	arg			Argument to pass to entry.
+ * \param	stackSize	Size of stack for new thread.
+ * \param	prio		Priority of thread. Lower values are higher priority.
+ *						Ignored on Linux.
+ * \param	core		Core to run thread on, -2 for the default core. Ignored
+ *						on Linux.
+ * \return				0 on success, else failure.
+ */
+int platformThreadCreate(struct thread_t* thread, void (* entry)(void*),
+		void* arg, size_t stackSize, int prio, int core);
+
+/**
+ * Wait for a thread to exit and free its resources.
+ *
+ * \param	thread	Thread started with platformThreadCreate().
+ */
+void platformThreadJoin(struct thread_t* thread);
+
+/**
+ * Get priority of the calling thread.
+ *
+ * \return	Priority of calling thread. Always 0 on Linux.
+ */
+int platformThreadPriority(void);
+
+/**
+ * Get time from a monotonic clock.
+ *
+ * \return	Time in nanoseconds.
+ */
+uint64_t platformTime(void);
+
+/**
+ * Sleep the calling thread.
+ *
+ * \param	ns	Nanoseconds to sleep for.
+ */
+void platformSleep(uint64_t ns);
+
+void eventInit(struct event_t* event);
+void eventSignal(struct event_t* event);
+void eventWait(struct event_t* event);
+
+/**
+ * Wait for an event to be signalled.
+ *
+ * \param	event	Event to wait on.
+ * \param	ns		Maximum nanoseconds to wait for.
+ * \return			true if signalled, false on timeout.
+ */
+bool eventWaitTimeout(struct event_t* event, uint64_t ns);
+void eventExit(struct event_t* event);
+
+void lockInit(struct lock_t* lock);
+void lockAcquire(struct lock_t* lock);
+void lockRelease(struct lock_t* lock);
+void lockExit(struct lock_t* lock);
+
+#endif
@@ -1,5 +1,11 @@
 #include <stdbool.h>
 #include <limits.h>
+#include <stdint.h>
+
+#include "output.h"
+#include "replaygain.h"
+#include "resample.h"
+#include "sample.h"
 
 #ifndef ctrmus_playback_h
 #define ctrmus_playback_h
@@ -7,62 +13,317 @@
 /* Channel to play music on */
 #define CHANNEL	0x08
 
+/* Range of speeds given to setPlaybackSpeed(), in percent. */
+#define PLAYBACK_SPEED_MIN	75
+#define PLAYBACK_SPEED_MAX	200
+
+struct probe_t;
+
 struct decoder_fn
 {
 	/**
-	 * Set decoder parameters.
-	 * \param	decoder Structure to store parameters.
-	 * \return	0 on success, else failure.
+	 * Open file for decoding. Each open file has its own context, which is
+	 * passed to the other functions.
+	 * \param	probe	Probed file to decode, read with probeRead(). On
+	 *					success, the decoder closes it in exit().
+	 * \return	Decoder context, or NULL on failure.
 	 */
-	int (* init)(const char* file);
+	void* (* init)(struct probe_t* probe);
 
 	/**
 	 * Get sampling rate of file.
 	 * \return	Sampling rate.
 	 */
-	uint32_t (* rate)(void);
+	uint32_t (* rate)(void* ctx);
 
 	/**
 	 * Get number of channels of file.
 	 * \return	Number of channels for opened file.
 	 */
-	uint8_t (* channels)(void);
+	uint8_t (* channels)(void* ctx);
 
 	/**
-	 * Size of output buffer used in decode().
+	 * Size of output buffer used in decode(), in samples.
 	 */
 	size_t buffSize;
 
+	/**
+	 * Order of channels given by decode(), if there are more than two.
+	 */
+	enum channel_order order;
+
+	/**
+	 * Optional. Set to NULL if decode() only gives 16-bit samples.
+	 * Choose the format of samples given by decode(), before it is first
+	 * called. Until then, samples are 16-bit.
+	 * \param	format	Most compact format that may be given. Samples may
+	 *					always be given as OUTPUT_FORMAT_PCM16.
+	 * \return	Format of samples that decode() will give.
+	 */
+	enum output_format (* setFormat)(void* ctx, enum output_format format);
+
 	/**
 	 * Fill buffer with decoded samples.
 	 * \param buffer	Output buffer to fill.
 	 * \return		Samples read for each channel.
 	 */
-	uint64_t (* decode)(void*);
+	uint64_t (* decode)(void* ctx, void* buffer);
 
 	/**
-	 * Free codec resources.
+	 * Free codec resources and the context.
 	 */
-	void (* exit)(void);
+	void (* exit)(void* ctx);
 
 	/**
 	 * Optional. Set to NULL if unavailable.
 	 * Get number of samples in audio file.
 	 */
-	size_t (* getFileSamples)(void);
+	size_t (* getFileSamples)(void* ctx);
+
+	/**
+	 * Optional. Set to NULL if unavailable.
+	 * Move to a sample so that the next decode() starts from it.
+	 * \param	sample	Position in samples for each channel.
+	 * \return	0 on success, else failure.
+	 */
+	int (* seek)(void* ctx, uint64_t sample);
+
+	/**
+	 * Optional. Set to NULL if the file type has no tags.
+	 * Read the ReplayGain of file from its tags.
+	 * \param	gain	Set up by replaygainInit(), to fill in with any gains
+	 *					found.
+	 */
+	void (* getGain)(void* ctx, struct replaygain_t* gain);
 };
 
 struct playbackInfo_t
 {
 	char file[PATH_MAX];
-	struct errInfo_t *errInfo;
+
+	/* Number of buffers in the decode-ahead ring. */
+	unsigned buffers_total;
+	/* Number of buffers currently queued to the DSP. */
+	unsigned buffers_queued;
+	/* Fewest buffers seen queued to the DSP whilst decoding. If this reaches
+	 * 0, the DSP ran out of samples to play. */
+	unsigned buffers_min_queued;
+
+	/* Number of times the playback thread has woken up. */
+	size_t wakeups;
+
+	/* Time taken to start the current track, from the command to play it
+	 * until its first samples were queued to the output. */
+	uint64_t switch_ns;
+
+	/* Time taken by the last seek, from the command until samples from the
+	 * new position were queued to the output. */
+	uint64_t seek_ns;
+
+	/* Number of files opened to start the current track. */
+	unsigned file_opens;
+
+	/* Time the decoder thread has spent decoding since playbackPlay(),
+	 * including any tracks that followed on without stopping playback. */
+	uint64_t decode_ns;
+};
+
+/**
+ * Position of playback in the current file, from playbackGetPosition().
+ * Samples count every channel, and are those of the file whatever the speed of
+ * playback.
+ */
+struct playbackPosition_t
+{
+	size_t samples_played;
 
 	/* If 0, then the duration of file is unavailable. */
 	size_t samples_total;
-	size_t samples_played;
+
+	/* If 0, then no file has been opened. */
 	size_t samples_per_second;
+
+	/* platformTime() at which the sample at samples_played is heard. */
+	uint64_t time;
+
+	/* Changes whenever the position jumps rather than moving on with
+	 * playback: when a file is opened, a track follows on or a seek is
+	 * carried out. */
+	unsigned serial;
+};
+
+/**
+ * Kinds of event reported by the playback thread, read with
+ * playbackGetEvent().
+ */
+enum playback_event
+{
+	/* The file given to playbackPlay() was opened and is starting. */
+	PLAYBACK_EVENT_STARTED = 0,
+
+	/* The next file started playing, either following on from the previous
+	 * file without stopping or after playbackNext(). */
+	PLAYBACK_EVENT_NEXT_TRACK,
+
+	/* A seek was carried out. */
+	PLAYBACK_EVENT_POSITION,
+
+	/* The output ran out of samples whilst the file was still being
+	 * decoded. */
+	PLAYBACK_EVENT_UNDERRUN,
+
+	/* An error occurred. Followed by PLAYBACK_EVENT_STOPPED if playback
+	 * stopped because of it. */
+	PLAYBACK_EVENT_ERROR,
+
+	/* Playback stopped, either at the end of the last file or because of an
+	 * error. */
+	PLAYBACK_EVENT_STOPPED
 };
 
+struct playbackEvent_t
+{
+	enum playback_event type;
+
+	/* PLAYBACK_EVENT_ERROR only. errno code or one defined in error.h. */
+	int error;
+
+	/* PLAYBACK_EVENT_POSITION only. Position moved to, in the same units as
+	 * samples_played of struct playbackPosition_t. */
+	size_t samples;
+
+	/* platformTime() at which the event occurred. */
+	uint64_t time;
+};
+
+struct output_fn;
+
+/**
+ * Set the output used for playback. Must be called before playbackInit().
+ *
+ * \param	out	Output functions to use.
+ */
+void setPlaybackOutput(const struct output_fn* out);
+
+/**
+ * Open the output and start the playback thread. The output must be set with
+ * setPlaybackOutput() beforehand, otherwise the default output is used.
+ *
+ * \param	infoIn	Playback information, updated by the playback thread
+ *					until playbackExit().
+ * \return			0 on success, else failure with errno set.
+ */
+int playbackInit(struct playbackInfo_t* infoIn);
+
+/**
+ * Stop playback, stop the playback thread and close the output.
+ */
+void playbackExit(void);
+
+/**
+ * Stop the current file, if any, and play another file. Like the other
+ * playback commands, this returns without waiting for the playback thread
+ * and must always be called from the same thread.
+ *
+ * \param	file	File to play.
+ * \param	next	File to play once file ends, as with setNextFile().
+ * \return			0 on success, else failure with errno set.
+ */
+int playbackPlay(const char* file, const char* next);
+
+/**
+ * Stop the current file and play the file set with setNextFile() straight
+ * away. If no file is set, playback stops and PLAYBACK_EVENT_STOPPED is
+ * reported.
+ *
+ * \return	0 on success, else failure with errno set.
+ */
+int playbackNext(void);
+
+/**
+ * Get the position of playback now. Between the updates of the playback
+ * thread, the position is carried on from the sample that the output was
+ * playing at the last update, up to the end of the buffer it was playing. May
+ * be called from any thread between playbackInit() and playbackExit().
+ *
+ * \param	pos	Set to the position.
+ */
+void playbackGetPosition(struct playbackPosition_t* pos);
+
+/**
+ * Take the oldest event reported by the playback thread. Events of a file that
+ * was replaced or stopped by a later command are dropped, so that they cannot
+ * be mistaken for events of the file that followed. Must be called from the
+ * thread that sends playback commands, often enough that the queue of events
+ * does not fill up.
+ *
+ * \param	event	Set to the event.
+ * \return			false if there are no more events, else true.
+ */
+bool playbackGetEvent(struct playbackEvent_t* event);
+
+/**
+ * Move playback of the current file to another position.
+ *
+ * \param	pos	Position in the same units as samples_played of
+ *				struct playbackPosition_t.
+ * \return		0 on success, else failure with errno set.
+ */
+int playbackSeek(size_t pos);
+
+/**
+ * Set the file to play once the current file ends. If it has the same number
+ * of channels as the current file, it is decoded whilst the last buffers of
+ * the current file are still playing, so that there is no gap between the two,
+ * or crossfaded with the end of the current file if crossfades are set with
+ * setPlaybackCrossfade(). A file at another sampling rate is resampled to that
+ * of the output stream, unless the current file is played as 8-bit samples.
+ *
+ * \param	file	File to play next, or NULL to stop after the current file.
+ */
+void setNextFile(const char* file);
+
+/**
+ * Set how files are normalised with ReplayGain. Takes effect from the next file
+ * that is opened.
+ *
+ * \param	mode	Which gain of each file to use.
+ * \param	preamp	Gain added to that of each file, in hundredths of a dB.
+ */
+void setPlaybackGain(enum replaygain_mode mode, int32_t preamp);
+
+/**
+ * Set the length of crossfades between a file and the file set to play next.
+ * Takes effect from the next file that is opened. Files are only crossfaded
+ * if they could otherwise be played without a gap, and if the length of the
+ * current file is known.
+ *
+ * \param	ms	Length of crossfades in milliseconds, or 0 for none.
+ */
+void setPlaybackCrossfade(unsigned ms);
+
+/**
+ * Set the sampling rate of the output stream, and how well files at other
+ * rates are resampled to it. Takes effect from the next file that is opened.
+ *
+ * \param	rate	Sampling rate, or 0 to use that of the file that starts the
+ *					stream, so that only the files that follow on from it at
+ *					another rate are resampled.
+ * \param	quality	Quality of resampling.
+ */
+void setPlaybackRate(uint32_t rate, enum resample_quality quality);
+
+/**
+ * Set the speed of playback, without changing the pitch. Takes effect from the
+ * next buffer decoded, unless the current file is played as 8-bit samples, in
+ * which case it takes effect from the next file played with playbackPlay() or
+ * playbackNext().
+ *
+ * \param	percent	Speed in percent of the speed of the file, from
+ *					PLAYBACK_SPEED_MIN to PLAYBACK_SPEED_MAX.
+ */
+void setPlaybackSpeed(unsigned percent);
+
 /**
  * Pause or play current file.
  *
@@ -71,7 +332,7 @@ struct playbackInfo_t
 bool togglePlayback(void);
 
 /**
- * Stops current playback. Playback thread should exit as a result.
+ * Stops current playback.
  */
 void stopPlayback(void);
 
@@ -80,13 +341,4 @@ void stopPlayback(void);
  */
 bool isPlaying(void);
 
-/**
- * Should only be called from a new thread only, and have only one playback
- * thread at time. This function has not been written for more than one
- * playback thread in mind.
- *
- * \param	infoIn	Playback information.
- */
-void playFile(void* infoIn);
-
 #endif
@@ -0,0 +1,70 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef ctrmus_replaygain_h
+#define ctrmus_replaygain_h
+
+/* Gain of a file without that tag. */
+#define REPLAYGAIN_UNKNOWN	INT32_MIN
+
+/**
+ * Which gain from the tags of a file is used to normalise it.
+ */
+enum replaygain_mode
+{
+	REPLAYGAIN_OFF = 0,
+
+	/* Make every track as loud as each other. */
+	REPLAYGAIN_TRACK,
+
+	/* Keep the differences between tracks of an album. Falls back to the
+	 * track gain for files without an album gain. */
+	REPLAYGAIN_ALBUM
+};
+
+/**
+ * ReplayGain of a file, as read from its tags.
+ */
+struct replaygain_t
+{
+	/* Gains in hundredths of a dB, or REPLAYGAIN_UNKNOWN. */
+	int32_t	track;
+	int32_t	album;
+
+	/* Peak samples, where 1 is full scale, or 0 if unknown. */
+	float	trackPeak;
+	float	albumPeak;
+};
+
+/**
+ * Set up a ReplayGain with every gain and peak unknown.
+ *
+ * \param	gain	ReplayGain to set up.
+ */
+void replaygainInit(struct replaygain_t* gain);
+
+/**
+ * Read a tag, of the form KEY=value as used by Vorbis comments, into a
+ * ReplayGain if it is a REPLAYGAIN_* or R128_* tag. R128 gains, as used by
+ * Opus, are changed to the ReplayGain reference level.
+ *
+ * \param	gain	ReplayGain to fill in.
+ * \param	tag		Tag, which need not be NUL terminated.
+ * \param	len		Length of tag.
+ */
+void replaygainParse(struct replaygain_t* gain, const char* tag, size_t len);
+
+/**
+ * Get the gain to give to sampleGain() for a file. The gain is lowered where
+ * needed so that the peak of the file does not clip.
+ *
+ * \param	gain	ReplayGain of the file.
+ * \param	mode	Which gain to use.
+ * \param	preamp	Gain to add to that of the tags, in hundredths of a dB.
+ * \return			Gain in Q12, or SAMPLE_GAIN_UNITY if the file has no gain
+ *					or mode is REPLAYGAIN_OFF.
+ */
+int16_t replaygainFactor(const struct replaygain_t* gain,
+		enum replaygain_mode mode, int32_t preamp);
+
+#endif
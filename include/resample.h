@@ -0,0 +1,146 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef ctrmus_resample_h
+#define ctrmus_resample_h
+
+/* Most channels that can be resampled. Files are downmixed to stereo first. */
+#define RESAMPLE_CHANNELS_MAX	2
+
+/**
+ * Trade-off between the quality of a resampler and the CPU time it takes.
+ */
+enum resample_quality
+{
+	/* 16 taps for each output frame. Rolls off from about 14 kHz, where the
+	 * lower rate is 44.1 kHz, and leaves images at about -65 dB. */
+	RESAMPLE_LOW = 0,
+
+	/* 32 taps. Flat to about 17 kHz, with images at about -85 dB. */
+	RESAMPLE_MEDIUM,
+
+	/* 64 taps, each with twice the precision. Flat to about 19 kHz and about
+	 * as clean as 16-bit samples allow. */
+	RESAMPLE_HIGH
+};
+
+/**
+ * Converts interleaved 16-bit frames from one sampling rate to another, with
+ * a polyphase windowed sinc filter. Frames are written to the resampler as
+ * they are decoded, and read back at the new rate.
+ */
+struct resampler_t
+{
+	unsigned	chans;
+
+	/* Rates divided by their greatest common divisor, so that each output
+	 * frame is down / up input frames after the one before. */
+	uint32_t	up;
+	uint32_t	down;
+
+	/* Filter of phases sets of taps, each a multiple of 8 long, in Q shift.
+	 * The taps of phase p make the output frame that is p / phases of an
+	 * input frame after the input frame at the middle of the taps. If
+	 * fineShift is not 0, each set is followed by what was left over from
+	 * rounding the taps, in Q (shift + fineShift), and the sets are stride
+	 * apart. If there are fewer phases than up, one more set is kept for
+	 * phase phases, and output frames between two phases are interpolated
+	 * linearly between them. */
+	unsigned	taps;
+	unsigned	phases;
+	unsigned	shift;
+	unsigned	fineShift;
+	unsigned	stride;
+	int16_t*	coeffs;
+	/* Multiplier that gives the phase of a fraction of up, in Q32. The
+	 * fractional part is how far the output frame is towards the next phase. */
+	uint64_t	phaseMul;
+
+	/* Input frames of each channel, up to histLen of the histSize that fit.
+	 * The taps of the next output frame start at frame next, and the frame is
+	 * frac / up of an input frame after the input frame at their middle. */
+	int16_t*	hist[RESAMPLE_CHANNELS_MAX];
+	size_t		histLen;
+	size_t		histSize;
+	size_t		next;
+	uint32_t	frac;
+
+	/* Position in the file of the input and output, in frames. Output stops
+	 * at outEnd once resampleFlush() has been called. */
+	uint64_t	inPos;
+	uint64_t	outPos;
+	uint64_t	outEnd;
+};
+
+/**
+ * Set up a resampler, starting from the first frame of a file.
+ *
+ * \param	rs			Resampler to set up.
+ * \param	inRate		Sampling rate of the input.
+ * \param	outRate		Sampling rate of the output.
+ * \param	chans		Number of channels, up to RESAMPLE_CHANNELS_MAX.
+ * \param	maxFrames	Most frames given to each resampleWrite().
+ * \param	quality		Quality of filter.
+ * \return				0 on success, else failure with errno set.
+ */
+int resampleInit(struct resampler_t* rs, uint32_t inRate, uint32_t outRate,
+		unsigned chans, size_t maxFrames, enum resample_quality quality);
+
+/**
+ * Free the memory used by a resampler.
+ *
+ * \param	rs	Resampler set up with resampleInit().
+ */
+void resampleExit(struct resampler_t* rs);
+
+/**
+ * Get the number of output frames made from a number of input frames.
+ *
+ * \param	rs		Resampler.
+ * \param	frames	Input frames from the start of the file.
+ * \return			Output frames.
+ */
+uint64_t resampleFrames(const struct resampler_t* rs, uint64_t frames);
+
+/**
+ * Drop all frames held by a resampler and carry on from another position of
+ * the file, as if the frames before it were silent.
+ *
+ * \param	rs		Resampler.
+ * \param	frame	Output frame to carry on from.
+ * \return			Input frame that must be written next.
+ */
+uint64_t resampleSeek(struct resampler_t* rs, uint64_t frame);
+
+/**
+ * Give input frames to a resampler. Must only be called once resampleRead()
+ * has made as many output frames as it can, so that there is room for them.
+ *
+ * \param	rs		Resampler.
+ * \param	in		Interleaved input frames.
+ * \param	frames	Number of frames, up to the maxFrames given to
+ *					resampleInit().
+ */
+void resampleWrite(struct resampler_t* rs, const int16_t* in, size_t frames);
+
+/**
+ * Mark the end of the input, so that resampleRead() makes the output frames
+ * that follow the last input frame and then stops. Must only be called once
+ * resampleRead() has made as many output frames as it can.
+ *
+ * \param	rs		Resampler.
+ */
+void resampleFlush(struct resampler_t* rs);
+
+/**
+ * Make output frames from the input frames written so far.
+ *
+ * \param	rs		Resampler.
+ * \param	out		Interleaved output frames.
+ * \param	frames	Most frames to make.
+ * \return			Frames made. Fewer than frames once the input runs out.
+ */
+size_t resampleRead(struct resampler_t* rs, int16_t* out, size_t frames);
+size_t resampleReadRef(struct resampler_t* rs, int16_t* out, size_t frames);
+
+#endif
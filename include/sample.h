@@ -0,0 +1,141 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef ctrmus_sample_h
+#define ctrmus_sample_h
+
+/* Most channels that can be downmixed to stereo. */
+#define SAMPLE_CHANNELS_MAX	8
+
+/* Gains given to sampleGain() are in Q12, so that up to +18 dB can be given. */
+#define SAMPLE_GAIN_SHIFT	12
+#define SAMPLE_GAIN_UNITY	(1 << SAMPLE_GAIN_SHIFT)
+
+/* Gains of the two files mixed by sampleFade() are in Q14. */
+#define SAMPLE_FADE_SHIFT	14
+#define SAMPLE_FADE_UNITY	(1 << SAMPLE_FADE_SHIFT)
+
+/**
+ * Order of the channels of files with more than two channels.
+ */
+enum channel_order
+{
+	/* WAVE_FORMAT_EXTENSIBLE order, also used by FLAC. */
+	CHANNEL_ORDER_WAV = 0,
+
+	/* Vorbis order, also used by Opus. */
+	CHANNEL_ORDER_VORBIS
+};
+
+/**
+ * Gains used to downmix interleaved frames to stereo.
+ */
+struct downmix_t
+{
+	unsigned	chans;
+
+	/* Gain of each input channel in each output channel, in Q15. */
+	int16_t		gains[2][SAMPLE_CHANNELS_MAX];
+
+	/* The same gains, two input channels to each word, as used by SMLAD. */
+	uint32_t	pairs[2][SAMPLE_CHANNELS_MAX / 2];
+};
+
+/*
+ * Each conversion below has a scalar reference, named with a Ref suffix, and a
+ * version that uses SSE2 or ARMv6 SIMD instructions where available. Both give
+ * the same output, which is checked by the Linux test build.
+ */
+
+/**
+ * Swap the bytes of 16-bit samples in place.
+ *
+ * \param	samples	Samples to swap.
+ * \param	count	Number of samples.
+ */
+void sampleSwap16(int16_t* samples, size_t count);
+void sampleSwap16Ref(int16_t* samples, size_t count);
+
+/**
+ * Convert unsigned 8-bit samples to signed in place, or back again.
+ *
+ * \param	samples	Samples to convert.
+ * \param	count	Number of samples.
+ */
+void sampleSign8(int8_t* samples, size_t count);
+void sampleSign8Ref(int8_t* samples, size_t count);
+
+/**
+ * Copy mono samples to both channels of stereo frames.
+ *
+ * \param	out		Stereo output, of 2 * frames samples. May be the same as
+ *					in.
+ * \param	in		Mono input.
+ * \param	frames	Number of frames.
+ */
+void sampleMonoToStereo(int16_t* out, const int16_t* in, size_t frames);
+void sampleMonoToStereoRef(int16_t* out, const int16_t* in, size_t frames);
+
+/**
+ * Multiply samples by a gain in place, saturating those that would clip.
+ *
+ * \param	samples	Samples to change.
+ * \param	count	Number of samples.
+ * \param	gain	Gain, where SAMPLE_GAIN_UNITY leaves samples as they are.
+ */
+void sampleGain(int16_t* samples, size_t count, int16_t gain);
+void sampleGainRef(int16_t* samples, size_t count, int16_t gain);
+
+/**
+ * Get the step to give sampleFade() for a fade of a number of frames.
+ *
+ * \param	frames	Length of fade, at least 1.
+ * \return			Step of gain for each frame, in Q30.
+ */
+uint32_t sampleFadeStep(uint32_t frames);
+
+/**
+ * Crossfade from one file to another, by mixing them with gains that change
+ * linearly over each frame. Past the end of the fade, only the file fading in
+ * is heard.
+ *
+ * \param	out		Frames of the file fading out, replaced by the mix.
+ * \param	in		Frames of the file fading in.
+ * \param	frames	Number of frames.
+ * \param	chans	Number of channels in each frame.
+ * \param	pos		Frame of the fade that the first frame is at.
+ * \param	step	Step of gain, from sampleFadeStep().
+ */
+void sampleFade(int16_t* out, const int16_t* in, size_t frames,
+		unsigned chans, uint64_t pos, uint32_t step);
+void sampleFadeRef(int16_t* out, const int16_t* in, size_t frames,
+		unsigned chans, uint64_t pos, uint32_t step);
+
+/**
+ * Set up the gains to downmix a file to stereo. Centre and surround channels
+ * are mixed in at -3 dB and LFE is dropped, as in ITU-R BS.775, and then the
+ * gains are scaled so that the mix cannot clip.
+ *
+ * \param	mix		Gains to set up.
+ * \param	chans	Number of channels in the file, from 3 to
+ *					SAMPLE_CHANNELS_MAX.
+ * \param	order	Order of channels in the file.
+ * \return			0 on success, else failure.
+ */
+int sampleDownmixInit(struct downmix_t* mix, unsigned chans,
+		enum channel_order order);
+
+/**
+ * Downmix interleaved frames to stereo.
+ *
+ * \param	mix		Gains set up with sampleDownmixInit().
+ * \param	out		Stereo output. May be the same as in.
+ * \param	in		Input frames of mix->chans channels each.
+ * \param	frames	Number of frames.
+ */
+void sampleDownmix(const struct downmix_t* mix, int16_t* out,
+		const int16_t* in, size_t frames);
+void sampleDownmixRef(const struct downmix_t* mix, int16_t* out,
+		const int16_t* in, size_t frames);
+
+#endif
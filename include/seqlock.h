@@ -0,0 +1,54 @@
+#include <stdatomic.h>
+#include <stddef.h>
+
+#ifndef ctrmus_seqlock_h
+#define ctrmus_seqlock_h
+
+/**
+ * Small block of data with a single writer thread and any number of reader
+ * threads. The writer never waits for readers, and readers never see the data
+ * part way through being written: a reader that overlaps a write tries again.
+ * Readers spin whilst a write is in progress, so on the 3DS the writer must
+ * run at a higher priority than readers on the same core.
+ */
+struct seqlock_t
+{
+	/* Copy of the data, in words that may be read whilst being written. */
+	atomic_uint*	words;
+	size_t			size;
+
+	/* Odd whilst the data is being written. Only written by the writer. */
+	atomic_uint		seq;
+};
+
+/**
+ * Initialise lock, with the data set to zero.
+ *
+ * \param	lock	Lock to initialise.
+ * \param	size	Size of the data in bytes.
+ * \return			0 on success, else failure with errno set.
+ */
+int seqlockInit(struct seqlock_t* lock, size_t size);
+
+/**
+ * Free lock memory. No thread may be using the lock.
+ */
+void seqlockExit(struct seqlock_t* lock);
+
+/**
+ * Replace the data. Must only be called by the writer.
+ *
+ * \param	lock	Lock.
+ * \param	data	Data to copy in.
+ */
+void seqlockWrite(struct seqlock_t* lock, const void* data);
+
+/**
+ * Copy out the data as it was after a single write.
+ *
+ * \param	lock	Lock.
+ * \param	data	Location to copy data to.
+ */
+void seqlockRead(struct seqlock_t* lock, void* data);
+
+#endif
@@ -0,0 +1,72 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifndef ctrmus_spsc_h
+#define ctrmus_spsc_h
+
+/**
+ * Bounded lock-free queue with a single producer thread and a single consumer
+ * thread. Elements are copied in and out of the queue.
+ */
+struct spsc_t
+{
+	unsigned char*	data;
+	size_t			elemSize;
+
+	/* Number of slots minus one. Number of slots is a power of two. */
+	size_t			mask;
+
+	/* Next slot to read. Only written by the consumer. */
+	atomic_size_t	head;
+
+	/* Next slot to write. Only written by the producer. */
+	atomic_size_t	tail;
+};
+
+/**
+ * Initialise queue.
+ *
+ * \param	q			Queue to initialise.
+ * \param	capacity	Minimum number of elements the queue must hold.
+ * \param	elemSize	Size of each element in bytes.
+ * \return				0 on success, else failure with errno set.
+ */
+int spscInit(struct spsc_t* q, size_t capacity, size_t elemSize);
+
+/**
+ * Free queue memory. No thread may be using the queue.
+ */
+void spscExit(struct spsc_t* q);
+
+/**
+ * Remove all elements from the queue. No thread may be using the queue.
+ */
+void spscClear(struct spsc_t* q);
+
+/**
+ * Add an element to the queue. Must only be called by the producer.
+ *
+ * \param	q		Queue.
+ * \param	elem	Element to copy into queue.
+ * \return			false if the queue is full, else true.
+ */
+bool spscPush(struct spsc_t* q, const void* elem);
+
+/**
+ * Remove the oldest element from the queue. Must only be called by the
+ * consumer.
+ *
+ * \param	q		Queue.
+ * \param	elem	Location to copy element to.
+ * \return			false if the queue is empty, else true.
+ */
+bool spscPop(struct spsc_t* q, void* elem);
+
+/**
+ * Get number of elements in the queue. The result may be stale by the time it
+ * is used if the other thread is active.
+ */
+size_t spscCount(struct spsc_t* q);
+
+#endif
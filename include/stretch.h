@@ -0,0 +1,145 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef ctrmus_stretch_h
+#define ctrmus_stretch_h
+
+/* Most channels that can be stretched. Files are downmixed to stereo first. */
+#define STRETCH_CHANNELS_MAX	2
+
+/* Speeds are in Q16, so that STRETCH_SPEED_UNITY plays at the speed of the
+ * input. */
+#define STRETCH_SPEED_SHIFT		16
+#define STRETCH_SPEED_UNITY		(1 << STRETCH_SPEED_SHIFT)
+#define STRETCH_SPEED_MIN		(STRETCH_SPEED_UNITY / 4)
+#define STRETCH_SPEED_MAX		(2 * STRETCH_SPEED_UNITY)
+
+/**
+ * Changes the speed of interleaved 16-bit frames without changing their pitch,
+ * with WSOLA. The output is made of segments of the input that overlap one
+ * another, each taken from where the speed puts it, give or take a window in
+ * which its start best matches the end of the segment before.
+ */
+struct stretcher_t
+{
+	unsigned	chans;
+	uint32_t	speed;
+
+	/* Length in frames of each segment, of the overlap between segments and
+	 * of the window searched for the start of each segment. Each a multiple
+	 * of 8. */
+	unsigned	segLen;
+	unsigned	overlap;
+	unsigned	window;
+	/* Shift of the mono mix searched, which keeps its sums in 32 bits. */
+	unsigned	monoShift;
+	uint32_t	fadeStep;
+
+	/* Input frames, interleaved, and their mono mix, up to histLen of the
+	 * histSize that fit. The window of the next segment starts at frame pos,
+	 * and posFrac in Q16 after it. */
+	int16_t*	hist;
+	int16_t*	mono;
+	size_t		histLen;
+	size_t		histSize;
+	size_t		pos;
+	uint32_t	posFrac;
+
+	/* The last overlap frames of the segment before and their mono mix,
+	 * which fade out over the start of the next segment. Not set until the
+	 * first segment is made. */
+	int16_t*	tail;
+	int16_t*	tailMono;
+	bool		hasTail;
+
+	/* Output frames of the last segment, of which outNext have been read.
+	 * They stand for segSource input frames, which follow on from the
+	 * segStart input frames of the segments before. */
+	int16_t*	out;
+	size_t		outLen;
+	size_t		outNext;
+	size_t		segSource;
+	uint64_t	segStart;
+
+	/* Input frames written so far. Once ended is set, the rest of the input
+	 * is made into output and no more can be written. */
+	uint64_t	inPos;
+	bool		ended;
+};
+
+/**
+ * Set up a stretcher, at the speed of the input.
+ *
+ * \param	st			Stretcher to set up.
+ * \param	rate		Sampling rate of the input.
+ * \param	chans		Number of channels, up to STRETCH_CHANNELS_MAX.
+ * \param	maxFrames	Most frames given to each stretchWrite().
+ * \return				0 on success, else failure with errno set.
+ */
+int stretchInit(struct stretcher_t* st, uint32_t rate, unsigned chans,
+		size_t maxFrames);
+
+/**
+ * Free the memory used by a stretcher.
+ *
+ * \param	st	Stretcher set up with stretchInit().
+ */
+void stretchExit(struct stretcher_t* st);
+
+/**
+ * Change the speed of the output, from the next segment made.
+ *
+ * \param	st		Stretcher.
+ * \param	speed	Speed in Q16, from STRETCH_SPEED_MIN to STRETCH_SPEED_MAX.
+ */
+void stretchSetSpeed(struct stretcher_t* st, uint32_t speed);
+
+/**
+ * Drop all frames held by a stretcher and start again, as at the start of the
+ * input. The speed is kept.
+ *
+ * \param	st	Stretcher.
+ */
+void stretchReset(struct stretcher_t* st);
+
+/**
+ * Give input frames to a stretcher. Must only be called once stretchRead() has
+ * made as many output frames as it can, so that there is room for them.
+ *
+ * \param	st		Stretcher.
+ * \param	in		Interleaved input frames.
+ * \param	frames	Number of frames, up to the maxFrames given to
+ *					stretchInit().
+ */
+void stretchWrite(struct stretcher_t* st, const int16_t* in, size_t frames);
+
+/**
+ * Mark the end of the input, so that stretchRead() makes the rest of the
+ * output and then stops.
+ *
+ * \param	st	Stretcher.
+ */
+void stretchFlush(struct stretcher_t* st);
+
+/**
+ * Get the number of input frames that the output read so far stands for.
+ * Once every output frame has been read, this is every input frame.
+ *
+ * \param	st	Stretcher.
+ * \return		Input frames.
+ */
+uint64_t stretchSource(const struct stretcher_t* st);
+
+/**
+ * Make output frames from the input frames written so far.
+ *
+ * \param	st		Stretcher.
+ * \param	out		Interleaved output frames.
+ * \param	frames	Most frames to make.
+ * \return			Frames made. Fewer than frames once the input runs out.
+ */
+size_t stretchRead(struct stretcher_t* st, int16_t* out, size_t frames);
+size_t stretchReadRef(struct stretcher_t* st, int16_t* out, size_t frames);
+
+#endif
@@ -3,4 +3,4 @@
 #include "playback.h"
 
 void setVorbis(struct decoder_fn* decoder);
-int isVorbis(const char* in);
+int probeVorbis(const uint8_t* head, size_t len);
@@ -1,4 +1,14 @@
+#include <stdbool.h>
 #include <stdint.h>
 #include "playback.h"
 
 void setWav(struct decoder_fn* decoder);
+
+/**
+ * Set whether 16-bit PCM is converted by dr_wav like other formats, rather
+ * than read without conversion. Only useful to compare the two. Takes effect
+ * from the next file that is opened.
+ *
+ * \param	convert	true to convert all samples.
+ */
+void setWavConvert(bool convert);
@@ -0,0 +1,480 @@
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "cache.h"
+#include "file.h"
+#include "platform.h"
+#include "playback.h"
+#include "replaygain.h"
+
+#define CACHE_STACK_SIZE	(32 * 1024)
+
+/* Most files waiting to be transcoded. Further files are not added. */
+#define CACHE_QUEUE_MAX		16
+
+/* Size of the WAV header of a transcoded file, without the music file path. */
+#define CACHE_HEADER_SIZE	(12 + 24 + 8 + sizeof(struct cacheHdr_t) + 8)
+
+/**
+ * Private chunk of a transcoded WAV file, placed between the "fmt " and
+ * "data" chunks. Followed by the path of the music file.
+ */
+struct cacheHdr_t
+{
+	int64_t		size;
+	int64_t		mtime;
+
+	/* ReplayGain of the music file, which the WAV file has no tags for. */
+	struct replaygain_t	gain;
+
+	uint32_t	pathLen;
+};
+
+static struct thread_t	cacheThreadInfo;
+static atomic_bool		cacheRunning;
+static atomic_bool		cacheQuit;
+static uint64_t			cacheMax;
+
+/* Signalled when a file is added or the thread must quit. */
+static struct event_t	cacheEvent;
+
+/* Protects the queue and cacheBusy. */
+static struct lock_t	cacheLock;
+static char*			cacheQueue[CACHE_QUEUE_MAX];
+static unsigned			cacheQueued;
+static bool				cacheBusy;
+
+void cachePath(const char* file, const char* ext, char* path, size_t len)
+{
+	/* FNV-1a */
+	uint64_t hash = 0xCBF29CE484222325;
+
+	for(const char* c = file; *c != '\0'; c++)
+	{
+		hash ^= (unsigned char)*c;
+		hash *= 0x100000001B3;
+	}
+
+	snprintf(path, len, "%s/%016llx.%s", CACHE_DIR,
+			(unsigned long long)hash, ext);
+}
+
+void cacheMakeDir(void)
+{
+	char dir[] = CACHE_DIR "/";
+
+	for(char* c = dir + 1; *c != '\0'; c++)
+	{
+		if(*c != '/')
+			continue;
+
+		*c = '\0';
+		mkdir(dir, 0777);
+		*c = '/';
+	}
+}
+
+static void putLe16(unsigned char* p, uint16_t val)
+{
+	p[0] = val & 0xFF;
+	p[1] = val >> 8;
+}
+
+static void putLe32(unsigned char* p, uint32_t val)
+{
+	putLe16(p, val & 0xFFFF);
+	putLe16(p + 2, val >> 16);
+}
+
+bool cacheLookup(const char* file, char* path, size_t len)
+{
+	unsigned char		wav[CACHE_HEADER_SIZE];
+	struct cacheHdr_t	hdr;
+	struct stat			st;
+	char				name[PATH_MAX];
+	FILE*				f;
+	bool				ret = false;
+
+	if(atomic_load(&cacheRunning) == false || stat(file, &st) != 0)
+		return false;
+
+	cachePath(file, "wav", path, len);
+
+	if((f = fileOpen(path, "rb")) == NULL)
+		return false;
+
+	if(fread(wav, 1, sizeof(wav), f) != sizeof(wav) ||
+			memcmp(wav, "RIFF", 4) != 0 ||
+			memcmp(wav + 8, "WAVE", 4) != 0 ||
+			memcmp(wav + 36, "ctrm", 4) != 0)
+		goto out;
+
+	memcpy(&hdr, wav + 44, sizeof(hdr));
+
+	if(hdr.size != (int64_t)st.st_size ||
+			hdr.mtime != (int64_t)st.st_mtime ||
+			hdr.pathLen != strlen(file) || hdr.pathLen >= sizeof(name))
+		goto out;
+
+	/* Two paths may share a hash. */
+	fseek(f, 44 + sizeof(hdr), SEEK_SET);
+	if(fread(name, 1, hdr.pathLen, f) != hdr.pathLen ||
+			memcmp(name, file, hdr.pathLen) != 0)
+		goto out;
+
+	ret = true;
+
+out:
+	fclose(f);
+	return ret;
+}
+
+void cacheReadGain(struct probe_t* probe, struct replaygain_t* gain)
+{
+	unsigned char		chunk[8 + sizeof(struct cacheHdr_t)];
+	struct cacheHdr_t	hdr;
+	int64_t				pos;
+
+	/* Only transcoded files have the chunk. */
+	if(strncmp(probe->file, CACHE_DIR "/", sizeof(CACHE_DIR)) != 0)
+		return;
+
+	pos = probeTell(probe);
+
+	if(probeSeek(probe, 36, SEEK_SET) == 0 &&
+			probeRead(probe, chunk, sizeof(chunk)) == sizeof(chunk) &&
+			memcmp(chunk, "ctrm", 4) == 0)
+	{
+		memcpy(&hdr, chunk + 8, sizeof(hdr));
+		*gain = hdr.gain;
+	}
+
+	probeSeek(probe, pos, SEEK_SET);
+}
+
+/**
+ * Write the WAV header of a transcoded file.
+ *
+ * \param	f		Transcoded file.
+ * \param	hdr		Private chunk, with pathLen set.
+ * \param	file	Music file.
+ * \param	rate	Sampling rate.
+ * \param	chans	Number of channels.
+ * \param	data	Bytes of samples.
+ * \return			0 on success, else failure.
+ */
+static int writeHeader(FILE* f, const struct cacheHdr_t* hdr, const char* file,
+		uint32_t rate, uint8_t chans, uint32_t data)
+{
+	unsigned char wav[CACHE_HEADER_SIZE];
+	/* Chunks must be an even number of bytes long. */
+	uint32_t ctrmSize = sizeof(*hdr) + hdr->pathLen + (hdr->pathLen & 1);
+
+	memcpy(wav, "RIFF", 4);
+	putLe32(wav + 4, sizeof(wav) - 8 + ctrmSize - sizeof(*hdr) + data);
+	memcpy(wav + 8, "WAVEfmt ", 8);
+	putLe32(wav + 16, 16);
+	putLe16(wav + 20, 1);
+	putLe16(wav + 22, chans);
+	putLe32(wav + 24, rate);
+	putLe32(wav + 28, rate * chans * sizeof(int16_t));
+	putLe16(wav + 32, chans * sizeof(int16_t));
+	putLe16(wav + 34, 16);
+	memcpy(wav + 36, "ctrm", 4);
+	putLe32(wav + 40, ctrmSize);
+	memcpy(wav + 44, hdr, sizeof(*hdr));
+
+	if(fseek(f, 0, SEEK_SET) != 0 ||
+			fwrite(wav, 1, 44 + sizeof(*hdr), f) != 44 + sizeof(*hdr) ||
+			fwrite(file, 1, hdr->pathLen, f) != hdr->pathLen ||
+			((hdr->pathLen & 1) && fputc(0, f) == EOF))
+		return -1;
+
+	memcpy(wav, "data", 4);
+	putLe32(wav + 4, data);
+
+	return fwrite(wav, 1, 8, f) == 8 ? 0 : -1;
+}
+
+/**
+ * Remove the oldest transcoded files until there is space for another.
+ *
+ * \param	needed	Size of file to make space for.
+ * \return			true if there is space, else false.
+ */
+static bool makeSpace(uint64_t needed)
+{
+	if(needed > cacheMax)
+		return false;
+
+	for(;;)
+	{
+		char		oldest[PATH_MAX] = "";
+		time_t		oldestTime = 0;
+		uint64_t	used = 0;
+		DIR*		dir;
+		struct dirent*	ent;
+
+		if((dir = opendir(CACHE_DIR)) == NULL)
+			return true;
+
+		while((ent = readdir(dir)) != NULL)
+		{
+			char		path[PATH_MAX];
+			struct stat	st;
+			size_t		len = strlen(ent->d_name);
+
+			/* Only complete transcoded files count. */
+			if(len < 4 || strcmp(ent->d_name + len - 4, ".wav") != 0)
+				continue;
+
+			snprintf(path, sizeof(path), "%s/%s", CACHE_DIR, ent->d_name);
+
+			if(stat(path, &st) != 0)
+				continue;
+
+			used += st.st_size;
+
+			if(oldest[0] == '\0' || st.st_mtime < oldestTime)
+			{
+				snprintf(oldest, sizeof(oldest), "%s", path);
+				oldestTime = st.st_mtime;
+			}
+		}
+
+		closedir(dir);
+
+		if(used + needed <= cacheMax)
+			return true;
+
+		if(oldest[0] == '\0' || remove(oldest) != 0)
+			return false;
+	}
+}
+
+/**
+ * Transcode a file to a 16-bit PCM WAV file in CACHE_DIR. Only types that
+ * take much CPU to decode are transcoded.
+ *
+ * \param	file	Music file.
+ */
+static void transcode(const char* file)
+{
+	struct probe_t*		probe;
+	struct decoder_fn	dec;
+	struct cacheHdr_t	hdr;
+	char				path[PATH_MAX];
+	char				tmp[PATH_MAX + 4];
+	int16_t*			buf = NULL;
+	void*				ctx;
+	FILE*				f = NULL;
+	uint64_t			data = 0;
+	uint64_t			read;
+	uint32_t			rate;
+	uint8_t				chans;
+
+	if(cacheLookup(file, path, sizeof(path)) == true ||
+			(probe = probeOpen(file)) == NULL)
+		return;
+
+	if(probe->decoder == NULL ||
+			(probe->decoder->type != FILE_TYPE_MP3 &&
+			 probe->decoder->type != FILE_TYPE_OPUS &&
+			 probe->decoder->type != FILE_TYPE_VORBIS))
+	{
+		probeClose(probe);
+		return;
+	}
+
+	hdr.size = probe->st.st_size;
+	hdr.mtime = probe->st.st_mtime;
+	hdr.pathLen = strlen(file);
+	cachePath(file, "wav", path, sizeof(path));
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	memset(&dec, 0, sizeof(dec));
+	(*probe->decoder->set)(&dec);
+
+	if((ctx = (*dec.init)(probe)) == NULL)
+	{
+		probeClose(probe);
+		return;
+	}
+
+	rate = (*dec.rate)(ctx);
+	chans = (*dec.channels)(ctx);
+
+	replaygainInit(&hdr.gain);
+	if(dec.getGain != NULL)
+		(*dec.getGain)(ctx, &hdr.gain);
+
+	/* Files of unknown length cannot be given space ahead of time. WAV
+	 * files cannot hold more than 4 GiB. */
+	if(chans < 1 || chans > 2 || dec.getFileSamples == NULL ||
+			(read = (*dec.getFileSamples)(ctx)) == 0 ||
+			read > (UINT32_MAX - PATH_MAX) / sizeof(int16_t) ||
+			makeSpace(read * sizeof(int16_t) + CACHE_HEADER_SIZE +
+				hdr.pathLen) == false)
+		goto out;
+
+	cacheMakeDir();
+
+	if((buf = malloc(dec.buffSize * sizeof(int16_t))) == NULL ||
+			(f = fileOpen(tmp, "wb")) == NULL ||
+			writeHeader(f, &hdr, file, rate, chans, 0) != 0)
+		goto out;
+
+	while(atomic_load(&cacheQuit) == false &&
+			(read = (*dec.decode)(ctx, buf)) > 0)
+	{
+		if(fwrite(buf, sizeof(int16_t), read, f) != read ||
+				data + read * sizeof(int16_t) > UINT32_MAX - PATH_MAX)
+			goto out;
+
+		data += read * sizeof(int16_t);
+	}
+
+	if(atomic_load(&cacheQuit) == true ||
+			writeHeader(f, &hdr, file, rate, chans, data) != 0)
+		goto out;
+
+	/* The copy is only found once it is complete. */
+	if(fclose(f) == 0)
+	{
+		remove(path);
+		rename(tmp, path);
+	}
+
+	f = NULL;
+
+out:
+	if(f != NULL)
+		fclose(f);
+
+	remove(tmp);
+	free(buf);
+	(*dec.exit)(ctx);
+}
+
+/**
+ * Transcoding thread. Transcodes files from the queue, oldest first, until
+ * cacheQuit is set.
+ *
+ * \param	arg	Unused.
+ */
+static void cacheThread(void* arg)
+{
+	(void) arg;
+
+	while(atomic_load(&cacheQuit) == false)
+	{
+		char* file = NULL;
+
+		lockAcquire(&cacheLock);
+
+		if(cacheQueued > 0)
+		{
+			file = cacheQueue[0];
+			memmove(cacheQueue, cacheQueue + 1,
+					--cacheQueued * sizeof(cacheQueue[0]));
+		}
+
+		cacheBusy = file != NULL;
+		lockRelease(&cacheLock);
+
+		if(file == NULL)
+		{
+			eventWait(&cacheEvent);
+			continue;
+		}
+
+		transcode(file);
+		free(file);
+	}
+}
+
+int cacheInit(uint64_t maxBytes, int prio, int core)
+{
+	if(atomic_load(&cacheRunning) == true)
+		return 0;
+
+	cacheMax = maxBytes;
+	lockInit(&cacheLock);
+	eventInit(&cacheEvent);
+	atomic_store(&cacheQuit, false);
+
+	if(platformThreadCreate(&cacheThreadInfo, cacheThread, NULL,
+				CACHE_STACK_SIZE, prio, core) != 0)
+	{
+		eventExit(&cacheEvent);
+		lockExit(&cacheLock);
+		return -1;
+	}
+
+	atomic_store(&cacheRunning, true);
+	return 0;
+}
+
+void cacheExit(void)
+{
+	if(atomic_load(&cacheRunning) == false)
+		return;
+
+	atomic_store(&cacheRunning, false);
+	atomic_store(&cacheQuit, true);
+	eventSignal(&cacheEvent);
+	platformThreadJoin(&cacheThreadInfo);
+
+	while(cacheQueued > 0)
+		free(cacheQueue[--cacheQueued]);
+
+	cacheBusy = false;
+	eventExit(&cacheEvent);
+	lockExit(&cacheLock);
+}
+
+void cacheAdd(const char* file)
+{
+	char* copy;
+
+	if(atomic_load(&cacheRunning) == false)
+		return;
+
+	lockAcquire(&cacheLock);
+
+	for(unsigned i = 0; i < cacheQueued; i++)
+	{
+		if(strcmp(cacheQueue[i], file) == 0)
+		{
+			lockRelease(&cacheLock);
+			return;
+		}
+	}
+
+	if(cacheQueued < CACHE_QUEUE_MAX && (copy = strdup(file)) != NULL)
+		cacheQueue[cacheQueued++] = copy;
+
+	lockRelease(&cacheLock);
+	eventSignal(&cacheEvent);
+}
+
+bool cacheIsIdle(void)
+{
+	bool idle;
+
+	if(atomic_load(&cacheRunning) == false)
+		return true;
+
+	lockAcquire(&cacheLock);
+	idle = cacheQueued == 0 && cacheBusy == false;
+	lockRelease(&cacheLock);
+
+	return idle;
+}
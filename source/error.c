@@ -33,6 +33,14 @@ char* ctrmus_strerror(int err)
 			error = "Unsupported number of channels";
 			break;
 
+		case DECODER_SEEK_FAIL:
+			error = "Unable to seek";
+			break;
+
+		case DECODER_READ_FAIL:
+			error = "Unable to decode file";
+			break;
+
 		default:
 			error = strerror(err);
 			break;
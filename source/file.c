@@ -1,6 +1,9 @@
 #include <errno.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "error.h"
 #include "file.h"
@@ -11,6 +14,106 @@
 #include "wav.h"
 #include "sid.h"
 
+/**
+ * Registered decoders. When probing a file, every signature is checked before
+ * any probe function is called. Probe functions are then called in this
+ * order, so cheaper probes are listed first.
+ */
+static const struct decoder_desc_t decoders[] = {
+	{
+		.name = "WAV",
+		.type = FILE_TYPE_WAV,
+		.magic = (const char* const[]) {
+			"RIFF", "riff", "RIFX", "RF64", "FORM", NULL
+		},
+		.probe = NULL,
+		.set = &setWav
+	},
+	{
+		.name = "SID",
+		.type = FILE_TYPE_SID,
+		.magic = (const char* const[]) { "PSID", "RSID", NULL },
+		.probe = NULL,
+		.set = &setSid
+	},
+	{
+		.name = "FLAC",
+		.type = FILE_TYPE_FLAC,
+		.magic = (const char* const[]) { "fLaC", NULL },
+		.probe = &probeFlac,
+		.set = &setFlac
+	},
+	{
+		.name = "OPUS",
+		.type = FILE_TYPE_OPUS,
+		.magic = NULL,
+		.probe = &probeOpus,
+		.set = &setOpus
+	},
+	{
+		.name = "VORBIS",
+		.type = FILE_TYPE_VORBIS,
+		.magic = NULL,
+		.probe = &probeVorbis,
+		.set = &setVorbis
+	},
+	{
+		.name = "MP3",
+		.type = FILE_TYPE_MP3,
+		.magic = (const char* const[]) { "ID3", NULL },
+		.probe = &probeMp3,
+		.set = &setMp3
+	}
+};
+
+#define DECODERS_NUM	(sizeof(decoders) / sizeof(decoders[0]))
+
+static atomic_ulong		opens;
+static atomic_ulong		reads;
+static atomic_ulong		seeks;
+static _Atomic uint64_t	bytes;
+
+static size_t			readAhead = READ_AHEAD_DEFAULT;
+static size_t			prefetch = PREFETCH_DEFAULT;
+static size_t			memoryBudget = MEMORY_BUDGET_DEFAULT;
+
+/* Memory used by files read whole. */
+static atomic_size_t	memoryUsed;
+
+#if !defined __arm__
+static uint64_t			readDelayMin;
+static uint64_t			readDelayMax;
+#endif
+
+#define IO_STACK_SIZE	(32 * 1024)
+
+/* How long to wait for the I/O thread to finish with a file before checking
+ * again, as another thread may have taken the signal. */
+#define IO_IDLE_WAIT_NS	(1000 * 1000)
+
+static struct thread_t	ioThreadInfo;
+static atomic_bool		ioRunning;
+
+/* Everything below is protected by ioLock. */
+static struct lock_t	ioLock;
+static bool				ioQuit;
+
+/* Signalled when the I/O thread may have work to do. */
+static struct event_t	ioEvent;
+
+/* Signalled when the I/O thread finishes with a file. */
+static struct event_t	ioIdle;
+
+/* Files read ahead by the I/O thread, and the one it is reading now. */
+static struct probe_t*	ioFiles;
+static struct probe_t*	ioCurrent;
+
+/* File to open ahead of time, and the result once opened. */
+static char*			preopenName;
+static bool				preopenWanted;
+static bool				preopenBusy;
+static struct probe_t*	preopened;
+
 /**
  * Obtain file type string from file_types enum.
  *
@@ -19,17 +122,13 @@
  */
 const char* fileToStr(enum file_types ft)
 {
-	static const char *file_types_str[] = {
-		"UNKNOWN",
-		"WAV",
-		"FLAC",
-		"VORBIS",
-		"OPUS",
-		"MP3",
-		"SID"
-	};
+	for(size_t i = 0; i < DECODERS_NUM; i++)
+	{
+		if(decoders[i].type == ft)
+			return decoders[i].name;
+	}
 
-	return file_types_str[ft];
+	return "UNKNOWN";
 }
 
 /**
@@ -40,75 +139,729 @@ const char* fileToStr(enum file_types ft)
  */
 enum file_types getFileType(const char *file)
 {
-	FILE* ftest = fopen(file, "rb");
-	uint32_t fileSig;
+	struct probe_t* probe;
 	enum file_types file_type = FILE_TYPE_ERROR;
 
-	/* Failure opening file */
-	if(ftest == NULL)
+	if((probe = probeOpen(file)) == NULL)
 		return FILE_TYPE_ERROR;
 
-	if(fread(&fileSig, 4, 1, ftest) == 0)
+	if(probe->decoder != NULL)
+		file_type = probe->decoder->type;
+
+	probeClose(probe);
+
+	if(file_type == FILE_TYPE_ERROR)
+		errno = FILE_NOT_SUPPORTED;
+
+	return file_type;
+}
+
+FILE* fileOpen(const char* file, const char* mode)
+{
+	FILE* f;
+
+	if((f = fopen(file, mode)) != NULL)
+		atomic_fetch_add(&opens, 1);
+
+	return f;
+}
+
+unsigned long fileOpens(void)
+{
+	return atomic_load(&opens);
+}
+
+void getIoStats(struct ioStats_t* stats)
+{
+	stats->opens = atomic_load(&opens);
+	stats->reads = atomic_load(&reads);
+	stats->seeks = atomic_load(&seeks);
+	stats->bytes = atomic_load(&bytes);
+}
+
+void setReadAhead(size_t size)
+{
+	if(size < PROBE_SIZE)
+		size = PROBE_SIZE;
+
+	readAhead = (size + IO_ALIGN - 1) & ~(size_t)(IO_ALIGN - 1);
+}
+
+void setPrefetch(size_t size)
+{
+	prefetch = size;
+}
+
+void setMemoryBudget(size_t size)
+{
+	memoryBudget = size;
+}
+
+#if !defined __arm__
+void setReadDelay(uint64_t minNs, uint64_t maxNs)
+{
+	readDelayMin = minNs;
+	readDelayMax = maxNs < minNs ? minNs : maxNs;
+}
+#endif
+
+/**
+ * Find the decoder for the first bytes of a file.
+ *
+ * \param	head	First bytes of file.
+ * \param	len		Number of bytes in head.
+ * \return			Decoder, or NULL if the file is not recognised.
+ */
+static const struct decoder_desc_t* findDecoder(const uint8_t* head,
+		size_t len)
+{
+	const struct decoder_desc_t* found = NULL;
+	int best = 0;
+
+	for(size_t i = 0; i < DECODERS_NUM; i++)
+	{
+		const char* const* magic = decoders[i].magic;
+
+		for(; magic != NULL && *magic != NULL; magic++)
+		{
+			size_t magicLen = strlen(*magic);
+
+			if(len >= magicLen && memcmp(head, *magic, magicLen) == 0)
+				return &decoders[i];
+		}
+	}
+
+	for(size_t i = 0; i < DECODERS_NUM; i++)
+	{
+		int score;
+
+		if(decoders[i].probe == NULL)
+			continue;
+
+		if((score = (*decoders[i].probe)(head, len)) > best)
+		{
+			best = score;
+			found = &decoders[i];
+
+			if(score >= 100)
+				break;
+		}
+	}
+
+	return found;
+}
+
+/**
+ * Read from a file.
+ *
+ * \param	probe	Probed file.
+ * \param	buf		Output.
+ * \param	size	Bytes to read.
+ * \param	offset	Offset in file to read from.
+ * \return			Bytes read.
+ */
+static size_t readAt(struct probe_t* probe, void* buf, size_t size,
+		int64_t offset)
+{
+	size_t done;
+
+#if !defined __arm__
+	if(readDelayMax != 0)
+		platformSleep(readDelayMin +
+				(uint64_t)rand() % (readDelayMax - readDelayMin + 1));
+#endif
+
+	if(probe->fpos != offset)
+	{
+		atomic_fetch_add(&seeks, 1);
+
+		if(fseeko(probe->f, offset, SEEK_SET) != 0)
+			return 0;
+
+		probe->fpos = offset;
+	}
+
+	done = fread(buf, 1, size, probe->f);
+	probe->fpos += done;
+
+	atomic_fetch_add(&reads, 1);
+	atomic_fetch_add(&bytes, done);
+	return done;
+}
+
+/**
+ * Read the next block of a file into its ring. Must be called with the lock
+ * of the file held, which is released whilst reading.
+ *
+ * \param	probe	Probed file with a free block.
+ */
+static void fillBlock(struct probe_t* probe)
+{
+	unsigned slot = (probe->head + probe->count) % probe->blocksNum;
+	struct ioBlock_t* block = &probe->blocks[slot];
+	int64_t pos = probe->fillPos;
+	unsigned gen = probe->gen;
+	size_t len;
+
+	if(probe->whole == true)
+	{
+		size_t size = probe->st.st_size - pos;
+
+		if(size > probe->blockSize)
+			size = probe->blockSize;
+
+		/* Only the bytes before fillPos are read from. */
+		lockRelease(&probe->lock);
+		len = readAt(probe, probe->buf + pos, size, pos);
+		lockAcquire(&probe->lock);
+
+		probe->fillPos += len;
+		probe->count++;
+
+		if(len < size || probe->fillPos >= probe->st.st_size)
+		{
+			probe->eof = true;
+			fclose(probe->f);
+			probe->f = NULL;
+		}
+
+		return;
+	}
+
+	/* The block is not read from until it is counted as filled. */
+	lockRelease(&probe->lock);
+	len = readAt(probe, block->data, probe->blockSize, pos);
+	lockAcquire(&probe->lock);
+
+	if(gen != probe->gen)
+		return;
+
+	block->pos = pos;
+	block->len = len;
+	probe->fillPos += len;
+
+	if(len > 0)
+		probe->count++;
+
+	/* A short read is either the end of the file or an error. */
+	if(len < probe->blockSize)
+		probe->eof = true;
+}
+
+/**
+ * Take memory from the budget to hold a whole file.
+ *
+ * \param	size	Size of file.
+ * \return			true if the file fits in what remains of the budget.
+ */
+static bool reserveMemory(size_t size)
+{
+	size_t used = atomic_load(&memoryUsed);
+
+	do
+	{
+		if(size == 0 || size > memoryBudget || used > memoryBudget - size)
+			return false;
+	} while(atomic_compare_exchange_weak(&memoryUsed, &used,
+				used + size) == false);
+
+	return true;
+}
+
+/**
+ * Open a file and read its first block.
+ *
+ * \param	file	File location.
+ * \param	async	Whether the file will be read ahead by the I/O thread.
+ * \return			Probed file, or NULL on failure with errno set.
+ */
+static struct probe_t* openProbe(const char* file, bool async)
+{
+	struct probe_t* probe;
+	size_t bufSize;
+	int err;
+
+	if((probe = calloc(1, sizeof(struct probe_t))) == NULL)
+		return NULL;
+
+	lockInit(&probe->lock);
+	eventInit(&probe->filled);
+
+	probe->async = async;
+	probe->blockSize = readAhead;
+	probe->blocksNum = 1;
+
+	if(async == true)
+	{
+		probe->blocksNum = prefetch / probe->blockSize;
+
+		/* One block is read from whilst the next is filled. */
+		if(probe->blocksNum < 2)
+			probe->blocksNum = 2;
+		else if(probe->blocksNum > IO_BLOCKS_MAX)
+			probe->blocksNum = IO_BLOCKS_MAX;
+	}
+
+	if((probe->file = strdup(file)) == NULL ||
+			(probe->f = fileOpen(file, "rb")) == NULL)
 		goto err;
 
-	switch(fileSig)
-	{
-		// "RIFF"
-		case 0x46464952:
-		// "riff"
-		case 0x66666972:
-		// "RIFX"
-		case 0x58464952:
-		// "RF64"
-		case 0x34364652:
-		// "FORM"
-		case 0x4D524F46:
-			file_type = FILE_TYPE_WAV;
-			break;
+	/* Reads are already made in large blocks. */
+	setvbuf(probe->f, NULL, _IONBF, 0);
+
+	if(fstat(fileno(probe->f), &probe->st) != 0)
+		goto err;
+
+	probe->whole = reserveMemory(probe->st.st_size);
+	bufSize = probe->blockSize * probe->blocksNum;
+
+	/* Rounded up, as aligned_alloc() needs a multiple of the alignment. */
+	if(probe->whole == true)
+		bufSize = (probe->st.st_size + IO_ALIGN - 1) &
+			~(size_t)(IO_ALIGN - 1);
+
+	if((probe->buf = aligned_alloc(IO_ALIGN, bufSize)) == NULL)
+		goto err;
+
+	for(unsigned i = 0; i < probe->blocksNum && probe->whole == false; i++)
+		probe->blocks[i].data = probe->buf + i * probe->blockSize;
+
+	lockAcquire(&probe->lock);
+	fillBlock(probe);
+	lockRelease(&probe->lock);
+
+	if(probe->f != NULL && ferror(probe->f))
+		goto err;
+
+	/* The first block is at the start of buf either way. */
+	probe->decoder = findDecoder(probe->buf,
+			probe->fillPos < PROBE_SIZE ? probe->fillPos : PROBE_SIZE);
+	return probe;
 
-		// "fLaC"
-		case 0x43614c66:
-			file_type = FILE_TYPE_FLAC;
+err:
+	err = errno;
+	probe->async = false;
+	probeClose(probe);
+	errno = err;
+	return NULL;
+}
+
+/**
+ * Wait for the I/O thread to finish its current step. Must be called with
+ * ioLock held.
+ */
+static void waitIoIdle(void)
+{
+	lockRelease(&ioLock);
+	eventWaitTimeout(&ioIdle, IO_IDLE_WAIT_NS);
+	lockAcquire(&ioLock);
+}
+
+/**
+ * Read ahead of every open file in turn, and open files set with
+ * prefetchFile().
+ */
+static void ioThread(void* arg)
+{
+	(void) arg;
+
+	lockAcquire(&ioLock);
+
+	while(ioQuit == false)
+	{
+		struct probe_t* best = NULL;
+		unsigned bestCount = 0;
+
+		/* The file with the fewest blocks ahead is the most urgent. */
+		for(struct probe_t* probe = ioFiles; probe != NULL;
+				probe = probe->next)
+		{
+			bool needed;
+			unsigned count;
+
+			lockAcquire(&probe->lock);
+			count = probe->count;
+			needed = probe->eof == false &&
+				(count < probe->blocksNum || probe->whole == true);
+			lockRelease(&probe->lock);
+
+			if(needed == true && (best == NULL || count < bestCount))
+			{
+				best = probe;
+				bestCount = count;
+			}
+		}
+
+		/* The next file is opened once open files are well ahead. */
+		if(preopenWanted == true &&
+				(best == NULL || bestCount >= best->blocksNum / 2))
+		{
+			struct probe_t* probe;
+			char* name = strdup(preopenName);
+
+			preopenWanted = false;
+			preopenBusy = true;
+			lockRelease(&ioLock);
+
+			probe = name == NULL ? NULL : openProbe(name, true);
+
+			lockAcquire(&ioLock);
+			preopenBusy = false;
+
+			/* Keep the file only if it is still wanted. */
+			if(probe != NULL && preopenName != NULL &&
+					strcmp(preopenName, name) == 0)
+			{
+				preopened = probe;
+				probe->next = ioFiles;
+				ioFiles = probe;
+				probe = NULL;
+			}
+
+			eventSignal(&ioIdle);
+			lockRelease(&ioLock);
+
+			if(probe != NULL)
+			{
+				probe->async = false;
+				probeClose(probe);
+			}
+
+			free(name);
+			lockAcquire(&ioLock);
+			continue;
+		}
+
+		if(best == NULL)
+		{
+			lockRelease(&ioLock);
+			eventWait(&ioEvent);
+			lockAcquire(&ioLock);
+			continue;
+		}
+
+		ioCurrent = best;
+		lockRelease(&ioLock);
+
+		lockAcquire(&best->lock);
+		if(best->eof == false &&
+				(best->count < best->blocksNum || best->whole == true))
+			fillBlock(best);
+		lockRelease(&best->lock);
+		eventSignal(&best->filled);
+
+		lockAcquire(&ioLock);
+		ioCurrent = NULL;
+		eventSignal(&ioIdle);
+	}
+
+	lockRelease(&ioLock);
+}
+
+int ioInit(int prio, int core)
+{
+	if(atomic_load(&ioRunning) == true)
+		return 0;
+
+	lockInit(&ioLock);
+	eventInit(&ioEvent);
+	eventInit(&ioIdle);
+	ioQuit = false;
+
+	if(platformThreadCreate(&ioThreadInfo, ioThread, NULL, IO_STACK_SIZE,
+				prio, core) != 0)
+	{
+		eventExit(&ioIdle);
+		eventExit(&ioEvent);
+		lockExit(&ioLock);
+		return -1;
+	}
+
+	atomic_store(&ioRunning, true);
+	return 0;
+}
+
+void ioExit(void)
+{
+	if(atomic_load(&ioRunning) == false)
+		return;
+
+	prefetchFile(NULL);
+	atomic_store(&ioRunning, false);
+
+	lockAcquire(&ioLock);
+	ioQuit = true;
+	lockRelease(&ioLock);
+
+	eventSignal(&ioEvent);
+	platformThreadJoin(&ioThreadInfo);
+
+	/* Files still open are read from only when needed from now on. Readers
+	 * waiting on the I/O thread are woken to read for themselves. */
+	for(struct probe_t* probe = ioFiles; probe != NULL; probe = probe->next)
+	{
+		lockAcquire(&probe->lock);
+		probe->async = false;
+		lockRelease(&probe->lock);
+		eventSignal(&probe->filled);
+	}
+
+	ioFiles = NULL;
+	eventExit(&ioIdle);
+	eventExit(&ioEvent);
+	lockExit(&ioLock);
+}
+
+void prefetchFile(const char* file)
+{
+	struct probe_t* old = NULL;
+
+	if(atomic_load(&ioRunning) == false)
+		return;
+
+	lockAcquire(&ioLock);
+
+	/* The file is already being opened. */
+	if(file != NULL && preopenName != NULL && strcmp(file, preopenName) == 0)
+	{
+		lockRelease(&ioLock);
+		return;
+	}
+
+	old = preopened;
+	preopened = NULL;
+	free(preopenName);
+	preopenName = file == NULL ? NULL : strdup(file);
+	preopenWanted = preopenName != NULL;
+	lockRelease(&ioLock);
+
+	probeClose(old);
+	eventSignal(&ioEvent);
+}
+
+/**
+ * Take the file opened by prefetchFile(), if it is the given file.
+ *
+ * \param	file	File location.
+ * \return			Probed file, or NULL if it was not opened ahead of time.
+ */
+static struct probe_t* takePrefetched(const char* file)
+{
+	struct probe_t* probe = NULL;
+
+	lockAcquire(&ioLock);
+
+	if(preopenName == NULL || strcmp(preopenName, file) != 0)
+	{
+		lockRelease(&ioLock);
+		return NULL;
+	}
+
+	while(preopenBusy == true)
+		waitIoIdle();
+
+	probe = preopened;
+	preopened = NULL;
+	free(preopenName);
+	preopenName = NULL;
+	preopenWanted = false;
+
+	lockRelease(&ioLock);
+	return probe;
+}
+
+struct probe_t* probeOpen(const char* file)
+{
+	struct probe_t* probe;
+	bool async = atomic_load(&ioRunning) == true && prefetch != 0;
+
+	if(async == true && (probe = takePrefetched(file)) != NULL)
+		return probe;
+
+	if((probe = openProbe(file, async)) == NULL)
+		return NULL;
+
+	if(async == true)
+	{
+		lockAcquire(&ioLock);
+		probe->next = ioFiles;
+		ioFiles = probe;
+		lockRelease(&ioLock);
+		eventSignal(&ioEvent);
+	}
+
+	return probe;
+}
+
+size_t probeRead(struct probe_t* probe, void* buf, size_t size)
+{
+	uint8_t* out = buf;
+	size_t done = 0;
+
+	lockAcquire(&probe->lock);
+
+	while(done < size)
+	{
+		struct ioBlock_t* block = &probe->blocks[probe->head];
+
+		if(probe->whole == true)
+		{
+			if(probe->pos < probe->fillPos)
+			{
+				size_t len = probe->fillPos - probe->pos;
+
+				if(len > size - done)
+					len = size - done;
+
+				memcpy(out + done, probe->buf + probe->pos, len);
+				probe->pos += len;
+				done += len;
+				continue;
+			}
+
+			if(probe->eof == true)
+				break;
+		}
+		/* Free blocks that have been read past. */
+		else if(probe->count > 0 &&
+				probe->pos >= block->pos + (int64_t)block->len)
+		{
+			probe->head = (probe->head + 1) % probe->blocksNum;
+			probe->count--;
+
+			if(probe->async == true)
+				eventSignal(&ioEvent);
+
+			continue;
+		}
+		else if(probe->count > 0 && probe->pos >= block->pos)
+		{
+			size_t off = probe->pos - block->pos;
+			size_t len = block->len - off;
+
+			if(len > size - done)
+				len = size - done;
+
+			memcpy(out + done, block->data + off, len);
+			probe->pos += len;
+			done += len;
+			continue;
+		}
+		else if(probe->count == 0 && probe->eof == true &&
+				probe->pos >= probe->fillPos)
 			break;
+		/* Start reading ahead from the new position after a seek. */
+		else if(probe->count > 0 || probe->pos < probe->fillPos ||
+				probe->pos >= probe->fillPos + (int64_t)probe->blockSize)
+		{
+			probe->head = 0;
+			probe->count = 0;
+			probe->fillPos = probe->pos & ~(int64_t)(IO_ALIGN - 1);
+			probe->eof = false;
+			probe->gen++;
+		}
 
-		// "OggS"
-		case 0x5367674F:
-			if(isOpus(file) == 0)
-				file_type = FILE_TYPE_OPUS;
-			else if(isFlac(file) == 0)
-				file_type = FILE_TYPE_FLAC;
-			else if(isVorbis(file) == 0)
-				file_type = FILE_TYPE_VORBIS;
-			else
-				errno = FILE_NOT_SUPPORTED;
+		if(probe->async == false)
+		{
+			fillBlock(probe);
+			continue;
+		}
 
+		lockRelease(&probe->lock);
+		eventSignal(&ioEvent);
+		eventWait(&probe->filled);
+		lockAcquire(&probe->lock);
+	}
+
+	/* Blocks of a whole file ahead of the reader, to rank its urgency. */
+	if(probe->whole == true)
+		probe->count = probe->pos < probe->fillPos ?
+			(probe->fillPos - probe->pos) / probe->blockSize : 0;
+
+	lockRelease(&probe->lock);
+	return done;
+}
+
+int probeSeek(struct probe_t* probe, int64_t offset, int whence)
+{
+	switch(whence)
+	{
+		case SEEK_SET:
+			break;
+
+		case SEEK_CUR:
+			offset += probe->pos;
 			break;
-		
-		// "PSID" or "RSID"
-		case 0x44495350:
-		case 0x44495352:
-			file_type = FILE_TYPE_SID;
+
+		case SEEK_END:
+			offset += probe->st.st_size;
 			break;
 
 		default:
-			/*
-			 * MP3 without ID3 tag, ID3v1 tag is at the end of file, or MP3
-			 * with ID3 tag at the beginning  of the file.
-			 */
-			if(isMp3(file) == 0)
+			return -1;
+	}
+
+	if(offset < 0)
+		return -1;
+
+	/* The file is only moved by the next read, if it needs to be. */
+	probe->pos = offset;
+	return 0;
+}
+
+int64_t probeTell(struct probe_t* probe)
+{
+	return probe->pos;
+}
+
+bool oggPacketIs(const uint8_t* head, size_t len, const char* magic,
+		size_t magicLen)
+{
+	size_t packet;
+
+	/* Page header, followed by a table of segment sizes. */
+	if(len < 27 || memcmp(head, "OggS", 4) != 0)
+		return false;
+
+	packet = 27 + head[26];
+
+	return len >= packet + magicLen &&
+		memcmp(head + packet, magic, magicLen) == 0;
+}
+
+void probeClose(struct probe_t* probe)
+{
+	if(probe == NULL)
+		return;
+
+	if(probe->async == true)
+	{
+		lockAcquire(&ioLock);
+
+		for(struct probe_t** p = &ioFiles; *p != NULL; p = &(*p)->next)
+		{
+			if(*p == probe)
 			{
-				file_type = FILE_TYPE_MP3;
+				*p = probe->next;
 				break;
 			}
+		}
 
-			/* TODO: Add this again at some point */
-			//printf("Unknown magic number: %#010x\n.", fileSig);
-			errno = FILE_NOT_SUPPORTED;
-			break;
+		while(ioCurrent == probe)
+			waitIoIdle();
+
+		lockRelease(&ioLock);
 	}
 
-err:
-	fclose(ftest);
-	return file_type;
-}
+	if(probe->f != NULL)
+		fclose(probe->f);
 
+	if(probe->whole == true)
+		atomic_fetch_sub(&memoryUsed, (size_t)probe->st.st_size);
+
+	eventExit(&probe->filled);
+	lockExit(&probe->lock);
+	free(probe->buf);
+	free(probe->file);
+	free(probe);
+}
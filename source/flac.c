@@ -1,18 +1,35 @@
+#include <stdlib.h>
+
 #define DR_FLAC_IMPLEMENTATION
 #include <dr_libs/dr_flac.h>
 
+#include "file.h"
 #include "flac.h"
 #include "playback.h"
 
-static drflac*		pFlac;
 static const size_t	buffSize = 16 * 1024;
 
-static int initFlac(const char* file);
-static uint32_t rateFlac(void);
-static uint8_t channelFlac(void);
-static uint64_t decodeFlac(void* buffer);
-static void exitFlac(void);
-static size_t getFileSamplesFlac(void);
+#if DRFLAC_VERSION_MINOR < 13
+#define DRFLAC_SEEK_CUR	drflac_seek_origin_current
+#endif
+
+struct flac_t
+{
+	drflac*					pFlac;
+	struct probe_t*			probe;
+
+	/* Read from the comments whilst the file is opened. */
+	struct replaygain_t		gain;
+};
+
+static void* initFlac(struct probe_t* probe);
+static uint32_t rateFlac(void* ctx);
+static uint8_t channelFlac(void* ctx);
+static uint64_t decodeFlac(void* ctx, void* buffer);
+static void exitFlac(void* ctx);
+static size_t getFileSamplesFlac(void* ctx);
+static int seekFlac(void* ctx, uint64_t sample);
+static void getGainFlac(void* ctx, struct replaygain_t* gain);
 
 /**
  * Set decoder parameters for flac.
@@ -28,23 +45,98 @@ void setFlac(struct decoder_fn* decoder)
 	decoder->decode = &decodeFlac;
 	decoder->exit = &exitFlac;
 	decoder->getFileSamples = &getFileSamplesFlac;
+	decoder->seek = &seekFlac;
+	decoder->getGain = &getGainFlac;
+}
+
+static size_t onReadFlac(void* user, void* buffer, size_t size)
+{
+	struct flac_t* flac = user;
+
+	return probeRead(flac->probe, buffer, size);
+}
+
+static drflac_bool32 onSeekFlac(void* user, int offset,
+		drflac_seek_origin origin)
+{
+	struct flac_t* flac = user;
+	int whence = SEEK_SET;
+
+	if(origin == DRFLAC_SEEK_CUR)
+		whence = SEEK_CUR;
+#if DRFLAC_VERSION_MINOR >= 13
+	else if(origin == DRFLAC_SEEK_END)
+		whence = SEEK_END;
+#endif
+
+	return probeSeek(flac->probe, offset, whence) == 0;
+}
+
+#if DRFLAC_VERSION_MINOR >= 13
+static drflac_bool32 onTellFlac(void* user, drflac_int64* cursor)
+{
+	struct flac_t* flac = user;
+
+	*cursor = probeTell(flac->probe);
+	return DRFLAC_TRUE;
+}
+#endif
+
+static void onMetaFlac(void* user, drflac_metadata* meta)
+{
+	struct flac_t* flac = user;
+	drflac_vorbis_comment_iterator it;
+	const char* comment;
+	drflac_uint32 len;
+
+	if(meta->type != DRFLAC_METADATA_BLOCK_TYPE_VORBIS_COMMENT)
+		return;
+
+	drflac_init_vorbis_comment_iterator(&it,
+			meta->data.vorbis_comment.commentCount,
+			meta->data.vorbis_comment.pComments);
+
+	while((comment = drflac_next_vorbis_comment(&it, &len)) != NULL)
+		replaygainParse(&flac->gain, comment, len);
 }
 
 /**
  * Initialise Flac decoder.
  *
- * \param	file	Location of flac file to play.
- * \return			0 on success, else failure.
+ * \param	probe	Probed flac file to play. Owned by the decoder on success.
+ * \return			Decoder context, or NULL on failure.
  */
-static int initFlac(const char* file)
+static void* initFlac(struct probe_t* probe)
 {
-	pFlac = drflac_open_file(file, NULL);
+	struct flac_t* flac;
+
+	if((flac = malloc(sizeof(struct flac_t))) == NULL)
+		return NULL;
+
+	flac->probe = probe;
+	replaygainInit(&flac->gain);
 
-	return pFlac == NULL ? -1 : 0;
+#if DRFLAC_VERSION_MINOR >= 13
+	flac->pFlac = drflac_open_with_metadata(&onReadFlac, &onSeekFlac,
+			&onTellFlac, &onMetaFlac, flac, NULL);
+#else
+	flac->pFlac = drflac_open_with_metadata(&onReadFlac, &onSeekFlac,
+			&onMetaFlac, flac, NULL);
+#endif
+
+	if(flac->pFlac == NULL)
+	{
+		free(flac);
+		return NULL;
+	}
+
+	return flac;
 }
 
-static size_t getFileSamplesFlac(void)
+static size_t getFileSamplesFlac(void* ctx)
 {
+	drflac* pFlac = ((struct flac_t*)ctx)->pFlac;
+
 	return pFlac->totalPCMFrameCount * (size_t)pFlac->channels;
 }
 
@@ -53,8 +145,10 @@ static size_t getFileSamplesFlac(void)
  *
  * \return	Sampling rate.
  */
-static uint32_t rateFlac(void)
+static uint32_t rateFlac(void* ctx)
 {
+	drflac* pFlac = ((struct flac_t*)ctx)->pFlac;
+
 	return pFlac->sampleRate;
 }
 
@@ -63,8 +157,10 @@ static uint32_t rateFlac(void)
  *
  * \return	Number of channels for opened file.
  */
-static uint8_t channelFlac(void)
+static uint8_t channelFlac(void* ctx)
 {
+	drflac* pFlac = ((struct flac_t*)ctx)->pFlac;
+
 	return pFlac->channels;
 }
 
@@ -74,8 +170,9 @@ static uint8_t channelFlac(void)
  * \param buffer	Decoded output.
  * \return			Samples read for each channel.
  */
-static uint64_t decodeFlac(void* buffer)
+static uint64_t decodeFlac(void* ctx, void* buffer)
 {
+	drflac* pFlac = ((struct flac_t*)ctx)->pFlac;
 	size_t buffSizeFrames;
 	uint64_t samplesRead;
 
@@ -86,27 +183,51 @@ static uint64_t decodeFlac(void* buffer)
 }
 
 /**
- * Free Flac decoder.
+ * Seek to a sample of open Flac file.
+ *
+ * \param sample	Sample for each channel to seek to.
+ * \return			0 on success, else failure.
  */
-static void exitFlac(void)
+static int seekFlac(void* ctx, uint64_t sample)
 {
-	drflac_close(pFlac);
+	struct flac_t* flac = ctx;
+
+	return drflac_seek_to_pcm_frame(flac->pFlac, sample) ? 0 : -1;
 }
 
 /**
- * Checks if the input file is Flac
+ * Get the ReplayGain of Flac file, read from its comments when it was opened.
  *
- * \param in	Input file.
- * \return		0 if Flac file, else not or failure.
+ * \param gain	ReplayGain to fill in.
  */
-int isFlac(const char* in)
+static void getGainFlac(void* ctx, struct replaygain_t* gain)
 {
-	int err = -1;
-	drflac* pFlac = drflac_open_file(in, NULL);
+	struct flac_t* flac = ctx;
 
-	if(pFlac != NULL)
-		err = 0;
+	*gain = flac->gain;
+}
+
+/**
+ * Free Flac decoder.
+ */
+static void exitFlac(void* ctx)
+{
+	struct flac_t* flac = ctx;
 
-	drflac_close(pFlac);
-	return err;
+	drflac_close(flac->pFlac);
+	probeClose(flac->probe);
+	free(flac);
+}
+
+/**
+ * Score the start of a file as an Ogg Flac file. Native Flac files are found
+ * by their signature.
+ *
+ * \param	head	First bytes of file.
+ * \param	len		Number of bytes in head.
+ * \return			100 if an Ogg Flac file, else 0.
+ */
+int probeFlac(const uint8_t* head, size_t len)
+{
+	return oggPacketIs(head, len, "\x7F" "FLAC", 5) ? 100 : 0;
 }
@@ -16,12 +16,15 @@
 #include <unistd.h>
 
 #include "all.h"
+#include "cache.h"
 #include "error.h"
 #include "file.h"
 #include "main.h"
+#include "platform.h"
 #include "playback.h"
 
-volatile bool runThreads = true;
+/* Most space on the SD card taken by transcoded copies of files. */
+#define CACHE_MAX_BYTES	(256ULL * 1024 * 1024)
 
 /**
  * Prints the current key mappings to stdio.
@@ -31,6 +34,11 @@ static void showControls(void)
 	printf("Button mappings:\n"
 			"Pause: L+R or L+Up\n"
 			"Previous/Next Song: ZL/ZR or L/R\n"
+			"ReplayGain Off/Track/Album: L+Down\n"
+			"Crossfade Off/2s/5s: L+Right\n"
+			"Resampling Low/Medium/High: L+X\n"
+			"Speed 0.75x-2x: L+Y\n"
+			"Transcode cache On/Off: L+A\n"
 			"A: Open File\n"
 			"B: Go up folder\n"
 			"Start: Exit\n"
@@ -38,95 +46,67 @@ static void showControls(void)
 }
 
 /**
- * Allows the playback thread to return any error messages that it may
- * encounter.
+ * Get the path of the file listed after an entry, so that it can be played
+ * straight after the file of that entry.
  *
- * \param	infoIn	Struct containing addresses of the event, the error code,
- *					and an optional error string.
+ * \param	dirList	Directory listing.
+ * \param	entry	Entry number of the current file.
+ * \param	path	Buffer to write the path to.
+ * \param	len		Size of path buffer.
+ * \return			path, or NULL if the next entry is not a file.
  */
-void playbackWatchdog(void* infoIn)
+static const char* getNextFile(const struct dirList_t* dirList, int entry,
+		char* path, size_t len)
 {
-	struct watchdogInfo* info = infoIn;
+	const char* sep = "/";
+	int ret;
 
-	while(runThreads)
-	{
-		svcWaitSynchronization(*info->errInfo->failEvent, U64_MAX);
-		svcClearEvent(*info->errInfo->failEvent);
+	/* Entries after the directories are files. */
+	if(entry + 1 <= dirList->dirNum ||
+			entry + 1 > dirList->dirNum + dirList->fileNum)
+		return NULL;
 
-		if(*info->errInfo->error > 0)
-		{
-			continue;
-			consoleSelect(info->screen);
-			printf("Error %d: %s\n", *info->errInfo->error,
-					ctrmus_strerror(*info->errInfo->error));
-		}
-		else if (*info->errInfo->error == -1)
-		{
-			continue;
-			/* Used to signify that playback has stopped.
-			 * Not technically an error.
-			 */
-			consoleSelect(info->screen);
-			puts("Stopped");
-		}
-	}
+	/* The working directory may have changed by the time the file is opened,
+	 * so an absolute path is required. */
+	if(dirList->currentDir[strlen(dirList->currentDir) - 1] == '/')
+		sep = "";
+
+	ret = snprintf(path, len, "%s%s%s", dirList->currentDir, sep,
+			dirList->files[entry - dirList->dirNum]);
 
-	return;
+	if(ret < 0 || (size_t)ret >= len)
+		return NULL;
+
+	return path;
 }
 
 /**
  * Stop the currently playing file (if there is one) and play another file.
+ * The playback thread keeps running between files.
  *
- * \param	ep_file			File to play.
- * \param	playbackInfo	Information that the playback thread requires to
- *							play file.
+ * \param	ep_file			File to play, or NULL to only stop playback.
+ * \param	next			File to play once ep_file ends, or NULL.
+ * \param	playbackInfo	Information updated by the playback thread.
  */
-static int changeFile(const char* ep_file, struct playbackInfo_t* playbackInfo)
+static int changeFile(const char* ep_file, const char* next,
+		struct playbackInfo_t* playbackInfo)
 {
-	s32 prio;
-	static Thread thread = NULL;
-
-	if(ep_file != NULL && getFileType(ep_file) == FILE_TYPE_ERROR)
+	/* The type of ep_file is checked by the playback thread as it opens it,
+	 * so that it is only opened once. */
+	if(ep_file == NULL)
 	{
-		*playbackInfo->errInfo->error = errno;
-		svcSignalEvent(*playbackInfo->errInfo->failEvent);
-		return -1;
-	}
-
-	/**
-	 * If music is playing, stop it. Only one playback thread should be playing
-	 * at any time.
-	 */
-	if(thread != NULL)
-	{
-		/* Tell the thread to stop playback before we join it */
 		stopPlayback();
-
-		threadJoin(thread, U64_MAX);
-		threadFree(thread);
-		thread = NULL;
+		return 0;
 	}
 
-	/* If file is NULL, then only thread termination was requested. */
-	if(ep_file == NULL || playbackInfo == NULL)
-		return 0;
-	
-	//playbackInfo->file = strdup(ep_file);
-	if (memccpy(playbackInfo->file, ep_file, '\0', sizeof(playbackInfo->file)) == NULL)
+	if(strlen(ep_file) >= sizeof(playbackInfo->file))
 	{
 		puts("Error: File path too long\n");
 		return -1;
 	}
 
-	printf("Playing: %s\n", playbackInfo->file);
-	playbackInfo->samples_total = 0;
-	playbackInfo->samples_played = 0;
-	playbackInfo->samples_per_second = 0;
-
-	svcGetThreadPriority(&prio, CUR_THREAD_HANDLE);
-	thread = threadCreate(playFile, playbackInfo, 32 * 1024, prio - 1, -2, false);
-
-	return 0;
+	printf("Playing: %s\n", ep_file);
+	return playbackPlay(ep_file, next);
 }
 
 static int cmpstringp(const void *p1, const void *p2)
@@ -294,13 +274,14 @@ int main(int argc, char **argv)
 	int			fileMax;
 	int			fileNum = 0;
 	int			from = 0;
-	Thread			watchdogThread;
-	Handle			playbackFailEvent;
-	struct watchdogInfo	watchdogInfoIn;
-	struct errInfo_t	errInfo;
 	struct playbackInfo_t	playbackInfo = { 0 };
-	volatile int		error = 0;
 	struct dirList_t	dirList = { 0 };
+	char			nextPath[PATH_MAX];
+	enum replaygain_mode	gainMode = REPLAYGAIN_TRACK;
+	unsigned		crossfade = 0;
+	enum resample_quality	quality = RESAMPLE_MEDIUM;
+	unsigned		speed = 1;
+	bool			cacheOn;
 
 	/* ignore key release of L/R if L+R or L+down was pressed */
 	bool keyLComboPressed = false;
@@ -318,16 +299,20 @@ int main(int argc, char **argv)
 
 	consoleSelect(&bottomScreen);
 
-	svcCreateEvent(&playbackFailEvent, RESET_ONESHOT);
-	errInfo.error = &error;
-	errInfo.failEvent = &playbackFailEvent;
-
-	watchdogInfoIn.screen = &topScreenLog;
-	watchdogInfoIn.errInfo = &errInfo;
-	watchdogThread = threadCreate(playbackWatchdog,
-			&watchdogInfoIn, 4 * 1024, 0x20, -2, true);
+	if(playbackInit(&playbackInfo) != 0)
+	{
+		err_print("Unable to start playback.");
+		goto err;
+	}
 
-	playbackInfo.errInfo = &errInfo;
+	/**
+	 * Files that take much CPU to decode are transcoded once they have been
+	 * played, using only time that the UI leaves spare.
+	 */
+	cacheOn = cacheInit(CACHE_MAX_BYTES, platformThreadPriority() + 1,
+			-2) == 0;
+	if(cacheOn == false)
+		err_print("Unable to start transcode cache.");
 
 	/* position of parent folder in parent directory */
 	int prevPosition[MAX_DIRECTORIES] = {0};
@@ -364,6 +349,7 @@ int main(int argc, char **argv)
 		u32			kHeld;
 		u32         kUp;
 		static u64	mill = 0;
+		struct playbackEvent_t	event;
 
 		gfxFlushBuffers();
 		gspWaitForVBlank();
@@ -418,6 +404,87 @@ int main(int argc, char **argv)
 				keyLComboPressed = true;
 				continue;
 			}
+
+			/* Change ReplayGain mode, from the next file played */
+			if(kDown & KEY_DOWN)
+			{
+				static const char* modes[] = { "Off", "Track", "Album" };
+
+				gainMode = (gainMode + 1) % 3;
+				setPlaybackGain(gainMode, 0);
+				consoleSelect(&topScreenLog);
+				printf("ReplayGain: %s\n", modes[gainMode]);
+				keyLComboPressed = true;
+				continue;
+			}
+
+			/* Change crossfade length, from the next file played */
+			if(kDown & KEY_RIGHT)
+			{
+				static const unsigned lengths[] = { 0, 2000, 5000 };
+
+				crossfade = (crossfade + 1) % 3;
+				setPlaybackCrossfade(lengths[crossfade]);
+				consoleSelect(&topScreenLog);
+				if(crossfade == 0)
+					puts("Crossfade: Off");
+				else
+					printf("Crossfade: %us\n", lengths[crossfade] / 1000);
+				keyLComboPressed = true;
+				continue;
+			}
+
+			/* Change quality of resampling, from the next file played */
+			if(kDown & KEY_X)
+			{
+				static const char* names[] = { "Low", "Medium", "High" };
+
+				quality = (quality + 1) % 3;
+				setPlaybackRate(0, quality);
+				consoleSelect(&topScreenLog);
+				printf("Resampling: %s\n", names[quality]);
+				keyLComboPressed = true;
+				continue;
+			}
+
+			/* Change speed of playback, keeping the pitch */
+			if(kDown & KEY_Y)
+			{
+				static const unsigned speeds[] = {
+					75, 100, 125, 150, 175, 200
+				};
+
+				speed = (speed + 1) % 6;
+				setPlaybackSpeed(speeds[speed]);
+				consoleSelect(&topScreenLog);
+				printf("Speed: %u.%02ux\n", speeds[speed] / 100,
+						speeds[speed] % 100);
+				keyLComboPressed = true;
+				continue;
+			}
+
+			/* Turn transcoding of played files, and use of the copies, on or
+			 * off. */
+			if(kDown & KEY_A)
+			{
+				consoleSelect(&topScreenLog);
+				if(cacheOn == true)
+				{
+					cacheExit();
+					cacheOn = false;
+					puts("Transcode cache: Off");
+				}
+				else if(cacheInit(CACHE_MAX_BYTES,
+							platformThreadPriority() + 1, -2) == 0)
+				{
+					cacheOn = true;
+					puts("Transcode cache: On");
+				}
+				else
+					puts("Unable to start transcode cache.");
+				keyLComboPressed = true;
+				continue;
+			}
 		}
 		// if R is pressed first
 		if ((kHeld & KEY_R) && (kDown & KEY_L))
@@ -574,8 +641,9 @@ int main(int argc, char **argv)
 				consoleSelect(&topScreenLog);
 				//consoleClear();
 
-				changeFile(dirList.files[fileNum - dirList.dirNum - 1], &playbackInfo);
-				error = 0;
+				changeFile(dirList.files[fileNum - dirList.dirNum - 1],
+					getNextFile(&dirList, fileNum, nextPath, sizeof(nextPath)),
+					&playbackInfo);
 				continue;
 			}
 		}
@@ -599,8 +667,9 @@ int main(int argc, char **argv)
 			consoleClear();
 			consoleSelect(&topScreenLog);
 			//consoleClear();
-			changeFile(dirList.files[fileNum - dirList.dirNum - 1], &playbackInfo);
-			error = 0;
+			changeFile(dirList.files[fileNum - dirList.dirNum - 1],
+				getNextFile(&dirList, fileNum, nextPath, sizeof(nextPath)),
+				&playbackInfo);
 			consoleSelect(&bottomScreen);
 			if(listDir(from, MAX_LIST, fileNum, dirList) < 0) err_print("Unable to list directory.");
 			continue;
@@ -623,48 +692,87 @@ int main(int argc, char **argv)
 			consoleClear();
 			consoleSelect(&topScreenLog);
 			//consoleClear();
-			changeFile(dirList.files[fileNum - dirList.dirNum - 1], &playbackInfo);
-			error = 0;
+			changeFile(dirList.files[fileNum - dirList.dirNum - 1],
+				getNextFile(&dirList, fileNum, nextPath, sizeof(nextPath)),
+				&playbackInfo);
 			consoleSelect(&bottomScreen);
 			if(listDir(from, MAX_LIST, fileNum, dirList) < 0) err_print("Unable to list directory.");
 			continue;
 		}
 
-		// play next song automatically
-		if (error == -1) {
-			// don't try to play folders
-			if (fileNum >= fileMax || dirList.dirNum >= fileNum) {
-				error = 0;
-				continue;
+		/* Act on what the playback thread reported since the last frame. */
+		while(playbackGetEvent(&event) == true)
+		{
+			switch(event.type)
+			{
+				case PLAYBACK_EVENT_NEXT_TRACK:
+					/* Playback carried on into the next file without
+					 * stopping. */
+					if (fileNum < fileMax && dirList.dirNum < fileNum)
+						fileNum += 1;
+					consoleSelect(&topScreenInfo);
+					consoleClear();
+					consoleSelect(&topScreenLog);
+					printf("Playing: %s\n", playbackInfo.file);
+					setNextFile(getNextFile(&dirList, fileNum, nextPath,
+								sizeof(nextPath)));
+					consoleSelect(&bottomScreen);
+					if(listDir(from, MAX_LIST, fileNum, dirList) < 0) err_print("Unable to list directory.");
+					break;
+
+				case PLAYBACK_EVENT_ERROR:
+					consoleSelect(&topScreenLog);
+					printf("Error %d: %s\n", event.error,
+							ctrmus_strerror(event.error));
+					break;
+
+#ifdef DEBUG
+				case PLAYBACK_EVENT_UNDERRUN:
+					consoleSelect(&topScreenLog);
+					puts("Underrun");
+					break;
+#endif
+
+				case PLAYBACK_EVENT_STOPPED:
+					// play next song automatically, but don't try to play folders
+					if (fileNum >= fileMax || dirList.dirNum >= fileNum)
+						break;
+					fileNum += 1;
+					consoleSelect(&topScreenInfo);
+					consoleClear();
+					consoleSelect(&topScreenLog);
+					//consoleClear();
+					changeFile(dirList.files[fileNum - dirList.dirNum - 1],
+						getNextFile(&dirList, fileNum, nextPath, sizeof(nextPath)),
+						&playbackInfo);
+					consoleSelect(&bottomScreen);
+					if(listDir(from, MAX_LIST, fileNum, dirList) < 0) err_print("Unable to list directory.");
+					break;
+
+				default:
+					break;
 			}
-			fileNum += 1;
-			consoleSelect(&topScreenInfo);
-			consoleClear();
-			consoleSelect(&topScreenLog);
-			//consoleClear();
-			changeFile(dirList.files[fileNum - dirList.dirNum - 1], &playbackInfo);
-			error = 0;
-			consoleSelect(&bottomScreen);
-			if(listDir(from, MAX_LIST, fileNum, dirList) < 0) err_print("Unable to list directory.");
-			continue;
 		}
 
 		/* After 1000ms, update playback time. */
 		while(osGetTime() - mill > 1000)
 		{
+			struct playbackPosition_t pos;
+
 			consoleSelect(&topScreenInfo);
 			/* Reset cursor position and print status. */
 			printf("\033[0;0H");
+			playbackGetPosition(&pos);
 
 			/* Avoid divide by zero. */
-			if(playbackInfo.samples_per_second == 0)
+			if(pos.samples_per_second == 0)
 				break;
 
 			{
 				unsigned hr, min, sec;
 				size_t seconds_played;
 
-				seconds_played = playbackInfo.samples_played / playbackInfo.samples_per_second; 
+				seconds_played = pos.samples_played / pos.samples_per_second; 
 
 				hr = (seconds_played/3600); 
 				min = (seconds_played - (3600*hr))/60;
@@ -673,12 +781,12 @@ int main(int argc, char **argv)
 				printf("%02d:%02d:%02d", hr, min, sec);
 			}
 
-			if(playbackInfo.samples_total != 0)
+			if(pos.samples_total != 0)
 			{
 				unsigned hr, min, sec;
 				size_t seconds_total;
 
-				seconds_total = playbackInfo.samples_total / playbackInfo.samples_per_second; 
+				seconds_total = pos.samples_total / pos.samples_per_second; 
 
 				hr = (seconds_total/3600); 
 				min = (seconds_total - (3600*hr))/60;
@@ -687,15 +795,25 @@ int main(int argc, char **argv)
 				printf(" %02d:%02d:%02d", hr, min, sec);
 			}
 
+#ifdef DEBUG
+			printf(" Buf: %u/%u (min %u) Wake: %zu Start: %llums "
+					"Opens: %u  ",
+					playbackInfo.buffers_queued,
+					playbackInfo.buffers_total,
+					playbackInfo.buffers_min_queued,
+					playbackInfo.wakeups,
+					playbackInfo.switch_ns / 1000000,
+					playbackInfo.file_opens);
+#endif
+
 			break;
 		}
 	}
 
 out:
 	puts("Exiting...");
-	runThreads = false;
-	svcSignalEvent(playbackFailEvent);
-	changeFile(NULL, &playbackInfo);
+	cacheExit();
+	playbackExit();
 
 	gfxExit();
 	return 0;
@@ -1,22 +1,59 @@
+#include <limits.h>
+#include <math.h>
 #include <mpg123.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "cache.h"
+#include "file.h"
 #include "mp3.h"
 #include "playback.h"
 
-static size_t*			buffSize;
-static mpg123_handle	*mh = NULL;
-static uint32_t			rate;
-static uint8_t			channels;
+/* Samples in the largest output of 16 MPEG frames. */
+#define MP3_BUFF_SIZE	(16 * 1152 * 2)
 
-static int initMp3(const char* file);
-static uint32_t rateMp3(void);
-static uint8_t channelMp3(void);
-static uint64_t decodeMp3(void* buffer);
-static void exitMp3(void);
-static size_t getFileSamplesMp3(void);
+#define MP3_INDEX_MAGIC		0x31494D43	/* "CMI1" */
+
+struct mp3_t
+{
+	mpg123_handle*	mh;
+	uint32_t		rate;
+	uint8_t			channels;
+
+	/* Samples for each channel, or -1 until the file has been indexed. */
+	off_t			length;
+
+	/* Location of saved frame index. */
+	char			index[PATH_MAX];
+	struct probe_t*	probe;
+};
+
+/**
+ * Header of a saved frame index. Followed by the path of the MP3 file, and
+ * then by fill offsets of step frames apart.
+ */
+struct mp3Index_t
+{
+	uint32_t		magic;
+	uint32_t		pathLen;
+	int64_t			size;
+	int64_t			mtime;
+	int64_t			length;
+	int64_t			step;
+	uint64_t		fill;
+};
+
+static void* initMp3(struct probe_t* probe);
+static uint32_t rateMp3(void* ctx);
+static uint8_t channelMp3(void* ctx);
+static uint64_t decodeMp3(void* ctx, void* buffer);
+static void exitMp3(void* ctx);
+static size_t getFileSamplesMp3(void* ctx);
+static int seekMp3(void* ctx, uint64_t sample);
+static void getGainMp3(void* ctx, struct replaygain_t* gain);
+static int loadIndexMp3(struct mp3_t* mp3);
+static void saveIndexMp3(struct mp3_t* mp3);
 
 /**
  * Set decoder parameters for MP3.
@@ -28,66 +65,220 @@ void setMp3(struct decoder_fn* decoder)
 	decoder->init = &initMp3;
 	decoder->rate = &rateMp3;
 	decoder->channels = &channelMp3;
-	/*
-	 * buffSize changes depending on input file. So we set buffSize later when
-	 * decoder is initialised.
-	 */
-	buffSize = &(decoder->buffSize);
+	decoder->buffSize = MP3_BUFF_SIZE;
 	decoder->decode = &decodeMp3;
 	decoder->exit = &exitMp3;
 	decoder->getFileSamples = &getFileSamplesMp3;
+	decoder->seek = &seekMp3;
+	decoder->getGain = &getGainMp3;
 }
 
-static size_t getFileSamplesMp3(void)
+/**
+ * Get number of samples in MP3 file. The length is exact once the file has
+ * been indexed. Until then it is estimated, as scanning the whole file would
+ * hold up the start of playback.
+ *
+ * \return	Samples for all channels, or 0 if unknown.
+ */
+static size_t getFileSamplesMp3(void* ctx)
 {
-	off_t len = mpg123_length(mh);
-	if(len == MPG123_ERR)
+	struct mp3_t* mp3 = ctx;
+	off_t length = mp3->length;
+
+	if(length < 0 && (length = mpg123_length(mp3->mh)) < 0)
 		return 0;
-	
-	return len * (size_t)channels;
+
+	return length * (size_t)mp3->channels;
+}
+
+/**
+ * Load the saved frame index of the open file into mpg123. The index is only
+ * used if the file has not changed since it was saved.
+ *
+ * \param	mp3		Context with index and probe set.
+ * \return			0 on success, else no usable index was found.
+ */
+static int loadIndexMp3(struct mp3_t* mp3)
+{
+	struct probe_t*		probe = mp3->probe;
+	struct mp3Index_t	hdr;
+	char				path[PATH_MAX];
+	off_t*				offsets = NULL;
+	FILE*				f;
+	int					ret = -1;
+
+	if((f = fileOpen(mp3->index, "rb")) == NULL)
+		return -1;
+
+	if(fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+			hdr.magic != MP3_INDEX_MAGIC ||
+			hdr.size != (int64_t)probe->st.st_size ||
+			hdr.mtime != (int64_t)probe->st.st_mtime ||
+			hdr.pathLen != strlen(probe->file) ||
+			hdr.fill == 0 || hdr.fill > SIZE_MAX / sizeof(off_t))
+		goto out;
+
+	/* Two paths may share a hash. */
+	if(fread(path, 1, hdr.pathLen, f) != hdr.pathLen ||
+			memcmp(path, probe->file, hdr.pathLen) != 0)
+		goto out;
+
+	if((offsets = malloc(hdr.fill * sizeof(off_t))) == NULL)
+		goto out;
+
+	for(uint64_t i = 0; i < hdr.fill; i++)
+	{
+		int64_t offset;
+
+		if(fread(&offset, sizeof(offset), 1, f) != 1)
+			goto out;
+
+		offsets[i] = offset;
+	}
+
+	/* mpg123 copies the index. */
+	if(mpg123_set_index(mp3->mh, offsets, hdr.step, hdr.fill) != MPG123_OK)
+		goto out;
+
+	mp3->length = hdr.length;
+	ret = 0;
+
+out:
+	free(offsets);
+	fclose(f);
+	return ret;
+}
+
+/**
+ * Save the frame index of the open file, once it has been read to the end.
+ * Failure to save is not an error; the file will be indexed again next time
+ * that it is played through.
+ *
+ * \param	mp3		Context with length set.
+ */
+static void saveIndexMp3(struct mp3_t* mp3)
+{
+	struct probe_t*		probe = mp3->probe;
+	struct mp3Index_t	hdr;
+	off_t*				offsets;
+	off_t				step;
+	size_t				fill;
+	FILE*				f;
+
+	if(mpg123_index(mp3->mh, &offsets, &step, &fill) != MPG123_OK ||
+			fill == 0)
+		return;
+
+	cacheMakeDir();
+
+	if((f = fileOpen(mp3->index, "wb")) == NULL)
+		return;
+
+	hdr.magic = MP3_INDEX_MAGIC;
+	hdr.pathLen = strlen(probe->file);
+	hdr.size = probe->st.st_size;
+	hdr.mtime = probe->st.st_mtime;
+	hdr.length = mp3->length;
+	hdr.step = step;
+	hdr.fill = fill;
+
+	if(fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+			fwrite(probe->file, 1, hdr.pathLen, f) != hdr.pathLen)
+		goto err;
+
+	for(size_t i = 0; i < fill; i++)
+	{
+		int64_t offset = offsets[i];
+
+		if(fwrite(&offset, sizeof(offset), 1, f) != 1)
+			goto err;
+	}
+
+	if(fclose(f) != 0)
+		remove(mp3->index);
+
+	return;
+
+err:
+	fclose(f);
+	remove(mp3->index);
+}
+
+static ssize_t onReadMp3(void* handle, void* buffer, size_t size)
+{
+	return probeRead(handle, buffer, size);
+}
+
+static off_t onSeekMp3(void* handle, off_t offset, int whence)
+{
+	if(probeSeek(handle, offset, whence) != 0)
+		return -1;
+
+	return probeTell(handle);
 }
 
 /**
  * Initialise MP3 decoder.
  *
- * \param	file	Location of MP3 file to play.
- * \return			0 on success, else failure.
+ * \param	probe	Probed MP3 file to play. Owned by the decoder on success.
+ * \return			Decoder context, or NULL on failure.
  */
-int initMp3(const char* file)
+static void* initMp3(struct probe_t* probe)
 {
+	struct mp3_t* mp3;
 	int err = 0;
 	int encoding = 0;
+	long rate;
+	int channels;
+
+	/* Only needed by old versions of mpg123, and safe to call again. */
+	if(mpg123_init() != MPG123_OK)
+		return NULL;
 
-	if((err = mpg123_init()) != MPG123_OK)
-		return err;
+	if((mp3 = calloc(1, sizeof(struct mp3_t))) == NULL)
+		return NULL;
 
-	if((mh = mpg123_new(NULL, &err)) == NULL)
+	mp3->length = -1;
+
+	if((mp3->mh = mpg123_new(NULL, &err)) == NULL)
 	{
 		printf("Error: %s\n", mpg123_plain_strerror(err));
-		return err;
+		goto err;
 	}
 
-	if(mpg123_open(mh, file) != MPG123_OK ||
-			mpg123_getformat(mh, (long *) &rate, (int *) &channels, &encoding) != MPG123_OK)
+	/* The probe is closed by exitMp3(), so there is no cleanup function. */
+	if(mpg123_replace_reader_handle(mp3->mh, &onReadMp3, &onSeekMp3,
+				NULL) != MPG123_OK ||
+			mpg123_open_handle(mp3->mh, probe) != MPG123_OK ||
+			mpg123_getformat(mp3->mh, &rate, &channels, &encoding) != MPG123_OK)
 	{
-		printf("Trouble with mpg123: %s\n", mpg123_strerror(mh));
-		return -1;
+		printf("Trouble with mpg123: %s\n", mpg123_strerror(mp3->mh));
+		goto err;
 	}
 
+	mp3->rate = rate;
+	mp3->channels = channels;
+
 	/*
-	 * Ensure that this output format will not change (it might, when we allow
-	 * it).
+	 * A saved index gives an exact length and fast seeks without scanning
+	 * the whole file.
 	 */
-	mpg123_format_none(mh);
-	mpg123_format(mh, rate, channels, encoding);
+	mp3->probe = probe;
+	cachePath(probe->file, "idx", mp3->index, sizeof(mp3->index));
+	loadIndexMp3(mp3);
 
 	/*
-	 * Buffer could be almost any size here, mpg123_outblock() is just some
-	 * recommendation. The size should be a multiple of the PCM frame size.
+	 * Ensure that this output format will not change (it might, when we allow
+	 * it).
 	 */
-	*buffSize = mpg123_outblock(mh) * 16;
+	mpg123_format_none(mp3->mh);
+	mpg123_format(mp3->mh, rate, channels, encoding);
 
-	return 0;
+	return mp3;
+
+err:
+	exitMp3(mp3);
+	return NULL;
 }
 
 /**
@@ -95,9 +286,11 @@ int initMp3(const char* file)
  *
  * \return	Sampling rate.
  */
-uint32_t rateMp3(void)
+static uint32_t rateMp3(void* ctx)
 {
-	return rate;
+	struct mp3_t* mp3 = ctx;
+
+	return mp3->rate;
 }
 
 /**
@@ -105,9 +298,11 @@ uint32_t rateMp3(void)
  *
  * \return	Number of channels for opened file.
  */
-uint8_t channelMp3(void)
+static uint8_t channelMp3(void* ctx)
 {
-	return channels;
+	struct mp3_t* mp3 = ctx;
+
+	return mp3->channels;
 }
 
 /**
@@ -116,109 +311,121 @@ uint8_t channelMp3(void)
  * \param buffer	Decoded output.
  * \return			Samples read for each channel.
  */
-uint64_t decodeMp3(void* buffer)
+static uint64_t decodeMp3(void* ctx, void* buffer)
 {
+	struct mp3_t* mp3 = ctx;
 	size_t done = 0;
-	mpg123_read(mh, buffer, *buffSize, &done);
+
+	/* mpg123 indexes each frame that it reads, and seeks read every frame
+	 * that they pass over, so the index is complete at the end of the file.
+	 * This is reached in the decoder thread, after playback has started. */
+	if(mpg123_read(mp3->mh, buffer, MP3_BUFF_SIZE * sizeof(int16_t),
+				&done) == MPG123_DONE && mp3->length < 0 &&
+			(mp3->length = mpg123_tell(mp3->mh)) >= 0)
+		saveIndexMp3(mp3);
+
 	return done / (sizeof(int16_t));
 }
 
 /**
- * Free MP3 decoder.
+ * Seek to a sample of open MP3 file. mpg123 decodes from a few frames before
+ * the sample so that the result is sample accurate.
+ *
+ * \param sample	Sample for each channel to seek to.
+ * \return			0 on success, else failure.
  */
-void exitMp3(void)
+static int seekMp3(void* ctx, uint64_t sample)
 {
-	mpg123_close(mh);
-	mpg123_delete(mh);
-	mpg123_exit();
+	struct mp3_t* mp3 = ctx;
+
+	return mpg123_seek(mp3->mh, sample, SEEK_SET) < 0 ? -1 : 0;
 }
 
 /**
- * Check if a file is a valid MP3 file.
- * 
- * \param path	Path to the MP3 file.
- * \return		0 if valid MP3, 1 if not valid.
+ * Read the ReplayGain of MP3 file from its ID3v2 TXXX frames, or else from the
+ * RVA2 frames or LAME header that mpg123 reads.
+ *
+ * \param gain	ReplayGain to fill in.
  */
-int isMp3(const char *path)
+static void getGainMp3(void* ctx, struct replaygain_t* gain)
 {
-#if 0
-	int err;
-	int result = 1;
-	mpg123_handle *mh = NULL;
-	long rate;
-	int channels, encoding;
+	struct mp3_t* mp3 = ctx;
+	mpg123_id3v2* v2 = NULL;
+	double db;
 
-	// Initialise the library
-	if (mpg123_init() != MPG123_OK)
-		goto out;
+	if(mpg123_id3(mp3->mh, NULL, &v2) == MPG123_OK && v2 != NULL)
+	{
+		for(size_t i = 0; i < v2->extras; i++)
+		{
+			const mpg123_text* txxx = &v2->extra[i];
+			char tag[128];
+			int len;
 
-	// Create a decoder handle
-	mh = mpg123_new(NULL, &err);
-	if (!mh)
-		goto exit_init;
+			if(txxx->description.p == NULL || txxx->text.p == NULL)
+				continue;
 
-	// skip ID3v2 tags rather than parsing them (so tag-only files don’t count as valid mp3)
-	mpg123_param(mh, MPG123_SKIP_ID3V2, 1, 0);
+			len = snprintf(tag, sizeof(tag), "%s=%s", txxx->description.p,
+					txxx->text.p);
 
-	// limit how many bytes to scan for a frame sync (e.g. 2048 bytes)
-	mpg123_param(mh, MPG123_RESYNC_LIMIT, 2048, 0);
+			if(len > 0 && (size_t)len < sizeof(tag))
+				replaygainParse(gain, tag, len);
+		}
+	}
 
-	// Try opening the file
-	err = mpg123_open(mh, path);
-	if (err != MPG123_OK)
-		goto exit_handle;
+	/*
+	 * mpg123 only gives the gains it has read whilst it is set to apply them
+	 * itself, so it is only set to do so until they are read. Gains are given
+	 * as 0 dB where there are none.
+	 */
+	if(gain->track == REPLAYGAIN_UNKNOWN &&
+			mpg123_param(mp3->mh, MPG123_RVA, MPG123_RVA_MIX, 0) == MPG123_OK &&
+			mpg123_getvolume(mp3->mh, NULL, NULL, &db) == MPG123_OK &&
+			db != 0)
+		gain->track = lrint(db * 100);
+
+	if(gain->album == REPLAYGAIN_UNKNOWN &&
+			mpg123_param(mp3->mh, MPG123_RVA, MPG123_RVA_ALBUM, 0) == MPG123_OK &&
+			mpg123_getvolume(mp3->mh, NULL, NULL, &db) == MPG123_OK &&
+			db != 0)
+		gain->album = lrint(db * 100);
+
+	mpg123_param(mp3->mh, MPG123_RVA, MPG123_RVA_OFF, 0);
+}
 
-	// Query the decoded format
-	if (mpg123_getformat(mh, &rate, &channels, &encoding) != MPG123_OK)
-		goto close_handle;
+/**
+ * Free MP3 decoder. mpg123_exit() is not called, as other files may still be
+ * open.
+ */
+static void exitMp3(void* ctx)
+{
+	struct mp3_t* mp3 = ctx;
 
-	// Parse first frame in file
-	err = mpg123_framebyframe_next(mh);
-	if (err != MPG123_OK)
+	if(mp3->mh != NULL)
 	{
-		// If we can't read the first frame, it's not a valid MP3
-		goto close_handle;
+		mpg123_close(mp3->mh);
+		mpg123_delete(mp3->mh);
 	}
 
-	// All checks passed: valid MP3
-	result = 0;
-
-close_handle:
-	mpg123_close(mh);
-
-exit_handle:
-	mpg123_delete(mh);
-
-exit_init:
-	mpg123_exit();
-
-out:
-	return result;
-#else
-    unsigned char buf[4];
-	FILE *f = fopen(path, "rb");
-	int ret = 1;
-
-	if(!f) return 1;
-
-    if(fread(buf, 1, 4, f) < 4)
-		goto out;
+	probeClose(mp3->probe);
+	free(mp3);
+}
 
-    // ID3v2 tag?
-    if(buf[0]=='I' && buf[1]=='D' && buf[2]=='3') {
-		ret = 0;
-		goto out;
-	}
+/**
+ * Score the start of an MP3 file without an ID3v2 tag. A frame sync may also
+ * be found at the start of other files, so is not certain.
+ *
+ * \param	head	First bytes of file.
+ * \param	len		Number of bytes in head.
+ * \return			50 if a frame sync, else 0.
+ */
+int probeMp3(const uint8_t* head, size_t len)
+{
+	if(len < 2)
+		return 0;
 
-    // MPEG frame sync: 11 one-bits in a row
-    if(buf[0]==0xFF && (buf[1]&0xE0)==0xE0) {
-		ret = 0;
-		goto out;
-	}
+	/* MPEG frame sync: 11 one-bits in a row */
+	if(head[0] == 0xFF && (head[1] & 0xE0) == 0xE0)
+		return 50;
 
-out:
-	fclose(f);
-    return ret;
-#endif
+	return 0;
 }
-
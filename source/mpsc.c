@@ -0,0 +1,119 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mpsc.h"
+
+/**
+ * Initialise queue.
+ *
+ * \param	q			Queue to initialise.
+ * \param	capacity	Minimum number of elements the queue must hold.
+ * \param	elemSize	Size of each element in bytes.
+ * \return				0 on success, else failure with errno set.
+ */
+int mpscInit(struct mpsc_t* q, size_t capacity, size_t elemSize)
+{
+	size_t slots = 2;
+
+	/* Round up to a power of two so that indexes may be masked. At least two
+	 * slots are needed to tell a filled slot from an emptied one. */
+	while(slots < capacity)
+		slots <<= 1;
+
+	if((q->data = malloc(slots * elemSize)) == NULL ||
+			(q->seqs = malloc(slots * sizeof(atomic_size_t))) == NULL)
+	{
+		free(q->data);
+		q->data = NULL;
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for(size_t i = 0; i < slots; i++)
+		atomic_init(&q->seqs[i], i);
+
+	q->elemSize = elemSize;
+	q->mask = slots - 1;
+	q->head = 0;
+	atomic_init(&q->tail, 0);
+
+	return 0;
+}
+
+/**
+ * Free queue memory. No thread may be using the queue.
+ */
+void mpscExit(struct mpsc_t* q)
+{
+	free(q->seqs);
+	free(q->data);
+	q->seqs = NULL;
+	q->data = NULL;
+}
+
+/**
+ * Add an element to the queue. May be called by any thread.
+ *
+ * \param	q		Queue.
+ * \param	elem	Element to copy into queue.
+ * \return			false if the queue is full, else true.
+ */
+bool mpscPush(struct mpsc_t* q, const void* elem)
+{
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	atomic_size_t* seq;
+
+	while(true)
+	{
+		ptrdiff_t diff;
+
+		/* Compared as a difference, so that indexes may wrap around. */
+		seq = &q->seqs[tail & q->mask];
+		diff = (ptrdiff_t)(atomic_load_explicit(seq, memory_order_acquire) -
+				tail);
+
+		/* The slot has not been emptied since the last time round. */
+		if(diff < 0)
+			return false;
+
+		/* Another producer claimed the slot first. */
+		if(diff > 0)
+		{
+			tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+			continue;
+		}
+
+		if(atomic_compare_exchange_weak_explicit(&q->tail, &tail, tail + 1,
+					memory_order_relaxed, memory_order_relaxed) == true)
+			break;
+	}
+
+	memcpy(q->data + (tail & q->mask) * q->elemSize, elem, q->elemSize);
+	atomic_store_explicit(seq, tail + 1, memory_order_release);
+
+	return true;
+}
+
+/**
+ * Remove the oldest element from the queue. Must only be called by the
+ * consumer.
+ *
+ * \param	q		Queue.
+ * \param	elem	Location to copy element to.
+ * \return			false if the queue is empty, else true.
+ */
+bool mpscPop(struct mpsc_t* q, void* elem)
+{
+	atomic_size_t* seq = &q->seqs[q->head & q->mask];
+
+	/* Empty, or the producer that claimed the slot is still copying in. */
+	if(atomic_load_explicit(seq, memory_order_acquire) != q->head + 1)
+		return false;
+
+	memcpy(elem, q->data + (q->head & q->mask) * q->elemSize, q->elemSize);
+	atomic_store_explicit(seq, q->head + q->mask + 1, memory_order_release);
+	q->head++;
+
+	return true;
+}
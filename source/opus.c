@@ -1,20 +1,38 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "file.h"
 #include "opus.h"
 #include "playback.h"
 
-static OggOpusFile*		opusFile;
-static const OpusHead*	opusHead;
 static const size_t		buffSize = 32 * 1024;
 
-static int initOpus(const char* file);
-static uint32_t rateOpus(void);
-static uint8_t channelOpus(void);
-static uint64_t decodeOpus(void* buffer);
-static void exitOpus(void);
-static uint64_t fillOpusBuffer(int16_t* bufferOut);
-static size_t getFileSamplesOpus(void);
+struct opus_t
+{
+	OggOpusFile*	opusFile;
+	struct probe_t*	probe;
+
+	/* Channels given by the decoder. Files of up to two channels are always
+	 * decoded as stereo. */
+	uint8_t			channels;
+
+	/* Set once a chained file of more than two channels reaches a link with
+	 * another number of channels. From then on it is decoded as stereo, given
+	 * in the front left and right channels. */
+	bool			stereo;
+};
+
+static void* initOpus(struct probe_t* probe);
+static uint32_t rateOpus(void* ctx);
+static uint8_t channelOpus(void* ctx);
+static uint64_t decodeOpus(void* ctx, void* buffer);
+static void exitOpus(void* ctx);
+static uint64_t fillOpusBuffer(struct opus_t* opus, int16_t* bufferOut);
+static int readStereoOpus(struct opus_t* opus, int16_t* bufferOut,
+		int samplesToRead);
+static size_t getFileSamplesOpus(void* ctx);
+static int seekOpus(void* ctx, uint64_t sample);
+static void getGainOpus(void* ctx, struct replaygain_t* gain);
 
 /**
  * Set decoder parameters for Opus.
@@ -27,41 +45,74 @@ void setOpus(struct decoder_fn* decoder)
 	decoder->rate = &rateOpus;
 	decoder->channels = &channelOpus;
 	decoder->buffSize = buffSize;
+	decoder->order = CHANNEL_ORDER_VORBIS;
 	decoder->decode = &decodeOpus;
 	decoder->exit = &exitOpus;
 	decoder->getFileSamples = &getFileSamplesOpus;
+	decoder->seek = &seekOpus;
+	decoder->getGain = &getGainOpus;
 }
 
-static size_t getFileSamplesOpus(void)
+static size_t getFileSamplesOpus(void* ctx)
 {
-	ogg_int64_t len = op_pcm_total(opusFile, -1);
+	struct opus_t* opus = ctx;
+	ogg_int64_t len = op_pcm_total(opus->opusFile, -1);
 
 	if(len == OP_EINVAL)
 		return 0;
 
-	return len * (size_t)channelOpus();
+	return len * (size_t)channelOpus(ctx);
+}
+
+static int onReadOpus(void* stream, unsigned char* ptr, int nbytes)
+{
+	return probeRead(stream, ptr, nbytes);
+}
+
+static int onSeekOpus(void* stream, opus_int64 offset, int whence)
+{
+	return probeSeek(stream, offset, whence);
+}
+
+static opus_int64 onTellOpus(void* stream)
+{
+	return probeTell(stream);
 }
 
 /**
  * Initialise Opus decoder.
  *
- * \param	file	Location of opus file to play.
- * \return			0 on success, else failure.
+ * \param	probe	Probed opus file to play. Owned by the decoder on success.
+ * \return			Decoder context, or NULL on failure.
  */
-int initOpus(const char* file)
+static void* initOpus(struct probe_t* probe)
 {
+	static const OpusFileCallbacks cb = {
+		.read = &onReadOpus,
+		.seek = &onSeekOpus,
+		.tell = &onTellOpus,
+		.close = NULL
+	};
+	struct opus_t* opus;
 	int err = 0;
 
-	if((opusFile = op_open_file(file, &err)) == NULL)
-		goto out;
+	if((opus = malloc(sizeof(struct opus_t))) == NULL)
+		return NULL;
 
-	if((err = op_current_link(opusFile)) < 0)
-		goto out;
+	if((opus->opusFile = op_open_callbacks(probe, &cb, NULL, 0, &err)) == NULL)
+	{
+		free(opus);
+		return NULL;
+	}
+
+	opus->probe = probe;
+	opus->channels = op_channel_count(opus->opusFile, -1);
+	opus->stereo = false;
 
-	opusHead = op_head(opusFile, err);
+	if(opus->channels <= 2)
+		opus->channels = 2;
 
-out:
-	return err;
+	return opus;
 }
 
 /**
@@ -69,20 +120,23 @@ out:
  *
  * \return	Sampling rate. Should be 48000.
  */
-uint32_t rateOpus(void)
+static uint32_t rateOpus(void* ctx)
 {
+	(void) ctx;
 	return 48000;
 }
 
 /**
  * Get number of channels of Opus file.
  *
- * \return	Number of channels for opened file, so always be 2.
+ * \return	Number of channels for opened file. Mono files are given as
+ *			stereo.
  */
-uint8_t channelOpus(void)
+static uint8_t channelOpus(void* ctx)
 {
-	/* Opus decoder always returns stereo stream */
-	return 2;
+	struct opus_t* opus = ctx;
+
+	return opus->channels;
 }
 
 /**
@@ -92,34 +146,107 @@ uint8_t channelOpus(void)
  * \return			Samples read for each channel. 0 for end of file, negative
  *					for error.
  */
-uint64_t decodeOpus(void* buffer)
+static uint64_t decodeOpus(void* ctx, void* buffer)
+{
+	struct opus_t* opus = ctx;
+
+	return fillOpusBuffer(opus, buffer);
+}
+
+/**
+ * Seek to a sample of open Opus file.
+ *
+ * \param sample	Sample for each channel to seek to, at 48 kHz.
+ * \return			0 on success, else failure.
+ */
+static int seekOpus(void* ctx, uint64_t sample)
 {
-	return fillOpusBuffer(buffer);
+	struct opus_t* opus = ctx;
+
+	/* The link seeked to is checked for its channels again. */
+	opus->stereo = false;
+	return op_pcm_seek(opus->opusFile, sample) == 0 ? 0 : -1;
+}
+
+/**
+ * Read the ReplayGain of Opus file from its R128 tags. These are relative to
+ * the output gain in the header, which opusfile has already given.
+ *
+ * \param gain	ReplayGain to fill in.
+ */
+static void getGainOpus(void* ctx, struct replaygain_t* gain)
+{
+	struct opus_t* opus = ctx;
+	const OpusTags* tags = op_tags(opus->opusFile, -1);
+
+	if(tags == NULL)
+		return;
+
+	for(int i = 0; i < tags->comments; i++)
+		replaygainParse(gain, tags->user_comments[i],
+				tags->comment_lengths[i]);
 }
 
 /**
  * Free Opus decoder.
  */
-void exitOpus(void)
+static void exitOpus(void* ctx)
 {
-	op_free(opusFile);
+	struct opus_t* opus = ctx;
+
+	op_free(opus->opusFile);
+	probeClose(opus->probe);
+	free(opus);
 }
 
 /**
- * Decode Opus file to fill buffer.
+ * Decode Opus file to fill buffer. Files of more than two channels are
+ * decoded with their own channel mapping, to be downmixed by the playback
+ * engine, until a chained link changes the number of channels.
  *
+ * \param opus			Opus context.
  * \param bufferOut		Pointer to buffer.
- * \return				Samples read per channel.
+ * \return				Samples read for all channels.
  */
-uint64_t fillOpusBuffer(int16_t* bufferOut)
+static uint64_t fillOpusBuffer(struct opus_t* opus, int16_t* bufferOut)
 {
 	uint64_t samplesRead = 0;
 	int samplesToRead = buffSize;
 
-	while(samplesToRead > 0)
+	while(samplesToRead >= opus->channels)
 	{
-		int samplesJustRead = op_read_stereo(opusFile, bufferOut,
-				samplesToRead > 120*48*2 ? 120*48*2 : samplesToRead);
+		int samplesJustRead;
+		int li;
+
+		if(opus->channels == 2)
+			samplesJustRead = op_read_stereo(opus->opusFile, bufferOut,
+					samplesToRead > 120*48*2 ? 120*48*2 : samplesToRead);
+		else if(opus->stereo == true)
+			samplesJustRead = readStereoOpus(opus, bufferOut, samplesToRead);
+		else
+		{
+			samplesJustRead = op_read(opus->opusFile, bufferOut,
+					samplesToRead, &li);
+
+			/* A chained file may change its channels part way through. The
+			 * samples of the new link are read again as stereo. */
+			if(samplesJustRead > 0 &&
+					op_channel_count(opus->opusFile, li) != opus->channels)
+			{
+				opus->stereo = true;
+
+				if(op_pcm_seek(opus->opusFile,
+							op_pcm_tell(opus->opusFile) - samplesJustRead) != 0)
+				{
+					if(samplesRead == 0)
+						return -1;
+
+					break;
+				}
+
+				continue;
+			}
+		}
 
 		if(samplesJustRead < 0)
 			return samplesJustRead;
@@ -129,25 +256,64 @@ uint64_t fillOpusBuffer(int16_t* bufferOut)
 			break;
 		}
 
-		samplesRead += samplesJustRead * 2;
-		samplesToRead -= samplesJustRead * 2;
-		bufferOut += samplesJustRead * 2;
+		samplesRead += samplesJustRead * opus->channels;
+		samplesToRead -= samplesJustRead * opus->channels;
+		bufferOut += samplesJustRead * opus->channels;
 	}
 
 	return samplesRead;
 }
 
 /**
- * Checks if the input file is Opus.
+ * Decode part of open Opus file as stereo, given in the front left and right
+ * channels of its channel mapping with the other channels silent.
  *
- * \param in	Input file.
- * \return		0 if Opus file, else not or failure.
+ * \param opus			Opus context, with more than two channels.
+ * \param bufferOut		Pointer to buffer.
+ * \param samplesToRead	Room in buffer, in samples for all channels.
+ * \return				Samples read for each channel, 0 for end of file or
+ *						negative for error.
  */
-int isOpus(const char* in)
+static int readStereoOpus(struct opus_t* opus, int16_t* bufferOut,
+		int samplesToRead)
 {
-	int err = 0;
-	OggOpusFile* opusTest = op_test_file(in, &err);
+	int frames = samplesToRead / opus->channels;
+	/* Vorbis order puts the centre between front left and right. */
+	int right = opus->channels == 4 ? 1 : 2;
+	int16_t* stereo;
+	int read;
+
+	if(frames > 120*48)
+		frames = 120*48;
+
+	/* Read into the end of the buffer, so that each frame is spread out
+	 * before the frames after it are overwritten. */
+	stereo = bufferOut + frames * (opus->channels - 2);
+	if((read = op_read_stereo(opus->opusFile, stereo, frames * 2)) <= 0)
+		return read;
+
+	for(int i = 0; i < read; i++)
+	{
+		int16_t l = stereo[i * 2];
+		int16_t r = stereo[i * 2 + 1];
+		int16_t* frame = bufferOut + i * opus->channels;
+
+		memset(frame, 0, opus->channels * sizeof(int16_t));
+		frame[0] = l;
+		frame[right] = r;
+	}
+
+	return read;
+}
 
-	op_free(opusTest);
-	return err;
+/**
+ * Score the start of a file as an Opus file.
+ *
+ * \param	head	First bytes of file.
+ * \param	len		Number of bytes in head.
+ * \return			100 if an Ogg Opus file, else 0.
+ */
+int probeOpus(const uint8_t* head, size_t len)
+{
+	return oggPacketIs(head, len, "OpusHead", 8) ? 100 : 0;
 }
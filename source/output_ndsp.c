@@ -0,0 +1,267 @@
+#if defined __arm__
+#include <3ds.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#include "error.h"
+#include "output.h"
+#include "platform.h"
+#include "playback.h"
+#include "seqlock.h"
+
+/* Length of an audio frame of the DSP, which mixes 160 samples at about
+ * 32728 Hz. A frame is heard about a frame after the DSP has mixed it. */
+#define NDSP_FRAME_NS	(160 * 1000000000ULL / 32728)
+
+/**
+ * State of the channel at the end of an audio frame.
+ */
+struct ndspFrame_t
+{
+	uint64_t	time;
+	uint32_t	pos;
+	u16			seq;
+	bool		playing;
+};
+
+static uint8_t	channels;
+static size_t	sampleSize;
+static void		(* callback)(void* data) = NULL;
+static void*	callbackData = NULL;
+
+/* State of channel after the previous audio frame. */
+static u16		lastSeq;
+static bool		lastPlaying;
+
+/* Last audio frame, written by the NDSP thread. */
+static struct seqlock_t	frameLock;
+
+static void setCallbackNdsp(void (* cb)(void* data), void* data);
+static int initNdsp(void);
+static int setFormatNdsp(uint32_t rate, uint8_t chans,
+		enum output_format format);
+static size_t spaceFreeNdsp(void);
+static int allocNdsp(struct outputBuf* buf, size_t size);
+static void freeNdsp(struct outputBuf* buf);
+static void queueNdsp(struct outputBuf* buf);
+static bool doneNdsp(const struct outputBuf* buf);
+static uint32_t positionNdsp(const struct outputBuf* buf, uint64_t* time);
+static void flushNdsp(void);
+static void setPausedNdsp(bool paused);
+static bool isPausedNdsp(void);
+static void exitNdsp(void);
+
+/**
+ * Set output to play through the DSP of the 3DS.
+ *
+ * \param	output	Structure to store output functions.
+ */
+void setOutputNdsp(struct output_fn* output)
+{
+	output->setCallback = &setCallbackNdsp;
+	output->init = &initNdsp;
+	output->setFormat = &setFormatNdsp;
+	output->spaceFree = &spaceFreeNdsp;
+	output->alloc = &allocNdsp;
+	output->free = &freeNdsp;
+	output->queue = &queueNdsp;
+	output->done = &doneNdsp;
+	output->position = &positionNdsp;
+	output->flush = &flushNdsp;
+	output->setPaused = &setPausedNdsp;
+	output->isPaused = &isPausedNdsp;
+	output->exit = &exitNdsp;
+}
+
+static void setCallbackNdsp(void (* cb)(void* data), void* data)
+{
+	callback = cb;
+	callbackData = data;
+}
+
+/**
+ * Called by NDSP after every audio frame. Records where the channel got to,
+ * but only passes on the frames in which the channel moved on to another
+ * buffer or stopped playing, as only then has a buffer finished.
+ *
+ * \param	data	Unused.
+ */
+static void frameCallbackNdsp(void* data)
+{
+	u16 seq = ndspChnGetWaveBufSeq(CHANNEL);
+	bool playing = ndspChnIsPlaying(CHANNEL);
+	struct ndspFrame_t frame = {
+		.time = platformTime(),
+		.pos = ndspChnGetSamplePos(CHANNEL),
+		.seq = seq,
+		.playing = playing
+	};
+
+	(void) data;
+
+	seqlockWrite(&frameLock, &frame);
+
+	if(seq == lastSeq && playing == lastPlaying)
+		return;
+
+	lastSeq = seq;
+	lastPlaying = playing;
+
+	if(callback != NULL)
+		(*callback)(callbackData);
+}
+
+/**
+ * Initialise NDSP.
+ *
+ * \return	0 on success, else failure with errno set.
+ */
+static int initNdsp(void)
+{
+	if(seqlockInit(&frameLock, sizeof(struct ndspFrame_t)) != 0)
+		return -1;
+
+	if(ndspInit() < 0)
+	{
+		seqlockExit(&frameLock);
+		errno = NDSP_INIT_FAIL;
+		return -1;
+	}
+
+	ndspSetOutputMode(NDSP_OUTPUT_STEREO);
+	ndspSetCallback(frameCallbackNdsp, NULL);
+	return 0;
+}
+
+/**
+ * Configure channel for stream.
+ *
+ * \param	rate	Sampling rate.
+ * \param	chans	Number of channels.
+ * \param	format	Format of samples, which the DSP plays as they are.
+ * \return			0 on success, else failure with errno set.
+ */
+static int setFormatNdsp(uint32_t rate, uint8_t chans,
+		enum output_format format)
+{
+	u16 ndspFormat;
+
+	if(format == OUTPUT_FORMAT_PCM8)
+		ndspFormat = chans == 2 ? NDSP_FORMAT_STEREO_PCM8 :
+			NDSP_FORMAT_MONO_PCM8;
+	else
+		ndspFormat = chans == 2 ? NDSP_FORMAT_STEREO_PCM16 :
+			NDSP_FORMAT_MONO_PCM16;
+
+	channels = chans;
+	sampleSize = OUTPUT_SAMPLE_SIZE(format);
+	lastSeq = 0;
+	lastPlaying = false;
+	ndspChnReset(CHANNEL);
+	ndspChnWaveBufClear(CHANNEL);
+	ndspChnSetInterp(CHANNEL, NDSP_INTERP_POLYPHASE);
+	ndspChnSetRate(CHANNEL, rate);
+	ndspChnSetFormat(CHANNEL, ndspFormat);
+
+	return 0;
+}
+
+/**
+ * Sample buffers must be allocated in linear memory for the DSP to read them.
+ */
+static size_t spaceFreeNdsp(void)
+{
+	return linearSpaceFree();
+}
+
+static int allocNdsp(struct outputBuf* buf, size_t size)
+{
+	ndspWaveBuf* waveBuf;
+
+	if((waveBuf = calloc(1, sizeof(ndspWaveBuf))) == NULL)
+		return -1;
+
+	if((buf->data = linearAlloc(size)) == NULL)
+	{
+		free(waveBuf);
+		return -1;
+	}
+
+	waveBuf->data_vaddr = buf->data;
+	buf->priv = waveBuf;
+	return 0;
+}
+
+static void freeNdsp(struct outputBuf* buf)
+{
+	linearFree(buf->data);
+	free(buf->priv);
+	buf->data = NULL;
+	buf->priv = NULL;
+}
+
+/**
+ * ndspChnWaveBufAdd() ignores buffers that are still marked as queued or
+ * playing, which those discarded by flushNdsp() are. The buffer belongs to
+ * the caller once it is queued again, so its status is reset here.
+ */
+static void queueNdsp(struct outputBuf* buf)
+{
+	ndspWaveBuf* waveBuf = buf->priv;
+
+	waveBuf->status = NDSP_WBUF_FREE;
+	waveBuf->nsamples = buf->nsamples;
+	DSP_FlushDataCache(buf->data,
+			buf->nsamples * channels * sampleSize);
+	ndspChnWaveBufAdd(CHANNEL, waveBuf);
+}
+
+static bool doneNdsp(const struct outputBuf* buf)
+{
+	const ndspWaveBuf* waveBuf = buf->priv;
+
+	return waveBuf->status == NDSP_WBUF_DONE;
+}
+
+/**
+ * The sample position of the channel is only updated once every audio frame,
+ * and applies to the buffer that it was playing at the time.
+ */
+static uint32_t positionNdsp(const struct outputBuf* buf, uint64_t* time)
+{
+	const ndspWaveBuf* waveBuf = buf->priv;
+	struct ndspFrame_t frame;
+
+	seqlockRead(&frameLock, &frame);
+	*time = frame.time + NDSP_FRAME_NS;
+
+	if(frame.playing == true && frame.seq == waveBuf->sequence_id)
+		return frame.pos < buf->nsamples ? frame.pos : buf->nsamples;
+
+	return waveBuf->status == NDSP_WBUF_DONE ? buf->nsamples : 0;
+}
+
+static void flushNdsp(void)
+{
+	ndspChnWaveBufClear(CHANNEL);
+}
+
+static void setPausedNdsp(bool paused)
+{
+	ndspChnSetPaused(CHANNEL, paused);
+}
+
+static bool isPausedNdsp(void)
+{
+	return ndspChnIsPaused(CHANNEL);
+}
+
+static void exitNdsp(void)
+{
+	ndspSetCallback(NULL, NULL);
+	ndspChnWaveBufClear(CHANNEL);
+	ndspExit();
+	seqlockExit(&frameLock);
+}
+
+#endif
@@ -0,0 +1,119 @@
+#include <stdlib.h>
+
+#include "output.h"
+
+/* Arbitrary amount of memory to report as available for buffers. */
+#define NULL_SPACE_FREE	(16 * 1024 * 1024)
+
+static bool	paused = false;
+static void	(* callback)(void* data) = NULL;
+static void*	callbackData = NULL;
+
+static void setCallbackNull(void (* cb)(void* data), void* data);
+static int initNull(void);
+static int setFormatNull(uint32_t rate, uint8_t channels,
+		enum output_format format);
+static size_t spaceFreeNull(void);
+static int allocNull(struct outputBuf* buf, size_t size);
+static void freeNull(struct outputBuf* buf);
+static void queueNull(struct outputBuf* buf);
+static bool doneNull(const struct outputBuf* buf);
+static void flushNull(void);
+static void setPausedNull(bool pause);
+static bool isPausedNull(void);
+static void exitNull(void);
+
+/**
+ * Set output to discard all samples as soon as they are queued.
+ *
+ * \param	output	Structure to store output functions.
+ */
+void setOutputNull(struct output_fn* output)
+{
+	output->setCallback = &setCallbackNull;
+	output->init = &initNull;
+	output->setFormat = &setFormatNull;
+	output->spaceFree = &spaceFreeNull;
+	output->alloc = &allocNull;
+	output->free = &freeNull;
+	output->queue = &queueNull;
+	output->done = &doneNull;
+	output->position = NULL;
+	output->flush = &flushNull;
+	output->setPaused = &setPausedNull;
+	output->isPaused = &isPausedNull;
+	output->exit = &exitNull;
+}
+
+static void setCallbackNull(void (* cb)(void* data), void* data)
+{
+	callback = cb;
+	callbackData = data;
+}
+
+static int initNull(void)
+{
+	paused = false;
+	return 0;
+}
+
+static int setFormatNull(uint32_t rate, uint8_t channels,
+		enum output_format format)
+{
+	(void) rate;
+	(void) channels;
+	(void) format;
+	return 0;
+}
+
+static size_t spaceFreeNull(void)
+{
+	return NULL_SPACE_FREE;
+}
+
+static int allocNull(struct outputBuf* buf, size_t size)
+{
+	buf->priv = NULL;
+	return (buf->data = malloc(size)) == NULL ? -1 : 0;
+}
+
+static void freeNull(struct outputBuf* buf)
+{
+	free(buf->data);
+	buf->data = NULL;
+}
+
+static void queueNull(struct outputBuf* buf)
+{
+	(void) buf;
+
+	if(callback != NULL)
+		(*callback)(callbackData);
+}
+
+/**
+ * Buffers are finished as soon as they are queued, unless paused.
+ */
+static bool doneNull(const struct outputBuf* buf)
+{
+	(void) buf;
+	return !paused;
+}
+
+static void flushNull(void)
+{
+}
+
+static void setPausedNull(bool pause)
+{
+	paused = pause;
+}
+
+static bool isPausedNull(void)
+{
+	return paused;
+}
+
+static void exitNull(void)
+{
+}
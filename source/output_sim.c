@@ -0,0 +1,297 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "output.h"
+#include "platform.h"
+#include "spsc.h"
+
+/* Arbitrary amount of memory to report as available for buffers. */
+#define SIM_SPACE_FREE	(16 * 1024 * 1024)
+
+/* Maximum number of buffers that may be queued at once. */
+#define SIM_QUEUE_MAX	64
+
+/* Stack size of the thread simulating the DSP. */
+#define SIM_STACK_SIZE	(16 * 1024)
+
+struct simBuf_t
+{
+	atomic_bool		done;
+
+	/* Time at which the DSP would start playing the buffer, or 0 until the
+	 * simulation thread takes it from the queue. */
+	_Atomic uint64_t	start;
+};
+
+static struct spsc_t	queue;
+static struct thread_t	thread;
+/* Signalled when a buffer is queued, playback is resumed, on flush or on
+ * exit. */
+static struct event_t	event;
+/* Signalled once the queue has been emptied after a flush. */
+static struct event_t	flushedEvent;
+static atomic_bool		paused;
+static atomic_bool		flushing;
+static atomic_bool		quit;
+static uint32_t			rate;
+static unsigned			speed = 1;
+static void				(* callback)(void* data) = NULL;
+static void*			callbackData = NULL;
+
+static void setCallbackSim(void (* cb)(void* data), void* data);
+static int initSim(void);
+static int setFormatSim(uint32_t sampleRate, uint8_t channels,
+		enum output_format format);
+static size_t spaceFreeSim(void);
+static int allocSim(struct outputBuf* buf, size_t size);
+static void freeSim(struct outputBuf* buf);
+static void queueSim(struct outputBuf* buf);
+static bool doneSim(const struct outputBuf* buf);
+static uint32_t positionSim(const struct outputBuf* buf, uint64_t* time);
+static void flushSim(void);
+static void setPausedSim(bool pause);
+static bool isPausedSim(void);
+static void exitSim(void);
+
+/**
+ * Set output to discard samples at the rate that the DSP would play them.
+ *
+ * \param	output	Structure to store output functions.
+ */
+void setOutputSim(struct output_fn* output)
+{
+	output->setCallback = &setCallbackSim;
+	output->init = &initSim;
+	output->setFormat = &setFormatSim;
+	output->spaceFree = &spaceFreeSim;
+	output->alloc = &allocSim;
+	output->free = &freeSim;
+	output->queue = &queueSim;
+	output->done = &doneSim;
+	output->position = &positionSim;
+	output->flush = &flushSim;
+	output->setPaused = &setPausedSim;
+	output->isPaused = &isPausedSim;
+	output->exit = &exitSim;
+}
+
+/**
+ * Set how many times faster than real time the simulated output plays.
+ *
+ * \param	multiplier	Speed multiplier. Must be at least 1.
+ */
+void setOutputSimSpeed(unsigned multiplier)
+{
+	speed = multiplier;
+}
+
+/**
+ * Simulates the DSP by waiting for as long as each queued buffer would take to
+ * play before marking it as done.
+ *
+ * \param	arg	Unused.
+ */
+static void simThread(void* arg)
+{
+	/* Time at which the DSP would finish the previous buffer. */
+	uint64_t deadline = 0;
+
+	(void) arg;
+
+	while(atomic_load(&quit) == false)
+	{
+		struct outputBuf* buf;
+		struct simBuf_t* sim;
+		uint64_t now;
+
+		if(atomic_load(&flushing) == true)
+		{
+			while(spscPop(&queue, &buf) == true)
+			{
+				sim = buf->priv;
+				atomic_store(&sim->done, true);
+			}
+
+			deadline = 0;
+			atomic_store(&flushing, false);
+			eventSignal(&flushedEvent);
+			continue;
+		}
+
+		if(atomic_load(&paused) == true || spscPop(&queue, &buf) == false)
+		{
+			/* The DSP would be idle, so start timing again later. */
+			deadline = 0;
+			eventWait(&event);
+			continue;
+		}
+
+		/* The DSP plays queued buffers back to back, however late this
+		 * thread wakes up. */
+		if(deadline == 0)
+			deadline = platformTime();
+
+		sim = buf->priv;
+		atomic_store(&sim->start, deadline);
+		deadline += (uint64_t)buf->nsamples * 1000000000 / rate / speed;
+
+		/* A flush cuts the current buffer short, as the DSP would. */
+		while((now = platformTime()) < deadline &&
+				atomic_load(&flushing) == false &&
+				atomic_load(&quit) == false)
+			eventWaitTimeout(&event, deadline - now);
+
+		atomic_store(&sim->done, true);
+
+		if(callback != NULL)
+			(*callback)(callbackData);
+	}
+}
+
+static void setCallbackSim(void (* cb)(void* data), void* data)
+{
+	callback = cb;
+	callbackData = data;
+}
+
+static int initSim(void)
+{
+	atomic_store(&paused, false);
+	atomic_store(&flushing, false);
+	atomic_store(&quit, false);
+
+	if(spscInit(&queue, SIM_QUEUE_MAX, sizeof(struct outputBuf*)) != 0)
+		return -1;
+
+	eventInit(&event);
+	eventInit(&flushedEvent);
+
+	if(platformThreadCreate(&thread, simThread, NULL, SIM_STACK_SIZE,
+				platformThreadPriority() - 1, -2) != 0)
+	{
+		eventExit(&flushedEvent);
+		eventExit(&event);
+		spscExit(&queue);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Only called whilst no buffers are queued, so the simulation thread is not
+ * reading rate.
+ */
+static int setFormatSim(uint32_t sampleRate, uint8_t channels,
+		enum output_format format)
+{
+	(void) channels;
+	(void) format;
+
+	rate = sampleRate;
+	return 0;
+}
+
+static size_t spaceFreeSim(void)
+{
+	return SIM_SPACE_FREE;
+}
+
+static int allocSim(struct outputBuf* buf, size_t size)
+{
+	struct simBuf_t* sim;
+
+	if((sim = malloc(sizeof(struct simBuf_t))) == NULL)
+		return -1;
+
+	if((buf->data = malloc(size)) == NULL)
+	{
+		free(sim);
+		return -1;
+	}
+
+	atomic_init(&sim->done, true);
+	atomic_init(&sim->start, 0);
+	buf->priv = sim;
+	return 0;
+}
+
+static void freeSim(struct outputBuf* buf)
+{
+	free(buf->data);
+	free(buf->priv);
+	buf->data = NULL;
+	buf->priv = NULL;
+}
+
+static void queueSim(struct outputBuf* buf)
+{
+	struct simBuf_t* sim = buf->priv;
+
+	atomic_store(&sim->start, 0);
+	atomic_store(&sim->done, false);
+	spscPush(&queue, &buf);
+	eventSignal(&event);
+}
+
+static bool doneSim(const struct outputBuf* buf)
+{
+	struct simBuf_t* sim = buf->priv;
+
+	return atomic_load(&sim->done);
+}
+
+/**
+ * The simulated DSP plays samples evenly from the start of each buffer until
+ * its deadline, and they are heard straight away.
+ */
+static uint32_t positionSim(const struct outputBuf* buf, uint64_t* time)
+{
+	struct simBuf_t* sim = buf->priv;
+	uint64_t start = atomic_load(&sim->start);
+	uint64_t played;
+
+	*time = platformTime();
+
+	if(atomic_load(&sim->done) == true)
+		return buf->nsamples;
+
+	if(start == 0 || *time < start)
+		return 0;
+
+	played = (*time - start) * rate * speed / 1000000000;
+	return played < buf->nsamples ? played : buf->nsamples;
+}
+
+/**
+ * Wait for the simulation thread to drop every queued buffer.
+ */
+static void flushSim(void)
+{
+	atomic_store(&flushing, true);
+	eventSignal(&event);
+
+	while(atomic_load(&flushing) == true)
+		eventWait(&flushedEvent);
+}
+
+static void setPausedSim(bool pause)
+{
+	atomic_store(&paused, pause);
+	eventSignal(&event);
+}
+
+static bool isPausedSim(void)
+{
+	return atomic_load(&paused);
+}
+
+static void exitSim(void)
+{
+	atomic_store(&quit, true);
+	eventSignal(&event);
+	platformThreadJoin(&thread);
+	eventExit(&flushedEvent);
+	eventExit(&event);
+	spscExit(&queue);
+}
@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "output.h"
+
+/* Arbitrary amount of memory to report as available for buffers. */
+#define WAV_SPACE_FREE	(16 * 1024 * 1024)
+
+/* Size of a canonical WAV header. */
+#define WAV_HEADER_SIZE	44
+
+static const char*	path = "out.wav";
+static FILE*		out = NULL;
+static uint32_t		rate;
+static uint8_t		channels;
+static enum output_format	format;
+static uint32_t		dataSize;
+static bool			paused = false;
+static void			(* callback)(void* data) = NULL;
+static void*		callbackData = NULL;
+
+static void setCallbackWav(void (* cb)(void* data), void* data);
+static int initWav(void);
+static int setFormatWav(uint32_t sampleRate, uint8_t chans,
+		enum output_format fmt);
+static size_t spaceFreeWav(void);
+static int allocWav(struct outputBuf* buf, size_t size);
+static void freeWav(struct outputBuf* buf);
+static void queueWav(struct outputBuf* buf);
+static bool doneWav(const struct outputBuf* buf);
+static void flushWav(void);
+static void setPausedWav(bool pause);
+static bool isPausedWav(void);
+static void exitWav(void);
+
+/**
+ * Set output to write all samples to a WAV file.
+ *
+ * \param	output	Structure to store output functions.
+ */
+void setOutputWav(struct output_fn* output)
+{
+	output->setCallback = &setCallbackWav;
+	output->init = &initWav;
+	output->setFormat = &setFormatWav;
+	output->spaceFree = &spaceFreeWav;
+	output->alloc = &allocWav;
+	output->free = &freeWav;
+	output->queue = &queueWav;
+	output->done = &doneWav;
+	output->position = NULL;
+	output->flush = &flushWav;
+	output->setPaused = &setPausedWav;
+	output->isPaused = &isPausedWav;
+	output->exit = &exitWav;
+}
+
+/**
+ * Set file that the WAV output writes to. Defaults to "out.wav".
+ *
+ * \param	file	Location of file to write. Must remain valid whilst the
+ *					output is open.
+ */
+void setOutputWavFile(const char* file)
+{
+	path = file;
+}
+
+static void putLe16(unsigned char* p, uint16_t val)
+{
+	p[0] = val & 0xFF;
+	p[1] = val >> 8;
+}
+
+static void putLe32(unsigned char* p, uint32_t val)
+{
+	putLe16(p, val & 0xFFFF);
+	putLe16(p + 2, val >> 16);
+}
+
+/**
+ * Write WAV header for the samples written so far to the start of the file.
+ */
+static void writeHeader(void)
+{
+	unsigned char header[WAV_HEADER_SIZE];
+
+	memcpy(header, "RIFF", 4);
+	putLe32(header + 4, WAV_HEADER_SIZE - 8 + dataSize);
+	memcpy(header + 8, "WAVEfmt ", 8);
+	putLe32(header + 16, 16);
+	putLe16(header + 20, 1);
+	putLe16(header + 22, channels);
+	putLe32(header + 24, rate);
+	putLe32(header + 28, rate * channels * OUTPUT_SAMPLE_SIZE(format));
+	putLe16(header + 32, channels * OUTPUT_SAMPLE_SIZE(format));
+	putLe16(header + 34, 8 * OUTPUT_SAMPLE_SIZE(format));
+	memcpy(header + 36, "data", 4);
+	putLe32(header + 40, dataSize);
+
+	fseek(out, 0, SEEK_SET);
+	fwrite(header, sizeof(header), 1, out);
+	fseek(out, 0, SEEK_END);
+}
+
+static void setCallbackWav(void (* cb)(void* data), void* data)
+{
+	callback = cb;
+	callbackData = data;
+}
+
+static int initWav(void)
+{
+	paused = false;
+	return 0;
+}
+
+/**
+ * The file is opened for the first stream. A stream in a different format
+ * starts the file again, as a WAV file can only hold one format.
+ */
+static int setFormatWav(uint32_t sampleRate, uint8_t chans,
+		enum output_format fmt)
+{
+	if(out != NULL && sampleRate == rate && chans == channels &&
+			fmt == format)
+		return 0;
+
+	exitWav();
+
+	if((out = fopen(path, "wb")) == NULL)
+		return -1;
+
+	rate = sampleRate;
+	channels = chans;
+	format = fmt;
+	dataSize = 0;
+	writeHeader();
+
+	return 0;
+}
+
+static size_t spaceFreeWav(void)
+{
+	return WAV_SPACE_FREE;
+}
+
+static int allocWav(struct outputBuf* buf, size_t size)
+{
+	buf->priv = NULL;
+	return (buf->data = malloc(size)) == NULL ? -1 : 0;
+}
+
+static void freeWav(struct outputBuf* buf)
+{
+	free(buf->data);
+	buf->data = NULL;
+}
+
+/**
+ * Samples are written as soon as they are queued. 8-bit samples are unsigned
+ * in WAV files, so are converted a chunk at a time.
+ */
+static void queueWav(struct outputBuf* buf)
+{
+	size_t size = buf->nsamples * channels * OUTPUT_SAMPLE_SIZE(format);
+
+	if(format == OUTPUT_FORMAT_PCM16)
+		dataSize += fwrite(buf->data, 1, size, out);
+	else
+	{
+		const uint8_t* in = (const uint8_t*)buf->data;
+		uint8_t chunk[1024];
+
+		for(size_t done = 0; done < size; done += sizeof(chunk))
+		{
+			size_t len = size - done < sizeof(chunk) ? size - done :
+				sizeof(chunk);
+
+			for(size_t i = 0; i < len; i++)
+				chunk[i] = in[done + i] ^ 0x80;
+
+			dataSize += fwrite(chunk, 1, len, out);
+		}
+	}
+
+	if(callback != NULL)
+		(*callback)(callbackData);
+}
+
+static bool doneWav(const struct outputBuf* buf)
+{
+	(void) buf;
+	return !paused;
+}
+
+static void flushWav(void)
+{
+}
+
+static void setPausedWav(bool pause)
+{
+	paused = pause;
+}
+
+static bool isPausedWav(void)
+{
+	return paused;
+}
+
+static void exitWav(void)
+{
+	if(out == NULL)
+		return;
+
+	writeHeader();
+	fclose(out);
+	out = NULL;
+}
@@ -0,0 +1,311 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "platform.h"
+
+#if defined __arm__
+
+/**
+ * Start a new thread.
+ *
+ * \param	thread		Thread to initialise.
+ * \param	entry		Function to run in new thread.
+ * \param	arg			Argument to pass to entry.
+ * \param	stackSize	Size of stack for new thread.
+ * \param	prio		Priority of thread. Lower values are higher priority.
+ * \param	core		Core to run thread on, -2 for the default core.
+ * \return				0 on success, else failure.
+ */
+int platformThreadCreate(struct thread_t* thread, void (* entry)(void*),
+		void* arg, size_t stackSize, int prio, int core)
+{
+	thread->thread = threadCreate(entry, arg, stackSize, prio, core, false);
+	return thread->thread == NULL ? -1 : 0;
+}
+
+/**
+ * Wait for a thread to exit and free its resources.
+ *
+ * \param	thread	Thread started with platformThreadCreate().
+ */
+void platformThreadJoin(struct thread_t* thread)
+{
+	threadJoin(thread->thread, U64_MAX);
+	threadFree(thread->thread);
+	thread->thread = NULL;
+}
+
+/**
+ * Get priority of the calling thread.
+ *
+ * \return	Priority of calling thread.
+ */
+int platformThreadPriority(void)
+{
+	s32 prio;
+
+	svcGetThreadPriority(&prio, CUR_THREAD_HANDLE);
+	return prio;
+}
+
+/**
+ * Get time from a monotonic clock.
+ *
+ * \return	Time in nanoseconds.
+ */
+uint64_t platformTime(void)
+{
+	uint64_t ticks = svcGetSystemTick();
+
+	/* Split to avoid overflowing 64 bits. */
+	return (ticks / SYSCLOCK_ARM11) * 1000000000 +
+		(ticks % SYSCLOCK_ARM11) * 1000000000 / SYSCLOCK_ARM11;
+}
+
+/**
+ * Sleep the calling thread.
+ *
+ * \param	ns	Nanoseconds to sleep for.
+ */
+void platformSleep(uint64_t ns)
+{
+	svcSleepThread(ns);
+}
+
+void eventInit(struct event_t* event)
+{
+	LightEvent_Init(&event->event, RESET_ONESHOT);
+}
+
+void eventSignal(struct event_t* event)
+{
+	LightEvent_Signal(&event->event);
+}
+
+void eventWait(struct event_t* event)
+{
+	LightEvent_Wait(&event->event);
+}
+
+/**
+ * Wait for an event to be signalled.
+ *
+ * \param	event	Event to wait on.
+ * \param	ns		Maximum nanoseconds to wait for.
+ * \return			true if signalled, false on timeout.
+ */
+bool eventWaitTimeout(struct event_t* event, uint64_t ns)
+{
+	return LightEvent_WaitTimeout(&event->event, ns) == 0;
+}
+
+void eventExit(struct event_t* event)
+{
+	(void) event;
+}
+
+void lockInit(struct lock_t* lock)
+{
+	LightLock_Init(&lock->lock);
+}
+
+void lockAcquire(struct lock_t* lock)
+{
+	LightLock_Lock(&lock->lock);
+}
+
+void lockRelease(struct lock_t* lock)
+{
+	LightLock_Unlock(&lock->lock);
+}
+
+void lockExit(struct lock_t* lock)
+{
+	(void) lock;
+}
+
+#else
+
+static void* threadEntry(void* arg)
+{
+	struct thread_t* thread = arg;
+
+	thread->entry(thread->arg);
+	return NULL;
+}
+
+/**
+ * Start a new thread.
+ *
+ * \param	thread		Thread to initialise.
+ * \param	entry		Function to run in new thread.
+ * \param	arg			Argument to pass to entry.
+ * \param	stackSize	Size of stack for new thread.
+ * \param	prio		Ignored on Linux.
+ * \param	core		Ignored on Linux.
+ * \return				0 on success, else failure with errno set.
+ */
+int platformThreadCreate(struct thread_t* thread, void (* entry)(void*),
+		void* arg, size_t stackSize, int prio, int core)
+{
+	pthread_attr_t attr;
+	int err;
+
+	(void) prio;
+	(void) core;
+
+	thread->entry = entry;
+	thread->arg = arg;
+
+	pthread_attr_init(&attr);
+	if(stackSize < PTHREAD_STACK_MIN)
+		stackSize = PTHREAD_STACK_MIN;
+
+	pthread_attr_setstacksize(&attr, stackSize);
+	err = pthread_create(&thread->thread, &attr, threadEntry, thread);
+	pthread_attr_destroy(&attr);
+
+	if(err != 0)
+	{
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Wait for a thread to exit and free its resources.
+ *
+ * \param	thread	Thread started with platformThreadCreate().
+ */
+void platformThreadJoin(struct thread_t* thread)
+{
+	pthread_join(thread->thread, NULL);
+}
+
+/**
+ * Get priority of the calling thread.
+ *
+ * \return	Always 0 on Linux.
+ */
+int platformThreadPriority(void)
+{
+	return 0;
+}
+
+/**
+ * Get time from a monotonic clock.
+ *
+ * \return	Time in nanoseconds.
+ */
+uint64_t platformTime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Sleep the calling thread.
+ *
+ * \param	ns	Nanoseconds to sleep for.
+ */
+void platformSleep(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000,
+		.tv_nsec = ns % 1000000000
+	};
+
+	while(nanosleep(&ts, &ts) != 0 && errno == EINTR);
+}
+
+void eventInit(struct event_t* event)
+{
+	pthread_mutex_init(&event->lock, NULL);
+	pthread_cond_init(&event->cond, NULL);
+	event->signalled = false;
+}
+
+void eventSignal(struct event_t* event)
+{
+	pthread_mutex_lock(&event->lock);
+	event->signalled = true;
+	pthread_cond_signal(&event->cond);
+	pthread_mutex_unlock(&event->lock);
+}
+
+void eventWait(struct event_t* event)
+{
+	pthread_mutex_lock(&event->lock);
+
+	while(event->signalled == false)
+		pthread_cond_wait(&event->cond, &event->lock);
+
+	event->signalled = false;
+	pthread_mutex_unlock(&event->lock);
+}
+
+/**
+ * Wait for an event to be signalled.
+ *
+ * \param	event	Event to wait on.
+ * \param	ns		Maximum nanoseconds to wait for.
+ * \return			true if signalled, false on timeout.
+ */
+bool eventWaitTimeout(struct event_t* event, uint64_t ns)
+{
+	struct timespec ts;
+	bool signalled;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ns += ts.tv_nsec;
+	ts.tv_sec += ns / 1000000000;
+	ts.tv_nsec = ns % 1000000000;
+
+	pthread_mutex_lock(&event->lock);
+
+	while(event->signalled == false)
+	{
+		if(pthread_cond_timedwait(&event->cond, &event->lock, &ts) != 0)
+			break;
+	}
+
+	signalled = event->signalled;
+	event->signalled = false;
+	pthread_mutex_unlock(&event->lock);
+
+	return signalled;
+}
+
+void eventExit(struct event_t* event)
+{
+	pthread_cond_destroy(&event->cond);
+	pthread_mutex_destroy(&event->lock);
+}
+
+void lockInit(struct lock_t* lock)
+{
+	pthread_mutex_init(&lock->lock, NULL);
+}
+
+void lockAcquire(struct lock_t* lock)
+{
+	pthread_mutex_lock(&lock->lock);
+}
+
+void lockRelease(struct lock_t* lock)
+{
+	pthread_mutex_unlock(&lock->lock);
+}
+
+void lockExit(struct lock_t* lock)
+{
+	pthread_mutex_destroy(&lock->lock);
+}
+
+#endif
@@ -1,225 +1,2154 @@
-#include <3ds.h>
+#include <errno.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "all.h"
+#include "cache.h"
 #include "error.h"
 #include "file.h"
-#include "flac.h"
-#include "mp3.h"
-#include "opus.h"
+#include "mpsc.h"
+#include "output.h"
+#include "platform.h"
 #include "playback.h"
-#include "vorbis.h"
-#include "wav.h"
-#include "sid.h"
+#include "resample.h"
+#include "sample.h"
+#include "seqlock.h"
+#include "spsc.h"
+#include "stretch.h"
 
-static volatile bool stop = true;
+/* Limits on the number of buffers in the decode-ahead ring. */
+#define PLAYBACK_BUFS_MIN	4
+#define PLAYBACK_BUFS_MAX	16
+
+/* Number of decoded buffers to wait for before starting a track. */
+#define PLAYBACK_BUFS_START	2
+
+/* Amount of decoded audio to keep queued ahead of the DSP. */
+#define PLAYBACK_AHEAD_MS	1500
+
+/* Maximum number of commands waiting for the playback thread. */
+#define PLAYBACK_CMDS_MAX	16
+
+/* Maximum number of events waiting for the UI. */
+#define PLAYBACK_EVENTS_MAX	32
+
+/* Stack sizes of the playback and decoder threads. */
+#define PLAYBACK_STACK_SIZE	(32 * 1024)
+#define DECODE_STACK_SIZE	(32 * 1024)
+
+/* Longest time that the playback thread sleeps for without being signalled
+ * whilst a track is open. */
+#define PLAYBACK_WAIT_NS	(100 * 1000 * 1000)
+
+enum playbackCmd_e
+{
+	PLAYBACK_CMD_PLAY,
+	PLAYBACK_CMD_NEXT,
+	PLAYBACK_CMD_STOP,
+	PLAYBACK_CMD_SEEK,
+	PLAYBACK_CMD_PAUSE,
+	PLAYBACK_CMD_QUIT
+};
+
+struct playbackCmd_t
+{
+	enum playbackCmd_e	cmd;
+
+	/* PLAYBACK_CMD_PLAY only. Owned by the command. */
+	char*				file;
+	char*				next;
+
+	/* PLAYBACK_CMD_SEEK only. */
+	size_t				pos;
+
+	/* PLAYBACK_CMD_PAUSE only. */
+	bool				paused;
+
+	/* Number of commands sent so far that replace or stop the current file,
+	 * including this one. */
+	unsigned			serial;
+
+	/* Time at which the command was sent. */
+	uint64_t			time;
+};
+
+/**
+ * Event waiting for the UI, with the serial of the last command that replaced
+ * or stopped the file before it occurred.
+ */
+struct queuedEvent_t
+{
+	struct playbackEvent_t	event;
+	unsigned				serial;
+};
+
+/**
+ * Information on a track that follows on from the previous track without
+ * stopping playback.
+ */
+struct track_t
+{
+	char*		file;
+	size_t		samples_total;
+	size_t		samples_per_second;
+	unsigned	file_opens;
+
+	/* Samples of the previous track alone at the start of this track, which
+	 * fades in part way through its first buffer. */
+	size_t		lead;
+};
+
+struct playbackBuf_t
+{
+	struct outputBuf	out;
+
+	/* Set on the first buffer of a track that follows on from the previous
+	 * track. Freed once the track starts playing. */
+	struct track_t*		track;
+
+	/* Samples of the files that the buffer plays, in the units of
+	 * position.samples_played. Differs from the samples in the buffer whilst
+	 * the speed of playback is changed. */
+	size_t				source;
+};
+
+/**
+ * Resampler of a file that is not at the rate of the output stream, with room
+ * for one decode of the file before it is resampled.
+ */
+struct resample_t
+{
+	struct resampler_t	rs;
+
+	/* Set once the end of the file has been given to the resampler. */
+	bool				ended;
+
+	int16_t				buf[];
+};
+
+/**
+ * Position of playback as last published by the playback thread, from which
+ * playbackGetPosition() carries on the position at any time.
+ */
+struct playbackClock_t
+{
+	struct playbackPosition_t	pos;
+	uint8_t						channels;
+
+	/* Samples of the file heard each second from pos.time, or 0 whilst
+	 * playback is paused, stopped or waiting for buffers. */
+	size_t						rate;
+
+	/* End of the buffer playing, which the position is not carried past. */
+	size_t						end;
+};
+
+/**
+ * Stretcher of the output stream whilst its speed is changed, with room for
+ * one buffer of samples before they are stretched. A track that follows on
+ * from the track playing starts part way through the input of the stretcher,
+ * and is marked on the buffer that plays that part.
+ */
+struct stretch_t
+{
+	struct stretcher_t	st;
+
+	/* Set once the end of the last file has been given to the stretcher. */
+	bool				ended;
+
+	/* Track that starts at input frame trackStart, or NULL. */
+	struct track_t*		track;
+	uint64_t			trackStart;
+
+	int16_t				buf[];
+};
+
+static struct output_fn output = { 0 };
+static bool				isInit = false;
+
+/* Set whilst a track is open, or about to be opened. */
+static atomic_bool		playing;
+static atomic_bool		paused;
+
+/* File to play once the current file ends. Owned by whoever holds it. */
+static _Atomic(char*)	nextFile = NULL;
+
+/* ReplayGain settings, read whenever a file is opened. */
+static atomic_int		gainMode = REPLAYGAIN_TRACK;
+static atomic_int		gainPreamp = 0;
+/* Length of crossfades between files, in milliseconds, or 0 for none. */
+static atomic_uint		crossfadeMs = 0;
+/* Sampling rate of the output stream, or 0 for that of the first file, and
+ * how well files at other rates are resampled to it. */
+static atomic_uint		outputRate = 0;
+static atomic_int		resampleQuality = RESAMPLE_MEDIUM;
+/* Speed of playback in percent, read before each buffer is filled. */
+static atomic_uint		playbackSpeed = 100;
+
+/* Commands from the UI to the playback thread. */
+static struct spsc_t	cmdQueue;
+/* Serial of the last command sent. Only used by the UI. */
+static unsigned			cmdSerial = 0;
+
+/* Events from the playback and decoder threads to the UI. */
+static struct mpsc_t	eventQueue;
+/* Serial of the last command carried out that replaced or stopped the file. */
+static atomic_uint		eventSerial;
+
+/* Signalled when the playback thread has work to do. */
+static struct event_t		playbackEvent;
+static struct thread_t		playbackThreadInfo;
+static struct thread_t		decodeThreadInfo;
+
+/* Position published by the playback thread, read by any thread. */
+static struct seqlock_t			clockLock;
+
+/* State owned by the playback thread. */
+static struct playbackInfo_t*	info;
+/* Position of playback up to the last buffer that finished playing. */
+static struct playbackPosition_t	position;
+static struct playbackBuf_t		bufs[PLAYBACK_BUFS_MAX] = { 0 };
+/* Number of buffers allocated. Buffers are kept between tracks. */
+static unsigned					bufsAlloc = 0;
+/* Number of buffers in the ring of the current track. */
+static unsigned					bufCount;
+/* Buffers queued to the output, oldest first. */
+static struct playbackBuf_t*	queue[PLAYBACK_BUFS_MAX];
+static unsigned					queued;
+static unsigned					head;
+/* Number of channels played, after any downmix. */
+static uint8_t					channels;
+/* Format of samples in the buffers of the current track. */
+static enum output_format		format;
+static bool						isTrackOpen = false;
+/* Set until the first buffers of a track are queued to the output. */
+static bool						isStarting;
+/* Time at which the command to play the current track was sent, or 0 once
+ * the track has started. */
+static uint64_t					switchStart;
+/* Samples still to play of the previous track before the current track fades
+ * in, which are not counted in position. */
+static size_t					leadSamples;
+
+/* State shared between the playback thread and the decoder thread. The
+ * decoder is only accessed by the playback thread whilst decodeDone is set. */
+static struct decoder_fn	decoder;
+/* Context of the open file, or NULL. */
+static void*				decoderCtx = NULL;
+/* Sampling rate of the output stream. */
+static uint32_t				streamRate;
+/* Resampler of the open file, or NULL if it is at the rate of the output
+ * stream. */
+static struct resample_t*	resample = NULL;
+/* Stretcher of the output stream, or NULL if it has been played at its own
+ * speed since the track was opened or last seeked. */
+static struct stretch_t*	stretch = NULL;
+/* Number of channels given by the decoder, and the gains used to downmix
+ * them if there are more than channels. */
+static uint8_t				decChannels;
+static struct downmix_t		downmix;
+/* Gain given to the samples of the open file, in Q12. Samples are always
+ * 16-bit when it is not SAMPLE_GAIN_UNITY. */
+static int16_t				gain;
+/* Frames of the open file decoded so far, and in total or 0 if unknown, at
+ * the rate of the output stream. */
+static uint64_t				decodedFrames;
+static uint64_t				totalFrames;
+/*
+ * The next file, whilst it fades in over the end of the open file, else
+ * fadeCtx is NULL. Its samples are decoded ahead into fadeBuf, which holds
+ * fadeLen samples, to be mixed with those of the open file from its frame
+ * fadeStart. fadePos frames of the fade have been mixed so far. Once the
+ * open file has ended, fadeEnded is set until fadeBuf has been played out.
+ */
+static struct decoder_fn	fadeDecoder;
+static void*				fadeCtx = NULL;
+static struct resample_t*	fadeResample = NULL;
+static int16_t				fadeGain;
+static int16_t*				fadeBuf = NULL;
+static size_t				fadeLen;
+static uint64_t				fadeStart;
+static uint64_t				fadePos;
+static uint32_t				fadeStep;
+static uint64_t				fadeDecodedFrames;
+static uint64_t				fadeTotalFrames;
+static bool					fadeEnded;
+/* Number of times the decoder has moved on to the next file, and the number
+ * of times playback has followed it, since the current track was opened. */
+static unsigned				decodedTracks;
+static unsigned				playedTracks;
+/* Number of bytes that each buffer can hold. */
+static size_t				bufCapacity = 0;
+/* Buffers that the decoder may fill. */
+static struct spsc_t		freeQueue;
+/* Buffers filled by the decoder, waiting to be queued to the output. */
+static struct spsc_t		readyQueue;
+/* Signalled when a buffer is added to freeQueue or decoding is started,
+ * stopped or quit. */
+static struct event_t		decodeEvent;
+static atomic_bool			decodeStop;
+static atomic_bool			decodeQuit;
+/* Set by the decoder thread once it will not fill any more buffers. */
+static atomic_bool			decodeDone;
+
+/**
+ * Set the output used for playback. Must be called before playbackInit().
+ *
+ * \param	out	Output functions to use.
+ */
+void setPlaybackOutput(const struct output_fn* out)
+{
+	output = *out;
+}
+
+/**
+ * Get the file to open in place of a music file, which is its transcoded copy
+ * if one has been cached.
+ *
+ * \param	file	Music file.
+ * \param	cached	Space for the location of a transcoded copy.
+ * \return			file, or cached if there is a transcoded copy.
+ */
+static const char* cachedFile(const char* file, char cached[PATH_MAX])
+{
+	return cacheLookup(file, cached, PATH_MAX) ? cached : file;
+}
+
+/**
+ * Set the file to play once the current file ends. If it has the same number
+ * of channels as the current file, it is decoded whilst the last buffers of
+ * the current file are still playing, so that there is no gap between the two,
+ * or crossfaded with the end of the current file if crossfades are set with
+ * setPlaybackCrossfade(). A file at another sampling rate is resampled to that
+ * of the output stream, unless the current file is played as 8-bit samples.
+ *
+ * \param	file	File to play next, or NULL to stop after the current file.
+ */
+void setNextFile(const char* file)
+{
+	char* next = NULL;
+	char cached[PATH_MAX];
+
+	if(file != NULL)
+		next = strdup(file);
+
+	free(atomic_exchange(&nextFile, next));
+	prefetchFile(file == NULL ? NULL : cachedFile(file, cached));
+}
+
+/**
+ * Send a command to the playback thread. Commands must all be sent from the
+ * same thread.
+ *
+ * \param	cmd	Command to send. Ownership of any files passes to the
+ *				playback thread on success.
+ * \return		0 on success, else failure with errno set.
+ */
+static int sendCommand(struct playbackCmd_t* cmd)
+{
+	if(isInit == false)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	cmd->time = platformTime();
+	cmd->serial = cmdSerial;
+
+	/* Events of the current file are no longer wanted once it is replaced or
+	 * stopped. */
+	if(cmd->cmd == PLAYBACK_CMD_PLAY || cmd->cmd == PLAYBACK_CMD_NEXT ||
+			cmd->cmd == PLAYBACK_CMD_STOP)
+		cmd->serial++;
+
+	if(spscPush(&cmdQueue, cmd) == false)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+
+	cmdSerial = cmd->serial;
+	eventSignal(&playbackEvent);
+	return 0;
+}
+
+/**
+ * Stop the current file, if any, and play another file.
+ *
+ * \param	file	File to play.
+ * \param	next	File to play once file ends, as with setNextFile().
+ * \return			0 on success, else failure with errno set.
+ */
+int playbackPlay(const char* file, const char* next)
+{
+	struct playbackCmd_t cmd = { .cmd = PLAYBACK_CMD_PLAY };
+	char cached[PATH_MAX];
+
+	if((cmd.file = strdup(file)) == NULL ||
+			(next != NULL && (cmd.next = strdup(next)) == NULL))
+		goto err;
+
+	atomic_store(&playing, true);
+	atomic_store(&paused, false);
+
+	if(sendCommand(&cmd) != 0)
+		goto err;
+
+	prefetchFile(next == NULL ? NULL : cachedFile(next, cached));
+	return 0;
+
+err:
+	free(cmd.file);
+	free(cmd.next);
+	return -1;
+}
+
+/**
+ * Stop the current file and play the file set with setNextFile() straight
+ * away.
+ *
+ * \return	0 on success, else failure with errno set.
+ */
+int playbackNext(void)
+{
+	struct playbackCmd_t cmd = { .cmd = PLAYBACK_CMD_NEXT };
+
+	return sendCommand(&cmd);
+}
+
+/**
+ * Take the oldest event reported by the playback thread, skipping those of
+ * files that were since replaced or stopped.
+ *
+ * \param	event	Set to the event.
+ * \return			false if there are no more events, else true.
+ */
+bool playbackGetEvent(struct playbackEvent_t* event)
+{
+	struct queuedEvent_t item;
+
+	while(mpscPop(&eventQueue, &item) == true)
+	{
+		if(item.serial != cmdSerial)
+			continue;
+
+		*event = item.event;
+		return true;
+	}
+
+	return false;
+}
+
+/**
+ * Get the position of playback now, carried on from the last position
+ * published by the playback thread. May be called from any thread between
+ * playbackInit() and playbackExit().
+ *
+ * \param	pos	Set to the position.
+ */
+void playbackGetPosition(struct playbackPosition_t* pos)
+{
+	struct playbackClock_t clk;
+	uint64_t now = platformTime();
+	uint64_t moved;
+	size_t samples;
+
+	seqlockRead(&clockLock, &clk);
+	*pos = clk.pos;
+	pos->time = now;
+
+	if(clk.rate == 0)
+		return;
+
+	/* The sample published may not be heard until after now. */
+	if(now >= clk.pos.time)
+	{
+		moved = (now - clk.pos.time) * clk.rate / 1000000000;
+		samples = clk.pos.samples_played + moved;
+	}
+	else
+	{
+		moved = (clk.pos.time - now) * clk.rate / 1000000000;
+		samples = moved < clk.pos.samples_played ?
+			clk.pos.samples_played - moved : 0;
+	}
+
+	if(samples > clk.end)
+		samples = clk.end;
+
+	pos->samples_played = samples - samples % clk.channels;
+}
+
+/**
+ * Move playback of the current file to another position.
+ *
+ * \param	pos	Position in the same units as samples_played of
+ *				struct playbackPosition_t.
+ * \return		0 on success, else failure with errno set.
+ */
+int playbackSeek(size_t pos)
+{
+	struct playbackCmd_t cmd = { .cmd = PLAYBACK_CMD_SEEK, .pos = pos };
+
+	return sendCommand(&cmd);
+}
+
+/**
+ * Set how files are normalised with ReplayGain. Takes effect from the next file
+ * that is opened.
+ *
+ * \param	mode	Which gain of each file to use.
+ * \param	preamp	Gain added to that of each file, in hundredths of a dB.
+ */
+void setPlaybackGain(enum replaygain_mode mode, int32_t preamp)
+{
+	atomic_store(&gainMode, mode);
+	atomic_store(&gainPreamp, preamp);
+}
+
+/**
+ * Set the length of crossfades between a file and the file set to play next.
+ * Takes effect from the next file that is opened.
+ *
+ * \param	ms	Length of crossfades in milliseconds, or 0 for none.
+ */
+void setPlaybackCrossfade(unsigned ms)
+{
+	atomic_store(&crossfadeMs, ms);
+}
+
+/**
+ * Set the sampling rate of the output stream, and how well files at other
+ * rates are resampled to it. Takes effect from the next file that is opened.
+ *
+ * \param	rate	Sampling rate, or 0 to use that of the file that starts the
+ *					stream, so that only the files that follow on from it at
+ *					another rate are resampled.
+ * \param	quality	Quality of resampling.
+ */
+void setPlaybackRate(uint32_t rate, enum resample_quality quality)
+{
+	atomic_store(&outputRate, rate);
+	atomic_store(&resampleQuality, quality);
+}
+
+/**
+ * Set the speed of playback, without changing the pitch. Takes effect from the
+ * next buffer decoded, unless the current file is played as 8-bit samples.
+ *
+ * \param	percent	Speed in percent, from PLAYBACK_SPEED_MIN to
+ *					PLAYBACK_SPEED_MAX.
+ */
+void setPlaybackSpeed(unsigned percent)
+{
+	if(percent < PLAYBACK_SPEED_MIN)
+		percent = PLAYBACK_SPEED_MIN;
+	else if(percent > PLAYBACK_SPEED_MAX)
+		percent = PLAYBACK_SPEED_MAX;
+
+	atomic_store(&playbackSpeed, percent);
+}
+
+/**
+ * Pause or play current file.
+ *
+ * \return	True if paused.
+ */
+bool togglePlayback(void)
+{
+	struct playbackCmd_t cmd = { .cmd = PLAYBACK_CMD_PAUSE };
+
+	cmd.paused = !atomic_load(&paused);
+
+	if(sendCommand(&cmd) != 0)
+		return !cmd.paused;
+
+	atomic_store(&paused, cmd.paused);
+	return cmd.paused;
+}
+
+/**
+ * Stops current playback.
+ */
+void stopPlayback(void)
+{
+	struct playbackCmd_t cmd = { .cmd = PLAYBACK_CMD_STOP };
+
+	sendCommand(&cmd);
+}
+
+/**
+ * Returns whether music is playing or paused.
+ */
+bool isPlaying(void)
+{
+	return atomic_load(&playing);
+}
+
+/**
+ * Report an event to the UI. May be called from the playback thread or the
+ * decoder thread. The event is lost if the UI has let the queue fill up.
+ *
+ * \param	type	Kind of event.
+ * \param	error	Error number of PLAYBACK_EVENT_ERROR, else 0.
+ * \param	samples	Position of PLAYBACK_EVENT_POSITION, else 0.
+ */
+static void postEvent(enum playback_event type, int error, size_t samples)
+{
+	struct queuedEvent_t item = {
+		.event = {
+			.type = type,
+			.error = error,
+			.samples = samples,
+			.time = platformTime()
+		},
+		.serial = atomic_load(&eventSerial)
+	};
+
+	mpscPush(&eventQueue, &item);
+}
+
+/**
+ * Obtain the number of buffers to use for the decode-ahead ring. Enough
+ * buffers are used to hold PLAYBACK_AHEAD_MS of audio, limited to a quarter of
+ * the memory available to the output.
+ *
+ * \param	decoder	Decoder functions.
+ * \param	ctx		Context of open file.
+ * \return			Number of buffers to allocate.
+ */
+static unsigned getBufferCount(const struct decoder_fn* decoder, void* ctx)
+{
+	size_t bufBytes = decoder->buffSize * OUTPUT_SAMPLE_SIZE(format);
+	size_t aheadSamples;
+	size_t count;
+	size_t memCount;
+
+	aheadSamples = (size_t)streamRate * (*decoder->channels)(ctx) *
+		PLAYBACK_AHEAD_MS / 1000;
+	count = (aheadSamples + decoder->buffSize - 1) / decoder->buffSize;
+	/* Buffers that are already allocated count as free. */
+	memCount = ((*output.spaceFree)() / 4 + bufsAlloc * bufCapacity) /
+		bufBytes;
+
+	if(count > memCount)
+		count = memCount;
+
+	if(count < PLAYBACK_BUFS_MIN)
+		count = PLAYBACK_BUFS_MIN;
+	else if(count > PLAYBACK_BUFS_MAX)
+		count = PLAYBACK_BUFS_MAX;
+
+	return count;
+}
+
+static void freeBuffers(void)
+{
+	for(unsigned i = 0; i < bufsAlloc; i++)
+		(*output.free)(&bufs[i].out);
+
+	bufsAlloc = 0;
+	bufCapacity = 0;
+}
+
+/**
+ * Make sure that enough buffers are allocated for a track. Buffers are only
+ * reallocated if the track needs larger buffers than the previous tracks.
+ *
+ * \param	count		Number of buffers wanted.
+ * \param	capacity	Number of bytes each buffer must hold.
+ * \return				Number of buffers available, or 0 on failure with
+ *						errno set.
+ */
+static unsigned allocBuffers(unsigned count, size_t capacity)
+{
+	if(capacity > bufCapacity)
+	{
+		freeBuffers();
+		bufCapacity = capacity;
+	}
+
+	while(bufsAlloc < count)
+	{
+		if((*output.alloc)(&bufs[bufsAlloc].out, bufCapacity) != 0)
+			break;
+
+		bufs[bufsAlloc].track = NULL;
+		bufsAlloc++;
+	}
+
+	/* Make do with a shallower ring if memory runs out. */
+	if(bufsAlloc < PLAYBACK_BUFS_MIN)
+	{
+		errno = ENOMEM;
+		return 0;
+	}
+
+	return count < bufsAlloc ? count : bufsAlloc;
+}
+
+/**
+ * Open a file with a new decoder instance. The file is only opened once; the
+ * decoder reads on from the bytes used to find its type.
+ *
+ * \param	dec		Decoder functions to set.
+ * \param	file	File to open.
+ * \return			Decoder context, or NULL on failure with errno set.
+ */
+static void* openDecoder(struct decoder_fn* dec, const char* file)
+{
+	struct probe_t* probe;
+	char cached[PATH_MAX];
+	void* ctx;
+
+	if((probe = probeOpen(cachedFile(file, cached))) == NULL)
+		return NULL;
+
+	if(probe->decoder == NULL)
+	{
+		probeClose(probe);
+		errno = FILE_NOT_SUPPORTED;
+		return NULL;
+	}
+
+	memset(dec, 0, sizeof(*dec));
+	(*probe->decoder->set)(dec);
+
+	if((ctx = (*dec->init)(probe)) == NULL)
+	{
+		probeClose(probe);
+		errno = DECODER_INIT_FAIL;
+	}
+
+	return ctx;
+}
+
+/**
+ * Agree on a format of samples with a decoder.
+ *
+ * \param	dec		Decoder functions.
+ * \param	ctx		Decoder context.
+ * \param	fmt		Most compact format that may be used.
+ * \return			Format of samples that the decoder will give.
+ */
+static enum output_format setDecoderFormat(const struct decoder_fn* dec,
+		void* ctx, enum output_format fmt)
+{
+	if(dec->setFormat == NULL)
+		return OUTPUT_FORMAT_PCM16;
+
+	return (*dec->setFormat)(ctx, fmt);
+}
+
+/**
+ * Get the ReplayGain to give the samples of a file, with the current settings.
+ *
+ * \param	dec		Decoder functions.
+ * \param	ctx		Decoder context.
+ * \return			Gain in Q12.
+ */
+static int16_t getDecoderGain(const struct decoder_fn* dec, void* ctx)
+{
+	struct replaygain_t rg;
+
+	if(dec->getGain == NULL)
+		return SAMPLE_GAIN_UNITY;
+
+	replaygainInit(&rg);
+	(*dec->getGain)(ctx, &rg);
+	return replaygainFactor(&rg, atomic_load(&gainMode),
+			atomic_load(&gainPreamp));
+}
+
+/**
+ * Set up resampling of a file to the rate of the output stream, if it has
+ * another rate. Samples of the file must be 16-bit.
+ *
+ * \param	dec		Decoder functions.
+ * \param	ctx		Decoder context.
+ * \param	out		Set to the resampler, or NULL if the file is at the rate
+ *					of the output stream.
+ * \return			0 on success, else failure with errno set.
+ */
+static int openResample(const struct decoder_fn* dec, void* ctx,
+		struct resample_t** out)
+{
+	uint32_t rate = (*dec->rate)(ctx);
+	struct resample_t* rs;
+
+	*out = NULL;
+
+	if(rate == streamRate)
+		return 0;
+
+	if((rs = malloc(sizeof(struct resample_t) +
+					dec->buffSize * sizeof(int16_t))) == NULL)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* Each decode is downmixed before it is resampled. */
+	if(resampleInit(&rs->rs, rate, streamRate, channels,
+				dec->buffSize / (*dec->channels)(ctx),
+				atomic_load(&resampleQuality)) != 0)
+	{
+		free(rs);
+		return -1;
+	}
+
+	rs->ended = false;
+	*out = rs;
+	return 0;
+}
+
+static void closeResample(struct resample_t** rs)
+{
+	if(*rs != NULL)
+		resampleExit(&(*rs)->rs);
+
+	free(*rs);
+	*rs = NULL;
+}
+
+/**
+ * Get the number of frames of the output stream made from frames of a file.
+ *
+ * \param	rs		Resampler of the file, or NULL.
+ * \param	frames	Frames of the file.
+ * \return			Frames of the output stream.
+ */
+static uint64_t streamFrames(const struct resample_t* rs, uint64_t frames)
+{
+	return rs == NULL ? frames : resampleFrames(&rs->rs, frames);
+}
+
+static void closeDecoder(void)
+{
+	if(decoderCtx != NULL)
+		(*decoder.exit)(decoderCtx);
+
+	decoderCtx = NULL;
+	closeResample(&resample);
+}
+
+static void freeTrack(struct track_t* track)
+{
+	if(track == NULL)
+		return;
+
+	free(track->file);
+	free(track);
+}
+
+/**
+ * Discard a track that was decoded ahead but never started playing. Its file
+ * is set to be played next again, unless another file has been set since.
+ *
+ * \param	track	Track to discard. Freed by this function.
+ */
+static void restoreTrack(struct track_t* track)
+{
+	char* expected = NULL;
+
+	if(track == NULL)
+		return;
+
+	if(atomic_compare_exchange_strong(&nextFile, &expected,
+				track->file) == true)
+		track->file = NULL;
+
+	freeTrack(track);
+}
+
+/**
+ * Start stretching the output stream, if its speed is changed and its samples
+ * are 16-bit. Once started, the stream is stretched until the track is closed
+ * or seeked, even if its speed is set back. If memory runs out, the stream is
+ * played at its own speed.
+ */
+static void openStretch(void)
+{
+	struct stretch_t* s;
+
+	if(stretch != NULL || format != OUTPUT_FORMAT_PCM16 ||
+			atomic_load(&playbackSpeed) == 100)
+		return;
+
+	if((s = malloc(sizeof(struct stretch_t) + bufCapacity)) == NULL)
+		return;
+
+	if(stretchInit(&s->st, streamRate, channels,
+				bufCapacity / (sizeof(int16_t) * channels)) != 0)
+	{
+		free(s);
+		return;
+	}
+
+	s->ended = false;
+	s->track = NULL;
+	stretch = s;
+}
+
+/**
+ * Stop stretching the output stream. A track that was decoded ahead into the
+ * stretcher is set to be played next again.
+ */
+static void closeStretch(void)
+{
+	if(stretch == NULL)
+		return;
+
+	restoreTrack(stretch->track);
+	stretchExit(&stretch->st);
+	free(stretch);
+	stretch = NULL;
+}
+
+/**
+ * Open the file set with setNextFile() in place of the current file. Called by
+ * the decoder thread once the current file has been fully decoded, or once it
+ * is close enough to its end to start a crossfade. The current file is only
+ * closed if the next file can follow on from it.
+ *
+ * \param	chans		Number of channels given by the current decoder.
+ * \param	fade		If true, open the next file to fade in over the end of
+ *						the current file, which is left open.
+ * \return				Information on the opened track, or NULL if there is
+ *						no next file or it cannot be played in the current
+ *						output stream.
+ */
+static struct track_t* openNextTrack(uint8_t chans, bool fade)
+{
+	struct track_t* track;
+	struct decoder_fn dec;
+	struct resample_t* rs;
+	void* ctx;
+	char* file = atomic_exchange(&nextFile, NULL);
+	unsigned long opens = fileOpens();
+	int16_t decGain;
+
+	if(file == NULL)
+		return NULL;
+
+	if((ctx = openDecoder(&dec, file)) == NULL)
+		goto err;
+
+	decGain = getDecoderGain(&dec, ctx);
+
+	/* Changing the output format would leave a gap anyway. Files at another
+	 * rate are decoded into their resampler rather than the buffers. */
+	if((*dec.channels)(ctx) != chans ||
+			(chans > 2 && dec.order != decoder.order) ||
+			(format == OUTPUT_FORMAT_PCM8 && (decGain != SAMPLE_GAIN_UNITY ||
+				(*dec.rate)(ctx) != streamRate)) ||
+			setDecoderFormat(&dec, ctx, format) != format ||
+			((*dec.rate)(ctx) == streamRate &&
+			dec.buffSize * OUTPUT_SAMPLE_SIZE(format) > bufCapacity))
+		goto err_dec;
+
+	if(openResample(&dec, ctx, &rs) != 0)
+		goto err_dec;
+
+	if((track = malloc(sizeof(struct track_t))) == NULL)
+		goto err_rs;
+
+	track->file = file;
+	track->samples_total = 0;
+	track->samples_per_second = streamRate * channels;
+	track->lead = 0;
+
+	if(dec.getFileSamples != NULL)
+		track->samples_total = streamFrames(rs,
+				(*dec.getFileSamples)(ctx) / chans) * channels;
+
+	track->file_opens = fileOpens() - opens;
+
+	if(fade == true)
+	{
+		fadeDecoder = dec;
+		fadeCtx = ctx;
+		fadeResample = rs;
+		fadeGain = decGain;
+		fadeDecodedFrames = 0;
+		fadeTotalFrames = track->samples_total / channels;
+	}
+	else
+	{
+		closeDecoder();
+		decoder = dec;
+		decoderCtx = ctx;
+		resample = rs;
+		gain = decGain;
+		decodedFrames = 0;
+		totalFrames = track->samples_total / channels;
+	}
+
+	decodedTracks++;
+	return track;
+
+err_rs:
+	closeResample(&rs);
+
+err_dec:
+	(*dec.exit)(ctx);
+
+err:
+	free(file);
+	return NULL;
+}
+
+/**
+ * Downmix decoded samples to stereo if they have more channels, and give them
+ * their ReplayGain.
+ *
+ * \param	data	Decoded samples, changed in place.
+ * \param	read	Samples decoded, as returned by decode().
+ * \param	g		ReplayGain of the file, in Q12.
+ * \return			Samples for all played channels, or read if it is 0 or
+ *					negative.
+ */
+static int64_t convertSamples(int16_t* data, int64_t read, int16_t g)
+{
+	if(read <= 0)
+		return read;
+
+	if(decChannels != channels)
+	{
+		sampleDownmix(&downmix, data, data, read / decChannels);
+		read = read / decChannels * channels;
+	}
+
+	if(g != SAMPLE_GAIN_UNITY)
+		sampleGain(data, read, g);
+
+	return read;
+}
+
+/**
+ * Decode part of a file, downmixing it to stereo if it has more channels,
+ * giving it its ReplayGain and resampling it to the rate of the output stream
+ * if it has another rate. Resampled files are decoded until the buffer is
+ * full, with what does not fit kept in the resampler for next time.
+ *
+ * \param	dec		Decoder functions.
+ * \param	ctx		Decoder context.
+ * \param	g		ReplayGain of the file, in Q12.
+ * \param	rs		Resampler of the file, or NULL.
+ * \param	data	Buffer to fill, with room for dec->buffSize samples, or
+ *					for frames frames if the file is resampled.
+ * \param	frames	Size of buffer in frames.
+ * \return			Samples read for all played channels. 0 for end of file,
+ *					negative for error.
+ */
+static int64_t readSamples(const struct decoder_fn* dec, void* ctx, int16_t g,
+		struct resample_t* rs, int16_t* data, size_t frames)
+{
+	size_t made = 0;
+
+	if(rs == NULL)
+		return convertSamples(data, (*dec->decode)(ctx, data), g);
+
+	while((made += resampleRead(&rs->rs, data + made * channels,
+					frames - made)) < frames && rs->ended == false)
+	{
+		int64_t read = convertSamples(rs->buf, (*dec->decode)(ctx, rs->buf), g);
+
+		if(read < 0)
+			return read;
+
+		if(read == 0)
+		{
+			resampleFlush(&rs->rs);
+			rs->ended = true;
+		}
+		else
+			resampleWrite(&rs->rs, rs->buf, read / channels);
+	}
+
+	return made * channels;
+}
+
+/**
+ * Decode part of the open file into a buffer.
+ *
+ * \param	data	Buffer to fill, with room for decoder.buffSize samples.
+ * \return			Samples read for all played channels. 0 for end of file,
+ *					negative for error.
+ */
+static int64_t decodeBuffer(int16_t* data)
+{
+	int64_t read = readSamples(&decoder, decoderCtx, gain, resample, data,
+			bufCapacity / (sizeof(int16_t) * channels));
+
+	if(read > 0)
+		decodedFrames += read / channels;
+	else if(read < 0)
+		postEvent(PLAYBACK_EVENT_ERROR, DECODER_READ_FAIL, 0);
+
+	return read;
+}
+
+/**
+ * Stop fading in the next file.
+ *
+ * \param	keep	If true, the next file takes the place of the current
+ *					file, which is closed. Otherwise the next file is closed.
+ *					Samples of it that were decoded ahead are dropped.
+ */
+static void closeFade(bool keep)
+{
+	if(fadeCtx == NULL)
+		return;
+
+	if(keep == true)
+	{
+		closeDecoder();
+		decoder = fadeDecoder;
+		decoderCtx = fadeCtx;
+		resample = fadeResample;
+		fadeResample = NULL;
+		gain = fadeGain;
+		decodedFrames = fadeDecodedFrames;
+		totalFrames = fadeTotalFrames;
+	}
+	else
+	{
+		(*fadeDecoder.exit)(fadeCtx);
+		closeResample(&fadeResample);
+	}
+
+	fadeCtx = NULL;
+	free(fadeBuf);
+	fadeBuf = NULL;
+	fadeLen = 0;
+	fadeEnded = false;
+}
+
+/**
+ * Start fading in the next file, if the current file is within the length of
+ * a crossfade of its end.
+ *
+ * \param	chans		Number of channels given by the current decoder.
+ * \return				Information on the track fading in, or NULL if no fade
+ *						was started.
+ */
+static struct track_t* startFade(uint8_t chans)
+{
+	uint64_t frames = (uint64_t)atomic_load(&crossfadeMs) * streamRate / 1000;
+	struct track_t* track;
+
+	/* Mixing is only done on 16-bit samples. The fade is started in time for
+	 * the next buffer to reach its start. */
+	if(frames == 0 || format != OUTPUT_FORMAT_PCM16 || totalFrames == 0 ||
+			decodedFrames >= totalFrames ||
+			decodedFrames + bufCapacity / (sizeof(int16_t) * channels) +
+			frames < totalFrames)
+		return NULL;
+
+	/* Room for the samples left over from one decode of each file, which
+	 * each fit in a buffer. */
+	if((fadeBuf = malloc(2 * bufCapacity)) == NULL)
+		return NULL;
+
+	if((track = openNextTrack(chans, true)) == NULL)
+	{
+		free(fadeBuf);
+		fadeBuf = NULL;
+		return NULL;
+	}
+
+	/* The fade is shortened if the next file was set late. */
+	fadeStart = totalFrames > frames ? totalFrames - frames : 0;
+	if(fadeStart < decodedFrames)
+		fadeStart = decodedFrames;
+
+	fadeLen = 0;
+	fadeEnded = false;
+	fadePos = 0;
+	fadeStep = sampleFadeStep(totalFrames - fadeStart);
+	track->lead = (fadeStart - decodedFrames) * channels;
+	return track;
+}
+
+/**
+ * Decode part of the open file and mix it with the next file fading in. Once
+ * the open file ends, the next file takes its place.
+ *
+ * \param	data	Buffer to fill, with room for decoder.buffSize samples.
+ * \return			Samples read for all played channels. 0 for end of file,
+ *					negative for error.
+ */
+static int64_t fadeBuffer(int16_t* data)
+{
+	int64_t read = fadeEnded == true ? 0 : decodeBuffer(data);
+	uint64_t first;
+	size_t skip, mix;
+
+	if(read <= 0)
+	{
+		size_t len = fadeLen < bufCapacity / sizeof(int16_t) ?
+			fadeLen : bufCapacity / sizeof(int16_t);
+
+		/* The next file takes over once the samples decoded ahead of it
+		 * have been played out, a buffer at a time. */
+		memcpy(data, fadeBuf, len * sizeof(int16_t));
+		fadeLen -= len;
+		memmove(fadeBuf, fadeBuf + len, fadeLen * sizeof(int16_t));
+		fadeEnded = true;
+
+		if(fadeLen > 0)
+			return (int64_t)len;
+
+		closeFade(true);
+		return len > 0 ? (int64_t)len : decodeBuffer(data);
+	}
+
+	/* Leave the frames before the start of the fade as they are. */
+	first = decodedFrames - read / channels;
+	skip = 0;
+	if(first < fadeStart)
+		skip = fadeStart - first < (uint64_t)read / channels ?
+			fadeStart - first : (uint64_t)read / channels;
+
+	data += skip * channels;
+	mix = read - skip * channels;
+
+	if(mix == 0)
+		return read;
+
+	while(fadeLen < mix)
+	{
+		int64_t got = readSamples(&fadeDecoder, fadeCtx, fadeGain, fadeResample,
+				fadeBuf + fadeLen,
+				(bufCapacity / sizeof(int16_t) - fadeLen) / channels);
+
+		/* The next file may be shorter than the fade. */
+		if(got <= 0)
+		{
+			memset(fadeBuf + fadeLen, 0, (mix - fadeLen) * sizeof(int16_t));
+			fadeLen = mix;
+			break;
+		}
+
+		fadeLen += got;
+		fadeDecodedFrames += got / channels;
+	}
+
+	sampleFade(data, fadeBuf, mix / channels, channels, fadePos, fadeStep);
+	fadePos += mix / channels;
+	fadeLen -= mix;
+	memmove(fadeBuf, fadeBuf + mix, fadeLen * sizeof(int16_t));
+	return read;
+}
+
+/**
+ * Fill a buffer with the next samples of the output stream, crossfading into
+ * the next file or carrying on into it once the open file ends.
+ *
+ * \param	data	Buffer to fill, with room for bufCapacity bytes.
+ * \param	chans	Number of channels given by the current decoder.
+ * \param	track	Set to the track that starts in the buffer, if any. Any
+ *					track it was already set to is skipped.
+ * \return			Samples read for all played channels. 0 for the end of
+ *					the last file, negative for error.
+ */
+static int64_t fillBuffer(int16_t* data, uint8_t chans,
+		struct track_t** track)
+{
+	struct track_t* next;
+	int64_t read;
+
+	/* The next file starts to fade in from this buffer. */
+	if(fadeCtx == NULL && (next = startFade(chans)) != NULL)
+	{
+		freeTrack(*track);
+		*track = next;
+	}
+
+	if(fadeCtx != NULL)
+		read = fadeBuffer(data);
+	else
+		read = decodeBuffer(data);
+
+	/* Carry on into the next file in the same buffer. */
+	while(read <= 0 && (next = openNextTrack(chans, false)) != NULL)
+	{
+		/* Skip over tracks that had no samples. */
+		freeTrack(*track);
+		*track = next;
+		read = decodeBuffer(data);
+	}
+
+	return read;
+}
+
+/**
+ * Fill a buffer with the output stream at the speed set, from the stretcher.
+ * The stretcher is given buffers from fillBuffer() whenever it runs out.
+ *
+ * \param	data	Buffer to fill, with room for bufCapacity bytes.
+ * \param	chans	Number of channels given by the current decoder.
+ * \param	source	Set to the samples of the files that the buffer plays.
+ * \param	track	Set to the track that starts in the buffer, if any.
+ * \return			Samples made for all played channels. 0 once the end
+ *					of the last file has been played.
+ */
+static int64_t stretchBuffer(int16_t* data, uint8_t chans, size_t* source,
+		struct track_t** track)
+{
+	struct stretch_t*	s = stretch;
+	size_t				frames = bufCapacity / (sizeof(int16_t) * channels);
+	uint64_t			first = stretchSource(&s->st);
+	uint64_t			last;
+	size_t				made = 0;
+
+	stretchSetSpeed(&s->st, (uint64_t)atomic_load(&playbackSpeed) *
+			STRETCH_SPEED_UNITY / 100);
+
+	while((made += stretchRead(&s->st, data + made * channels,
+					frames - made)) < frames && s->ended == false)
+	{
+		struct track_t* next = NULL;
+		int64_t read = fillBuffer(s->buf, chans, &next);
+
+		/* A track that would not reach the output before the next one
+		 * starts is skipped. */
+		if(next != NULL)
+		{
+			freeTrack(s->track);
+			s->track = next;
+			s->trackStart = s->st.inPos + next->lead / channels;
+		}
+
+		if(read <= 0)
+		{
+			stretchFlush(&s->st);
+			s->ended = true;
+		}
+		else
+			stretchWrite(&s->st, s->buf, read / channels);
+	}
+
+	last = stretchSource(&s->st);
+	*source = (last - first) * channels;
+
+	/* Mark the track on the buffer that plays its start, with the samples of
+	 * the previous track before it. */
+	if(s->track != NULL && s->trackStart < last)
+	{
+		s->track->lead = s->trackStart > first ?
+			(s->trackStart - first) * channels : 0;
+		*track = s->track;
+		s->track = NULL;
+	}
+
+	return made * channels;
+}
 
 /**
- * Pause or play current file.
+ * Called by the output, from any thread, when a queued buffer has finished
+ * playing.
  *
- * \return	True if paused.
+ * \param	data	Unused.
  */
-bool togglePlayback(void)
+static void outputCallback(void* data)
 {
-	bool paused = ndspChnIsPaused(CHANNEL);
-	ndspChnSetPaused(CHANNEL, !paused);
-	return !paused;
+	(void) data;
+	eventSignal(&playbackEvent);
 }
 
 /**
- * Stops current playback. Playback thread should exit as a result.
+ * Fill buffers taken from freeQueue and pass them to the playback thread
+ * through readyQueue, until the end of the last file is reached or decodeStop
+ * is set.
  */
-void stopPlayback(void)
+static void decodeTrack(void)
 {
-	stop = true;
+	uint8_t chans = (*decoder.channels)(decoderCtx);
+	/* Track to mark on the next filled buffer. */
+	struct track_t* track = NULL;
+
+	while(atomic_load(&decodeStop) == false)
+	{
+		struct playbackBuf_t* buf;
+		int64_t read;
+		uint64_t start;
+		size_t source;
+
+		if(spscPop(&freeQueue, &buf) == false)
+		{
+			eventWait(&decodeEvent);
+			continue;
+		}
+
+		start = platformTime();
+
+		/* The speed may have been changed since the last buffer. */
+		openStretch();
+
+		if(stretch != NULL)
+			read = stretchBuffer(buf->out.data, chans, &source, &track);
+		else
+			source = read = fillBuffer(buf->out.data, chans, &track);
+
+		info->decode_ns += platformTime() - start;
+
+		if(read <= 0)
+			break;
+
+		buf->out.nsamples = read / channels;
+		buf->source = source;
+		buf->track = track;
+		track = NULL;
+
+		/* readyQueue holds every buffer, so this cannot fail. */
+		spscPush(&readyQueue, &buf);
+		eventSignal(&playbackEvent);
+	}
+
+	restoreTrack(track);
 }
 
 /**
- * Returns whether music is playing or paused.
+ * Decoder thread. Decodes the open file whenever the playback thread starts
+ * it, until decodeQuit is set.
+ *
+ * \param	arg	Unused.
  */
-bool isPlaying(void)
+static void decodeThread(void* arg)
+{
+	(void) arg;
+
+	while(atomic_load(&decodeQuit) == false)
+	{
+		if(atomic_load(&decodeDone) == true)
+		{
+			eventWait(&decodeEvent);
+			continue;
+		}
+
+		decodeTrack();
+		atomic_store(&decodeDone, true);
+		eventSignal(&playbackEvent);
+	}
+}
+
+/**
+ * Let the decoder thread fill the buffers in freeQueue.
+ */
+static void startDecoder(void)
+{
+	atomic_store(&decodeStop, false);
+	atomic_store(&decodeDone, false);
+	eventSignal(&decodeEvent);
+}
+
+/**
+ * Wait for the decoder thread to stop using the decoder and the buffers.
+ */
+static void stopDecoder(void)
 {
-	return !stop;
+	atomic_store(&decodeStop, true);
+	eventSignal(&decodeEvent);
+
+	while(atomic_load(&decodeDone) == false)
+		eventWaitTimeout(&playbackEvent, PLAYBACK_WAIT_NS);
 }
 
 /**
- * Should only be called from a new thread only, and have only one playback
- * thread at time. This function has not been written for more than one
- * playback thread in mind.
+ * Update playback information once a track that followed on from the previous
+ * track starts playing.
  *
- * \param	infoIn	Playback information.
+ * \param	track	Track that started playing. Freed by this function.
  */
-void playFile(void* infoIn)
+static void publishTrack(struct track_t* track)
 {
-	struct decoder_fn decoder = { 0 };
-	struct playbackInfo_t* info = infoIn;
-	int16_t*		buffer1 = NULL;
-	int16_t*		buffer2 = NULL;
-	ndspWaveBuf		waveBuf[2];
-	bool			lastbuf = false;
-	int				ret = -1;
-	const char*		file = info->file;
-	bool			isNdspInit = false;
+	snprintf(info->file, sizeof(info->file), "%s", track->file);
+	position.samples_total = track->samples_total;
+	position.samples_played = 0;
+	position.samples_per_second = track->samples_per_second;
+	position.serial++;
+	info->file_opens = track->file_opens;
+	leadSamples = track->lead;
+	/* There was no gap between the tracks. */
+	info->switch_ns = 0;
+	playedTracks++;
 
-	/* Reset previous stop command */
-	stop = false;
+	freeTrack(track);
+	postEvent(PLAYBACK_EVENT_NEXT_TRACK, 0, 0);
+}
 
-	switch(getFileType(file))
-	{
-		case FILE_TYPE_WAV:
-			setWav(&decoder);
-			break;
+/**
+ * Queue a buffer to the output.
+ */
+static void queueBuffer(struct playbackBuf_t* buf)
+{
+	(*output.queue)(&buf->out);
+	queue[(head + queued) % bufCount] = buf;
+	queued++;
 
-		case FILE_TYPE_FLAC:
-			setFlac(&decoder);
-			break;
+	if(switchStart != 0)
+	{
+		info->switch_ns = platformTime() - switchStart;
+		switchStart = 0;
+	}
+}
 
-		case FILE_TYPE_OPUS:
-			setOpus(&decoder);
-			break;
+/**
+ * Put every buffer of the ring back in freeQueue, with the output and decoder
+ * stopped.
+ *
+ * \param	first	Index of the first buffer to put in freeQueue.
+ */
+static void resetBuffers(unsigned first)
+{
+	spscClear(&freeQueue);
+	spscClear(&readyQueue);
 
-		case FILE_TYPE_MP3:
-			setMp3(&decoder);
-			break;
+	for(unsigned i = 0; i < bufCount; i++)
+	{
+		struct playbackBuf_t* buf = &bufs[i];
 
-		case FILE_TYPE_VORBIS:
-			setVorbis(&decoder);
-			break;
-		
-		case FILE_TYPE_SID:
-			setSid(&decoder);
-			break;
+		restoreTrack(buf->track);
+		buf->track = NULL;
 
-		default:
-			goto err;
+		if(i >= first)
+			spscPush(&freeQueue, &buf);
 	}
 
-	if(ndspInit() < 0)
+	queued = 0;
+	head = 0;
+	info->buffers_queued = 0;
+}
+
+/**
+ * Publish the position of playback for playbackGetPosition(), from the buffers
+ * that have finished playing and how much of the buffer playing has been heard.
+ */
+static void publishPosition(void)
+{
+	struct playbackClock_t clk = {
+		.pos = position,
+		.channels = channels,
+		.rate = 0,
+		.end = position.samples_played
+	};
+	struct playbackBuf_t* buf;
+	uint64_t frames;
+	uint64_t heard;
+	size_t lead;
+
+	clk.pos.time = platformTime();
+
+	if(isTrackOpen == false || queued == 0 || output.position == NULL)
 	{
-		errno = NDSP_INIT_FAIL;
-		goto err;
+		seqlockWrite(&clockLock, &clk);
+		return;
 	}
 
-	isNdspInit = true;
+	/* Samples of the previous track at the start of the buffer are not
+	 * counted. */
+	buf = queue[head];
+	lead = buf->source < leadSamples ? buf->source : leadSamples;
+	frames = buf->source / channels;
+	heard = frames * (*output.position)(&buf->out, &clk.pos.time) /
+		buf->out.nsamples * channels;
 
-	if((ret = (*decoder.init)(file)) != 0)
-	{
-		errno = DECODER_INIT_FAIL;
+	clk.end += buf->source - lead;
+
+	if((*output.isPaused)() == false)
+		clk.rate = frames * position.samples_per_second / buf->out.nsamples;
+
+	/* Until the previous track has played out, the first sample of this
+	 * track is heard later on. */
+	if(heard >= lead)
+		clk.pos.samples_played += heard - lead;
+	else if(clk.rate != 0)
+		clk.pos.time += (lead - heard) * 1000000000 / clk.rate;
+
+	seqlockWrite(&clockLock, &clk);
+}
+
+/**
+ * Stop playing the current track, keeping the output and buffers.
+ */
+static void closeTrack(void)
+{
+	struct playbackPosition_t heard;
+
+	if(isTrackOpen == false)
+		return;
+
+	/* Stay at the last sample heard, rather than going back to the end of
+	 * the last buffer that finished, and stop moving on from there straight
+	 * away. */
+	publishPosition();
+	playbackGetPosition(&heard);
+	position.samples_played = heard.samples_played;
+	isTrackOpen = false;
+	publishPosition();
+
+	stopDecoder();
+	(*output.flush)();
+	resetBuffers(bufCount);
+	closeStretch();
+	closeFade(false);
+	closeDecoder();
+
+	atomic_store(&playing, false);
+}
+
+/**
+ * Stop any current track and start playing a file.
+ *
+ * \param	file	File to play.
+ * \param	time	Time at which playback of the file was requested.
+ * \return			0 on success, else failure with errno set.
+ */
+static int openTrack(const char* file, uint64_t time)
+{
+	unsigned long opens = fileOpens();
+	uint32_t rate;
+	int ret;
+
+	closeTrack();
+
+	snprintf(info->file, sizeof(info->file), "%s", file);
+	position.samples_total = 0;
+	position.samples_played = 0;
+	position.samples_per_second = 0;
+	position.serial++;
+	leadSamples = 0;
+	info->buffers_total = 0;
+	info->buffers_queued = 0;
+	info->buffers_min_queued = 0;
+	info->wakeups = 0;
+	info->switch_ns = 0;
+	info->seek_ns = 0;
+	info->decode_ns = 0;
+	info->file_opens = 0;
+
+	if((decoderCtx = openDecoder(&decoder, file)) == NULL)
 		goto err;
-	}
 
-	if((*decoder.channels)() > 2 || (*decoder.channels)() < 1)
+	decChannels = (*decoder.channels)(decoderCtx);
+	channels = decChannels > 2 ? 2 : decChannels;
+
+	if(decChannels < 1 || (decChannels > 2 &&
+				sampleDownmixInit(&downmix, decChannels, decoder.order) != 0))
 	{
 		errno = UNSUPPORTED_CHANNELS;
 		goto err;
 	}
 
+	rate = (*decoder.rate)(decoderCtx);
+	if((streamRate = atomic_load(&outputRate)) == 0)
+		streamRate = rate;
+
+	/* Compact samples are played as they are, in smaller buffers. Samples
+	 * are only downmixed, given a gain, crossfaded, resampled and stretched
+	 * as 16-bit. */
+	gain = getDecoderGain(&decoder, decoderCtx);
+	format = setDecoderFormat(&decoder, decoderCtx,
+			decChannels > 2 || gain != SAMPLE_GAIN_UNITY ||
+			atomic_load(&crossfadeMs) != 0 || rate != streamRate ||
+			atomic_load(&playbackSpeed) != 100 ?
+			OUTPUT_FORMAT_PCM16 : OUTPUT_FORMAT_PCM8);
+
+	if(openResample(&decoder, decoderCtx, &resample) != 0)
+		goto err;
+
 	if(decoder.getFileSamples != NULL)
-		info->samples_total = decoder.getFileSamples();
-
-	info->samples_per_second = decoder.rate() * decoder.channels();
-	buffer1 = linearAlloc(decoder.buffSize * sizeof(int16_t));
-	buffer2 = linearAlloc(decoder.buffSize * sizeof(int16_t));
-
-	ndspChnReset(CHANNEL);
-	ndspChnWaveBufClear(CHANNEL);
-	ndspSetOutputMode(NDSP_OUTPUT_STEREO);
-	ndspChnSetInterp(CHANNEL, NDSP_INTERP_POLYPHASE);
-	ndspChnSetRate(CHANNEL, (*decoder.rate)());
-	ndspChnSetFormat(CHANNEL,
-			(*decoder.channels)() == 2 ? NDSP_FORMAT_STEREO_PCM16 :
-			NDSP_FORMAT_MONO_PCM16);
-
-	memset(waveBuf, 0, sizeof(waveBuf));
-	waveBuf[0].nsamples = (*decoder.decode)(&buffer1[0]) / (*decoder.channels)();
-	waveBuf[0].data_vaddr = &buffer1[0];
-	ndspChnWaveBufAdd(CHANNEL, &waveBuf[0]);
-
-	waveBuf[1].nsamples = (*decoder.decode)(&buffer2[0]) / (*decoder.channels)();
-	waveBuf[1].data_vaddr = &buffer2[0];
-	ndspChnWaveBufAdd(CHANNEL, &waveBuf[1]);
+		position.samples_total = streamFrames(resample,
+				(*decoder.getFileSamples)(decoderCtx) / decChannels) *
+			channels;
 
-	/**
-	 * There may be a chance that the music has not started by the time we get
-	 * to the while loop. So we ensure that music has started here.
-	 */
-	while(ndspChnIsPlaying(CHANNEL) == false);
+	position.samples_per_second = streamRate * channels;
+	info->file_opens = fileOpens() - opens;
+	decodedFrames = 0;
+	totalFrames = position.samples_total / channels;
+
+	if((*output.setFormat)(streamRate, channels, format) != 0)
+		goto err;
+
+	(*output.setPaused)(false);
+
+	if((bufCount = allocBuffers(getBufferCount(&decoder, decoderCtx),
+					decoder.buffSize * OUTPUT_SAMPLE_SIZE(format))) == 0)
+		goto err;
+
+	info->buffers_total = bufCount;
+	info->buffers_min_queued = bufCount;
+
+	resetBuffers(0);
+	decodedTracks = 0;
+	playedTracks = 0;
+	isTrackOpen = true;
+	atomic_store(&playing, true);
+	isStarting = true;
+	switchStart = time;
+	startDecoder();
+
+	/* Recently played files are transcoded, if the cache is running. */
+	cacheAdd(file);
+	return 0;
+
+err:
+	ret = errno;
+	closeDecoder();
+	atomic_store(&playing, false);
+	errno = ret;
+	return -1;
+}
+
+/**
+ * Move playback of the current track to another position. The first buffer
+ * from the new position is decoded by this thread and queued straight away,
+ * so that playback resumes without waiting for the decoder thread. Decoders
+ * that cannot seek decode the file from the start up to the position.
+ *
+ * \param	pos		Position in the same units as samples_played of
+ *					struct playbackPosition_t.
+ * \param	time	Time at which the seek was requested.
+ * \return			0 on success, else failure with errno set.
+ */
+static int seekTrack(size_t pos, uint64_t time)
+{
+	struct playbackBuf_t* buf = &bufs[0];
+	size_t skipped = 0;
+	int64_t read;
+
+	if(isTrackOpen == false)
+		return 0;
+
+	stopDecoder();
+	(*output.flush)();
+	resetBuffers(1);
+	closeStretch();
 
-	while(stop == false)
+	pos -= pos % channels;
+
+	/* A file fading in takes the place of the current file once it has
+	 * started playing. */
+	closeFade(decodedTracks == playedTracks);
+
+	/* The decoder may have moved on to the next file already. */
+	if(decodedTracks != playedTracks || decoder.seek == NULL)
 	{
-		svcSleepThread(100 * 1000);
+		closeDecoder();
+		if((decoderCtx = openDecoder(&decoder, info->file)) == NULL)
+			return -1;
 
-		/* When the last buffer has finished playing, break. */
-		if(lastbuf == true && waveBuf[0].status == NDSP_WBUF_DONE &&
-				waveBuf[1].status == NDSP_WBUF_DONE)
-			break;
+		/* The same file gives the same format again. 8-bit samples are
+		 * left as they are if the settings have changed since. */
+		setDecoderFormat(&decoder, decoderCtx, format);
+		gain = format == OUTPUT_FORMAT_PCM16 ?
+			getDecoderGain(&decoder, decoderCtx) : SAMPLE_GAIN_UNITY;
+		if(openResample(&decoder, decoderCtx, &resample) != 0)
+			return -1;
 
-		if(ndspChnIsPaused(CHANNEL) == true || lastbuf == true)
-			continue;
+		decodedTracks = playedTracks;
+		decodedFrames = 0;
+		totalFrames = position.samples_total / channels;
+	}
+
+	/* The stretcher starts again from the position. */
+	openStretch();
+
+	if(decoder.seek != NULL)
+	{
+		uint64_t frame = pos / channels;
 
-		if(waveBuf[0].status == NDSP_WBUF_DONE)
+		/* Resampled files carry on from the input frame under the position. */
+		if(resample != NULL)
 		{
-			size_t read = (*decoder.decode)(&buffer1[0]);
-			/* The previous block of samples have finished playing,
-			 * so accumulate them here. */
-			info->samples_played += waveBuf[0].nsamples * decoder.channels();
+			frame = resampleSeek(&resample->rs, frame);
+			resample->ended = false;
+		}
 
-			if(read <= 0)
-			{
-				lastbuf = true;
-				continue;
-			}
-			else if(read < decoder.buffSize)
-				waveBuf[0].nsamples = read / (*decoder.channels)();
+		if((*decoder.seek)(decoderCtx, frame) != 0)
+		{
+			errno = DECODER_SEEK_FAIL;
+			return -1;
+		}
+
+		skipped = pos;
+		decodedFrames = pos / channels;
+		read = stretch == NULL ? decodeBuffer(buf->out.data) : 0;
+	}
+	else
+	{
+		while((read = decodeBuffer(buf->out.data)) > 0 &&
+				skipped + read <= pos)
+			skipped += read;
 
-			ndspChnWaveBufAdd(CHANNEL, &waveBuf[0]);
+		/* Keep the samples past the position. */
+		if(read > 0)
+		{
+			read = skipped + read - pos;
+			memmove(buf->out.data, (uint8_t*)buf->out.data +
+					(pos - skipped) * OUTPUT_SAMPLE_SIZE(format),
+					read * OUTPUT_SAMPLE_SIZE(format));
+			skipped = pos;
 		}
+	}
+
+	buf->source = read;
+	if(stretch != NULL)
+	{
+		if(read > 0)
+			stretchWrite(&stretch->st, buf->out.data, read / channels);
+
+		read = stretchBuffer(buf->out.data, (*decoder.channels)(decoderCtx),
+				&buf->source, &buf->track);
+	}
+
+	if(read > 0)
+	{
+		buf->out.nsamples = read / channels;
+		queueBuffer(buf);
+	}
+	else
+		spscPush(&freeQueue, &buf);
+
+	position.samples_played = skipped;
+	position.serial++;
+	leadSamples = 0;
+	info->seek_ns = platformTime() - time;
+	isStarting = false;
+	postEvent(PLAYBACK_EVENT_POSITION, 0, skipped);
+	startDecoder();
+	return 0;
+}
+
+/**
+ * Hand decoded buffers to the output and recycle played buffers.
+ *
+ * \return	true once the last buffer of the track has finished playing.
+ */
+static bool updateTrack(void)
+{
+	/* Must be read before readyQueue is emptied. */
+	bool decoded = atomic_load(&decodeDone);
+	bool completed = false;
+	struct playbackBuf_t* buf;
+	size_t samples;
+	size_t lead;
 
-		if(waveBuf[1].status == NDSP_WBUF_DONE)
+	if((*output.isPaused)() == true)
+		return false;
+
+	/* Wait for a few buffers so that the output does not run dry straight
+	 * away. */
+	if(isStarting == true)
+	{
+		if(decoded == false &&
+				spscCount(&readyQueue) < PLAYBACK_BUFS_START)
+			return false;
+
+		isStarting = false;
+	}
+
+	/* The output completes buffers in the order that they were queued. */
+	while(queued > 0 && (*output.done)(&queue[head]->out) == true)
+	{
+		/* The first buffer of a track may finish before it is seen at the
+		 * head below. */
+		if(queue[head]->track != NULL)
 		{
-			size_t read = (*decoder.decode)(&buffer2[0]);
-			info->samples_played += waveBuf[0].nsamples * decoder.channels();
+			publishTrack(queue[head]->track);
+			queue[head]->track = NULL;
+		}
+
+		/* The previous block of samples have finished playing,
+		 * so accumulate them here. */
+		samples = queue[head]->source;
+		lead = samples < leadSamples ? samples : leadSamples;
+		leadSamples -= lead;
+		position.samples_played += samples - lead;
+
+		/* freeQueue holds every buffer, so this cannot fail. */
+		spscPush(&freeQueue, &queue[head]);
+		eventSignal(&decodeEvent);
+
+		head = (head + 1) % bufCount;
+		queued--;
+		completed = true;
+	}
+
+	if(completed == true && decoded == false &&
+			queued < info->buffers_min_queued)
+		info->buffers_min_queued = queued;
+
+	if(completed == true && decoded == false && queued == 0)
+		postEvent(PLAYBACK_EVENT_UNDERRUN, 0, 0);
+
+	while(spscPop(&readyQueue, &buf) == true)
+		queueBuffer(buf);
+
+	info->buffers_queued = queued;
+
+	/* Every buffer of the previous track has played. */
+	if(queued > 0 && queue[head]->track != NULL)
+	{
+		publishTrack(queue[head]->track);
+		queue[head]->track = NULL;
+	}
+
+	return decoded == true && queued == 0;
+}
+
+/**
+ * Carry out a command from the UI.
+ *
+ * \param	cmd	Command to carry out.
+ * \return		false if the playback thread must quit.
+ */
+static bool runCommand(struct playbackCmd_t* cmd)
+{
+	char* file;
+
+	switch(cmd->cmd)
+	{
+		case PLAYBACK_CMD_PLAY:
+			/* Tracks decoded ahead must not replace the new next file. */
+			closeTrack();
+			atomic_store(&eventSerial, cmd->serial);
+			free(atomic_exchange(&nextFile, cmd->next));
+			cmd->next = NULL;
+
+			if(openTrack(cmd->file, cmd->time) != 0)
+			{
+				postEvent(PLAYBACK_EVENT_ERROR, errno, 0);
+				postEvent(PLAYBACK_EVENT_STOPPED, 0, 0);
+			}
+			else
+				postEvent(PLAYBACK_EVENT_STARTED, 0, 0);
+
+			free(cmd->file);
+			break;
 
-			if(read <= 0)
+		case PLAYBACK_CMD_NEXT:
+			/* The next file may have been decoded ahead already. */
+			closeTrack();
+			atomic_store(&eventSerial, cmd->serial);
+			if((file = atomic_exchange(&nextFile, NULL)) == NULL)
 			{
-				lastbuf = true;
-				continue;
+				/* There is nothing to skip to, so playback has ended. */
+				postEvent(PLAYBACK_EVENT_STOPPED, 0, 0);
+				break;
 			}
-			else if(read < decoder.buffSize)
-				waveBuf[1].nsamples = read / (*decoder.channels)();
 
-			ndspChnWaveBufAdd(CHANNEL, &waveBuf[1]);
+			if(openTrack(file, cmd->time) != 0)
+			{
+				postEvent(PLAYBACK_EVENT_ERROR, errno, 0);
+				postEvent(PLAYBACK_EVENT_STOPPED, 0, 0);
+			}
+			else
+				postEvent(PLAYBACK_EVENT_NEXT_TRACK, 0, 0);
+
+			free(file);
+			break;
+
+		case PLAYBACK_CMD_STOP:
+			closeTrack();
+			atomic_store(&eventSerial, cmd->serial);
+			break;
+
+		case PLAYBACK_CMD_SEEK:
+			if(seekTrack(cmd->pos, cmd->time) != 0)
+			{
+				postEvent(PLAYBACK_EVENT_ERROR, errno, 0);
+				closeTrack();
+				postEvent(PLAYBACK_EVENT_STOPPED, 0, 0);
+			}
+			break;
+
+		case PLAYBACK_CMD_PAUSE:
+			(*output.setPaused)(cmd->paused);
+			break;
+
+		case PLAYBACK_CMD_QUIT:
+			closeTrack();
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * Playback thread. Runs from playbackInit() until playbackExit(), carrying out
+ * commands and keeping the output fed with buffers from the decoder thread.
+ * Sleeps until the output finishes playing a buffer, the decoder fills a
+ * buffer, or a command is sent.
+ *
+ * \param	arg	Unused.
+ */
+static void playbackThread(void* arg)
+{
+	bool run = true;
+
+	(void) arg;
+
+	while(run == true)
+	{
+		struct playbackCmd_t cmd;
+
+		while(run == true && spscPop(&cmdQueue, &cmd) == true)
+			run = runCommand(&cmd);
+
+		if(run == false)
+			break;
+
+		if(isTrackOpen == false)
+		{
+			publishPosition();
+			eventWait(&playbackEvent);
+			continue;
+		}
+
+		if(updateTrack() == true)
+		{
+			closeTrack();
+
+			postEvent(PLAYBACK_EVENT_STOPPED, 0, 0);
+			continue;
 		}
 
-		DSP_FlushDataCache(buffer1, decoder.buffSize * sizeof(int16_t));
-		DSP_FlushDataCache(buffer2, decoder.buffSize * sizeof(int16_t));
+		publishPosition();
+		eventWaitTimeout(&playbackEvent, PLAYBACK_WAIT_NS);
+		info->wakeups++;
 	}
+}
+
+/**
+ * Open the output and start the playback thread. The output must be set with
+ * setPlaybackOutput() beforehand, otherwise the default output is used.
+ *
+ * \param	infoIn	Playback information, updated by the playback thread
+ *					until playbackExit().
+ * \return			0 on success, else failure with errno set.
+ */
+int playbackInit(struct playbackInfo_t* infoIn)
+{
+	int prio = platformThreadPriority();
+
+	if(isInit == true)
+		return 0;
 
-	info->samples_played += waveBuf[0].nsamples * decoder.channels();
-	info->samples_played += waveBuf[0].nsamples * decoder.channels();
+	info = infoIn;
+	atomic_store(&playing, false);
+	atomic_store(&paused, false);
+	atomic_store(&decodeStop, false);
+	atomic_store(&decodeQuit, false);
+	atomic_store(&decodeDone, true);
 
-	(*decoder.exit)();
-out:
-	if(isNdspInit == true)
+	if(output.init == NULL)
 	{
-		ndspChnWaveBufClear(CHANNEL);
-		ndspExit();
+#if defined __arm__
+		setOutputNdsp(&output);
+#else
+		setOutputNull(&output);
+#endif
 	}
 
-	linearFree(buffer1);
-	linearFree(buffer2);
+	(*output.setCallback)(outputCallback, NULL);
+	if((*output.init)() != 0)
+		return -1;
 
-	/* Signal Watchdog thread that we've stopped playing */
-	*info->errInfo->error = -1;
-	svcSignalEvent(*info->errInfo->failEvent);
+	if(seqlockInit(&clockLock, sizeof(struct playbackClock_t)) != 0)
+		goto err_output;
 
-	threadExit(0);
-	return;
+	if(spscInit(&cmdQueue, PLAYBACK_CMDS_MAX,
+				sizeof(struct playbackCmd_t)) != 0 ||
+			mpscInit(&eventQueue, PLAYBACK_EVENTS_MAX,
+				sizeof(struct queuedEvent_t)) != 0 ||
+			spscInit(&freeQueue, PLAYBACK_BUFS_MAX,
+				sizeof(struct playbackBuf_t*)) != 0 ||
+			spscInit(&readyQueue, PLAYBACK_BUFS_MAX,
+				sizeof(struct playbackBuf_t*)) != 0)
+		goto err_queue;
 
-err:
-	*info->errInfo->error = errno;
-	svcSignalEvent(*info->errInfo->failEvent);
-	goto out;
+	eventInit(&playbackEvent);
+	eventInit(&decodeEvent);
+
+	/**
+	 * Decode on the extra core of the New 3DS where possible. The decoder
+	 * runs at a lower priority than the playback thread so that it never
+	 * delays the submission of decoded buffers.
+	 */
+	if(platformThreadCreate(&decodeThreadInfo, decodeThread, NULL,
+				DECODE_STACK_SIZE, prio, 2) != 0 &&
+			platformThreadCreate(&decodeThreadInfo, decodeThread, NULL,
+				DECODE_STACK_SIZE, prio, -2) != 0)
+		goto err_event;
+
+	if(platformThreadCreate(&playbackThreadInfo, playbackThread, NULL,
+				PLAYBACK_STACK_SIZE, prio - 1, -2) != 0)
+		goto err_decode;
+
+	/* Without the I/O thread, decoders read from the SD card themselves. */
+	ioInit(prio - 1, -2);
+
+	isInit = true;
+	return 0;
+
+err_decode:
+	atomic_store(&decodeQuit, true);
+	eventSignal(&decodeEvent);
+	platformThreadJoin(&decodeThreadInfo);
+
+err_event:
+	eventExit(&decodeEvent);
+	eventExit(&playbackEvent);
+
+err_queue:
+	spscExit(&readyQueue);
+	spscExit(&freeQueue);
+	mpscExit(&eventQueue);
+	spscExit(&cmdQueue);
+	seqlockExit(&clockLock);
+
+err_output:
+	(*output.exit)();
+	return -1;
+}
+
+/**
+ * Stop playback, stop the playback thread and close the output.
+ */
+void playbackExit(void)
+{
+	struct playbackCmd_t cmd = { .cmd = PLAYBACK_CMD_QUIT };
+
+	if(isInit == false)
+		return;
+
+	/* The queue may be full whilst the playback thread is busy. */
+	while(sendCommand(&cmd) != 0)
+		platformSleep(PLAYBACK_WAIT_NS / 10);
+
+	platformThreadJoin(&playbackThreadInfo);
+
+	atomic_store(&decodeQuit, true);
+	eventSignal(&decodeEvent);
+	platformThreadJoin(&decodeThreadInfo);
+	ioExit();
+
+	freeBuffers();
+	(*output.exit)();
+
+	eventExit(&decodeEvent);
+	eventExit(&playbackEvent);
+	spscExit(&readyQueue);
+	spscExit(&freeQueue);
+	mpscExit(&eventQueue);
+	spscExit(&cmdQueue);
+	seqlockExit(&clockLock);
+	free(atomic_exchange(&nextFile, NULL));
+	isInit = false;
 }
@@ -0,0 +1,140 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "replaygain.h"
+#include "sample.h"
+
+/* R128 gains are to -23 LUFS, which is 5 dB quieter than ReplayGain. */
+#define R128_OFFSET	500
+
+void replaygainInit(struct replaygain_t* gain)
+{
+	gain->track = REPLAYGAIN_UNKNOWN;
+	gain->album = REPLAYGAIN_UNKNOWN;
+	gain->trackPeak = 0;
+	gain->albumPeak = 0;
+}
+
+/**
+ * Check whether a tag has a key, ignoring case.
+ *
+ * \param	tag		Tag of the form KEY=value.
+ * \param	len		Length of tag.
+ * \param	key		Key, including the '='.
+ * \return			Value of the tag, or NULL if it has another key.
+ */
+static const char* tagValue(const char* tag, size_t len, const char* key)
+{
+	size_t keyLen = strlen(key);
+
+	if(len < keyLen || strncasecmp(tag, key, keyLen) != 0)
+		return NULL;
+
+	return tag + keyLen;
+}
+
+void replaygainParse(struct replaygain_t* gain, const char* tag, size_t len)
+{
+	static const char* keys[] = {
+		"REPLAYGAIN_TRACK_GAIN=",
+		"REPLAYGAIN_ALBUM_GAIN=",
+		"REPLAYGAIN_TRACK_PEAK=",
+		"REPLAYGAIN_ALBUM_PEAK=",
+		"R128_TRACK_GAIN=",
+		"R128_ALBUM_GAIN="
+	};
+	const char* value = NULL;
+	char buf[32];
+	char* end;
+	size_t valueLen;
+	unsigned i;
+	float f;
+
+	for(i = 0; i < sizeof(keys) / sizeof(keys[0]); i++)
+	{
+		if((value = tagValue(tag, len, keys[i])) != NULL)
+			break;
+	}
+
+	if(value == NULL)
+		return;
+
+	/* Values are parsed from a copy, as tags need not be NUL terminated. */
+	valueLen = len - (value - tag);
+	if(valueLen >= sizeof(buf))
+		return;
+
+	memcpy(buf, value, valueLen);
+	buf[valueLen] = '\0';
+
+	/* R128 gains are whole numbers of 1/256 dB. */
+	if(i >= 4)
+	{
+		long q8 = strtol(buf, &end, 10);
+
+		if(end == buf || q8 < INT16_MIN || q8 > INT16_MAX)
+			return;
+
+		*(i == 4 ? &gain->track : &gain->album) =
+			q8 * 100 / 256 + R128_OFFSET;
+		return;
+	}
+
+	/* Gains are given as, for example, "-6.50 dB". */
+	f = strtof(buf, &end);
+	if(end == buf || isfinite(f) == 0 || fabsf(f) > 100)
+		return;
+
+	switch(i)
+	{
+		case 0:
+			gain->track = lrintf(f * 100);
+			break;
+
+		case 1:
+			gain->album = lrintf(f * 100);
+			break;
+
+		case 2:
+			gain->trackPeak = f;
+			break;
+
+		case 3:
+			gain->albumPeak = f;
+			break;
+	}
+}
+
+int16_t replaygainFactor(const struct replaygain_t* gain,
+		enum replaygain_mode mode, int32_t preamp)
+{
+	int32_t db = gain->track;
+	float peak = gain->trackPeak;
+	float factor;
+
+	if(mode == REPLAYGAIN_ALBUM && gain->album != REPLAYGAIN_UNKNOWN)
+	{
+		db = gain->album;
+		peak = gain->albumPeak;
+	}
+	else if(db == REPLAYGAIN_UNKNOWN)
+	{
+		db = gain->album;
+		peak = gain->albumPeak;
+	}
+
+	if(mode == REPLAYGAIN_OFF || db == REPLAYGAIN_UNKNOWN)
+		return SAMPLE_GAIN_UNITY;
+
+	factor = powf(10, (db + preamp) / 2000.0f);
+
+	/* Prevent clipping, where the peak is known. */
+	if(peak > 0 && factor * peak > 1)
+		factor = 1 / peak;
+
+	factor = factor * SAMPLE_GAIN_UNITY + 0.5f;
+
+	return factor >= INT16_MAX ? INT16_MAX : (int16_t)factor;
+}
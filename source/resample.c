@@ -0,0 +1,522 @@
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined __SSE2__
+#include <emmintrin.h>
+#elif defined __ARM_FEATURE_SIMD32
+#include <arm_acle.h>
+#endif
+
+#include "resample.h"
+
+#ifndef M_PI
+#define M_PI	3.14159265358979323846
+#endif
+
+/* Most phases kept of the filter. Rates that would need more interpolate
+ * between the two phases either side of the exact position of each output
+ * frame. */
+#define RESAMPLE_PHASES_MAX	1024
+
+/* Fraction of the way from one phase to the next, in Q15 so that the
+ * difference of two accumulators can be multiplied by it in 64 bits. */
+#define RESAMPLE_INTERP_SHIFT	15
+
+/* Most taps for each output frame, reached when downsampling by a lot. */
+#define RESAMPLE_TAPS_MAX	256
+
+/* Largest shift of the taps, which gives them in Q15. */
+#define RESAMPLE_SHIFT_MAX	15
+
+/**
+ * Filter used for each quality. The cutoff is the fraction of the lower
+ * Nyquist frequency at which the filter is at -6 dB, and beta sets the Kaiser
+ * window, trading stopband attenuation against the width of the transition.
+ */
+static const struct
+{
+	unsigned	taps;
+	double		cutoff;
+	double		beta;
+} filters[] = {
+	[RESAMPLE_LOW] =	{ 16, 0.82, 6.0 },
+	[RESAMPLE_MEDIUM] =	{ 32, 0.90, 8.5 },
+	[RESAMPLE_HIGH] =	{ 64, 0.94, 10.5 }
+};
+
+static int16_t saturate16(int64_t val)
+{
+	if(val > INT16_MAX)
+		return INT16_MAX;
+
+	if(val < INT16_MIN)
+		return INT16_MIN;
+
+	return val;
+}
+
+static uint32_t gcd(uint32_t a, uint32_t b)
+{
+	while(b != 0)
+	{
+		uint32_t t = a % b;
+
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+/**
+ * Modified Bessel function of the first kind, of order 0, as used by the
+ * Kaiser window.
+ */
+static double besselI0(double x)
+{
+	double sum = 1;
+	double term = 1;
+
+	for(unsigned k = 1; k < 64 && term > sum * 1e-12; k++)
+	{
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+	}
+
+	return sum;
+}
+
+/**
+ * Get the number of sets of taps kept of the filter. When output frames fall
+ * between phases, the set for the phase one input frame on is kept as well,
+ * so that the last phase has one after it to interpolate towards.
+ */
+static unsigned filterSets(const struct resampler_t* rs)
+{
+	return rs->phases < rs->up ? rs->phases + 1 : rs->phases;
+}
+
+/**
+ * Find the largest sum of the magnitudes of the taps that are added into any
+ * one accumulator of the fast versions of resampleRead(), which add every
+ * fourth pair of taps together in 32 bits.
+ */
+static uint32_t laneMagnitude(const int16_t* coeffs, unsigned taps)
+{
+	uint32_t most = 0;
+
+	for(unsigned lane = 0; lane < 4; lane++)
+	{
+		uint32_t mag = 0;
+
+		for(unsigned k = lane * 2; k < taps; k += 8)
+			mag += abs(coeffs[k]) + abs(coeffs[k + 1]);
+
+		if(mag > most)
+			most = mag;
+	}
+
+	return most;
+}
+
+/**
+ * Work out the taps of each phase of the filter, in Q shift, followed by
+ * those of what is left over from rounding them in Q (shift + fineShift) if
+ * fineShift is not 0. Each phase is normalised so that its taps add up to
+ * exactly unity, which keeps DC from rippling from one output frame to the
+ * next.
+ *
+ * \param	rs		Resampler with its rates, taps, phases, shifts and coeffs
+ *					set.
+ * \param	cutoff	Cutoff of filter in cycles per input frame.
+ * \param	beta	Shape of Kaiser window.
+ * \param	most	Set to the largest result of laneMagnitude() for the taps
+ *					and for the taps left over.
+ */
+static void makeFilter(struct resampler_t* rs, double cutoff, double beta,
+		uint32_t most[2])
+{
+	double		taps[RESAMPLE_TAPS_MAX];
+	unsigned	half = rs->taps / 2;
+	double		norm = besselI0(beta);
+	int32_t		unity = 1 << rs->shift;
+
+	most[0] = 0;
+	most[1] = 0;
+
+	for(unsigned p = 0; p < filterSets(rs); p++)
+	{
+		int16_t*	coeffs = rs->coeffs + (size_t)p * rs->stride;
+		double		sum = 0;
+		int32_t		total = 0;
+		uint32_t	mag;
+
+		for(unsigned k = 0; k < rs->taps; k++)
+		{
+			double t = (double)p / rs->phases + half - 1 - k;
+			double u = t / half;
+			double x = 2 * cutoff * t;
+			double sinc = x == 0 ? 1 : sin(M_PI * x) / (M_PI * x);
+
+			taps[k] = 2 * cutoff * sinc *
+				besselI0(beta * sqrt(u >= 1 ? 0 : 1 - u * u)) / norm;
+			sum += taps[k];
+		}
+
+		for(unsigned k = 0; k < rs->taps; k++)
+		{
+			taps[k] = taps[k] / sum * unity;
+			coeffs[k] = lrint(taps[k]);
+			total += coeffs[k];
+		}
+
+		/* Round the taps that were nearest to halfway the other way instead,
+		 * until they add up to unity again. */
+		while(total != unity)
+		{
+			int step = total < unity ? 1 : -1;
+			unsigned best = 0;
+			double bestErr = 2;
+
+			for(unsigned k = 0; k < rs->taps; k++)
+			{
+				double err = fabs(coeffs[k] + step - taps[k]);
+
+				if(err < bestErr && abs(coeffs[k] + step) <= INT16_MAX)
+				{
+					best = k;
+					bestErr = err;
+				}
+			}
+
+			coeffs[best] += step;
+			total += step;
+		}
+
+		if((mag = laneMagnitude(coeffs, rs->taps)) > most[0])
+			most[0] = mag;
+
+		if(rs->fineShift == 0)
+			continue;
+
+		for(unsigned k = 0; k < rs->taps; k++)
+		{
+			long fine = lrint((taps[k] - coeffs[k]) * (1 << rs->fineShift));
+
+			coeffs[rs->taps + k] = fine > INT16_MAX ? INT16_MAX :
+				fine < -INT16_MAX ? -INT16_MAX : fine;
+		}
+
+		if((mag = laneMagnitude(coeffs + rs->taps, rs->taps)) > most[1])
+			most[1] = mag;
+	}
+}
+
+int resampleInit(struct resampler_t* rs, uint32_t inRate, uint32_t outRate,
+		unsigned chans, size_t maxFrames, enum resample_quality quality)
+{
+	uint32_t	div;
+	double		cutoff;
+	unsigned	taps;
+
+	memset(rs, 0, sizeof(*rs));
+
+	if(inRate == 0 || outRate == 0 || chans < 1 ||
+			chans > RESAMPLE_CHANNELS_MAX || quality > RESAMPLE_HIGH)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	div = gcd(inRate, outRate);
+	rs->chans = chans;
+	rs->up = outRate / div;
+	rs->down = inRate / div;
+	rs->phases = rs->up < RESAMPLE_PHASES_MAX ? rs->up : RESAMPLE_PHASES_MAX;
+	rs->phaseMul = ((uint64_t)rs->phases << 32) / rs->up;
+
+	/* Downsampling lowers the cutoff below the Nyquist frequency of the
+	 * input, so more taps are needed for the same transition. */
+	cutoff = 0.5 * filters[quality].cutoff;
+	taps = filters[quality].taps;
+
+	if(rs->down > rs->up)
+	{
+		cutoff = cutoff * rs->up / rs->down;
+		taps = (unsigned)ceil((double)taps * rs->down / rs->up / 8) * 8;
+
+		if(taps > RESAMPLE_TAPS_MAX)
+			taps = RESAMPLE_TAPS_MAX;
+	}
+
+	rs->taps = taps;
+	rs->fineShift = quality == RESAMPLE_HIGH ? RESAMPLE_SHIFT_MAX : 0;
+	rs->stride = rs->fineShift != 0 ? taps * 2 : taps;
+	rs->histSize = maxFrames + taps + taps / 2;
+
+	if((rs->coeffs = malloc((size_t)filterSets(rs) * rs->stride *
+					sizeof(int16_t))) == NULL ||
+			(rs->hist[0] = malloc(rs->histSize * chans *
+					sizeof(int16_t))) == NULL)
+	{
+		free(rs->coeffs);
+		rs->coeffs = NULL;
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for(unsigned c = 1; c < chans; c++)
+		rs->hist[c] = rs->hist[0] + c * rs->histSize;
+
+	/* Keep the accumulators from overflowing, even with full scale input of
+	 * the worst signs. */
+	rs->shift = RESAMPLE_SHIFT_MAX;
+	for(;;)
+	{
+		uint32_t most[2];
+
+		makeFilter(rs, cutoff, filters[quality].beta, most);
+
+		if(most[0] > INT32_MAX / 32768 && rs->shift > 8)
+			rs->shift--;
+		else if(most[1] > INT32_MAX / 32768 && rs->fineShift > 8)
+			rs->fineShift--;
+		else
+			break;
+	}
+
+	resampleSeek(rs, 0);
+	return 0;
+}
+
+void resampleExit(struct resampler_t* rs)
+{
+	free(rs->coeffs);
+	free(rs->hist[0]);
+	rs->coeffs = NULL;
+	rs->hist[0] = NULL;
+}
+
+uint64_t resampleFrames(const struct resampler_t* rs, uint64_t frames)
+{
+	return (frames * rs->up + rs->down - 1) / rs->down;
+}
+
+uint64_t resampleSeek(struct resampler_t* rs, uint64_t frame)
+{
+	uint64_t pos = frame * rs->down;
+
+	/* The taps before the middle of the first output frame are silent. */
+	rs->histLen = rs->taps / 2 - 1;
+	for(unsigned c = 0; c < rs->chans; c++)
+		memset(rs->hist[c], 0, rs->histLen * sizeof(int16_t));
+
+	rs->next = 0;
+	rs->frac = pos % rs->up;
+	rs->inPos = pos / rs->up;
+	rs->outPos = frame;
+	rs->outEnd = UINT64_MAX;
+	return rs->inPos;
+}
+
+/**
+ * Make room at the end of the history by dropping the frames that are no
+ * longer needed. When downsampling by a lot, the next output frame may start
+ * past the frames written so far.
+ */
+static void compactHistory(struct resampler_t* rs)
+{
+	size_t drop = rs->next < rs->histLen ? rs->next : rs->histLen;
+
+	if(drop == 0)
+		return;
+
+	rs->histLen -= drop;
+	rs->next -= drop;
+	for(unsigned c = 0; c < rs->chans; c++)
+		memmove(rs->hist[c], rs->hist[c] + drop,
+				rs->histLen * sizeof(int16_t));
+}
+
+void resampleWrite(struct resampler_t* rs, const int16_t* in, size_t frames)
+{
+	compactHistory(rs);
+
+	if(frames > rs->histSize - rs->histLen)
+		frames = rs->histSize - rs->histLen;
+
+	if(rs->chans == 1)
+		memcpy(rs->hist[0] + rs->histLen, in, frames * sizeof(int16_t));
+	else
+	{
+		int16_t* left = rs->hist[0] + rs->histLen;
+		int16_t* right = rs->hist[1] + rs->histLen;
+
+		for(size_t i = 0; i < frames; i++)
+		{
+			left[i] = in[i * 2];
+			right[i] = in[i * 2 + 1];
+		}
+	}
+
+	rs->histLen += frames;
+	rs->inPos += frames;
+}
+
+void resampleFlush(struct resampler_t* rs)
+{
+	size_t half = rs->taps / 2;
+
+	compactHistory(rs);
+
+	/* The taps after the middle of the last output frame are silent. */
+	for(unsigned c = 0; c < rs->chans; c++)
+		memset(rs->hist[c] + rs->histLen, 0, half * sizeof(int16_t));
+
+	rs->histLen += half;
+	rs->outEnd = resampleFrames(rs, rs->inPos);
+}
+
+/**
+ * Multiply and add taps with input frames of one channel.
+ */
+typedef int64_t (*resampleDot_fn)(const int16_t* coeffs, const int16_t* in,
+		unsigned taps);
+
+static int64_t dotRef(const int16_t* coeffs, const int16_t* in, unsigned taps)
+{
+	int64_t acc = 0;
+
+	for(unsigned k = 0; k < taps; k++)
+		acc += coeffs[k] * in[k];
+
+	return acc;
+}
+
+#if defined __SSE2__
+/**
+ * Multiplies and adds eight taps at a time with PMADDWD. The four lanes of the
+ * accumulator are only added together once every tap is done, in 64 bits.
+ */
+static int64_t dotFast(const int16_t* coeffs, const int16_t* in,
+		unsigned taps)
+{
+	__m128i	acc = _mm_setzero_si128();
+	int32_t	lanes[4];
+
+	for(unsigned k = 0; k < taps; k += 8)
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(
+					_mm_loadu_si128((const __m128i*)&coeffs[k]),
+					_mm_loadu_si128((const __m128i*)&in[k])));
+
+	_mm_storeu_si128((__m128i*)lanes, acc);
+	return (int64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+#elif defined __ARM_FEATURE_SIMD32
+/**
+ * ARMv6 version, which multiplies and adds two taps at a time with SMLAD, into
+ * four accumulators that are added together in 64 bits.
+ */
+static int64_t dotFast(const int16_t* coeffs, const int16_t* in,
+		unsigned taps)
+{
+	int32_t acc[4] = { 0 };
+
+	for(unsigned k = 0; k < taps; k += 8)
+	{
+		for(unsigned lane = 0; lane < 4; lane++)
+		{
+			int16x2_t tap, pair;
+
+			memcpy(&tap, &coeffs[k + lane * 2], sizeof(tap));
+			memcpy(&pair, &in[k + lane * 2], sizeof(pair));
+			acc[lane] = __smlad(tap, pair, acc[lane]);
+		}
+	}
+
+	return (int64_t)acc[0] + acc[1] + acc[2] + acc[3];
+}
+#else
+static int64_t dotFast(const int16_t* coeffs, const int16_t* in,
+		unsigned taps)
+{
+	return dotRef(coeffs, in, taps);
+}
+#endif
+
+/**
+ * Multiply and add the taps of a phase, and what was left over from rounding
+ * them, with input frames of one channel.
+ */
+static inline int64_t dotPhase(const struct resampler_t* rs,
+		const int16_t* coeffs, const int16_t* in, resampleDot_fn dot)
+{
+	int64_t acc = (*dot)(coeffs, in, rs->taps);
+
+	if(rs->fineShift != 0)
+		acc = acc * (1 << rs->fineShift) +
+			(*dot)(coeffs + rs->taps, in, rs->taps);
+
+	return acc;
+}
+
+/**
+ * Step through the output frames that can be made from the history. Output
+ * frames between two phases are interpolated linearly between them.
+ */
+static inline size_t readFrames(struct resampler_t* rs, int16_t* out,
+		size_t frames, resampleDot_fn dot)
+{
+	uint32_t	stepFrames = rs->down / rs->up;
+	uint32_t	stepFrac = rs->down % rs->up;
+	unsigned	shift = rs->shift + rs->fineShift;
+	size_t		made = 0;
+
+	while(made < frames && rs->outPos < rs->outEnd &&
+			rs->next + rs->taps <= rs->histLen)
+	{
+		uint64_t		pos = rs->frac * rs->phaseMul;
+		unsigned		phase = pos >> 32;
+		int64_t			interp =
+			(uint32_t)pos >> (32 - RESAMPLE_INTERP_SHIFT);
+		const int16_t*	coeffs = rs->coeffs + (size_t)phase * rs->stride;
+
+		for(unsigned c = 0; c < rs->chans; c++)
+		{
+			const int16_t*	in = rs->hist[c] + rs->next;
+			int64_t			acc = dotPhase(rs, coeffs, in, dot);
+
+			if(interp != 0)
+				acc += ((dotPhase(rs, coeffs + rs->stride, in, dot) - acc) *
+						interp) >> RESAMPLE_INTERP_SHIFT;
+
+			*out++ = saturate16((acc + ((int64_t)1 << (shift - 1))) >> shift);
+		}
+
+		made++;
+		rs->outPos++;
+
+		rs->next += stepFrames;
+		rs->frac += stepFrac;
+		if(rs->frac >= rs->up)
+		{
+			rs->frac -= rs->up;
+			rs->next++;
+		}
+	}
+
+	return made;
+}
+
+size_t resampleReadRef(struct resampler_t* rs, int16_t* out, size_t frames)
+{
+	return readFrames(rs, out, frames, dotRef);
+}
+
+size_t resampleRead(struct resampler_t* rs, int16_t* out, size_t frames)
+{
+	return readFrames(rs, out, frames, dotFast);
+}
@@ -0,0 +1,511 @@
+#include <string.h>
+
+#if defined __SSE2__
+#include <emmintrin.h>
+#elif defined __ARM_FEATURE_SIMD32
+#include <arm_acle.h>
+#endif
+
+#include "sample.h"
+
+/* Positions of speakers. */
+enum speaker
+{
+	SPEAKER_FL,
+	SPEAKER_FR,
+	SPEAKER_FC,
+	SPEAKER_LFE,
+	SPEAKER_BL,
+	SPEAKER_BR,
+	SPEAKER_SL,
+	SPEAKER_SR,
+	SPEAKER_BC
+};
+
+/* Speaker of each channel, by order and number of channels. */
+static const uint8_t layouts[2][SAMPLE_CHANNELS_MAX + 1][SAMPLE_CHANNELS_MAX] = {
+	[CHANNEL_ORDER_WAV] = {
+		[3] = { SPEAKER_FL, SPEAKER_FR, SPEAKER_FC },
+		[4] = { SPEAKER_FL, SPEAKER_FR, SPEAKER_BL, SPEAKER_BR },
+		[5] = { SPEAKER_FL, SPEAKER_FR, SPEAKER_FC, SPEAKER_BL, SPEAKER_BR },
+		[6] = { SPEAKER_FL, SPEAKER_FR, SPEAKER_FC, SPEAKER_LFE, SPEAKER_BL,
+			SPEAKER_BR },
+		[7] = { SPEAKER_FL, SPEAKER_FR, SPEAKER_FC, SPEAKER_LFE, SPEAKER_BC,
+			SPEAKER_SL, SPEAKER_SR },
+		[8] = { SPEAKER_FL, SPEAKER_FR, SPEAKER_FC, SPEAKER_LFE, SPEAKER_BL,
+			SPEAKER_BR, SPEAKER_SL, SPEAKER_SR }
+	},
+	[CHANNEL_ORDER_VORBIS] = {
+		[3] = { SPEAKER_FL, SPEAKER_FC, SPEAKER_FR },
+		[4] = { SPEAKER_FL, SPEAKER_FR, SPEAKER_BL, SPEAKER_BR },
+		[5] = { SPEAKER_FL, SPEAKER_FC, SPEAKER_FR, SPEAKER_BL, SPEAKER_BR },
+		[6] = { SPEAKER_FL, SPEAKER_FC, SPEAKER_FR, SPEAKER_BL, SPEAKER_BR,
+			SPEAKER_LFE },
+		[7] = { SPEAKER_FL, SPEAKER_FC, SPEAKER_FR, SPEAKER_SL, SPEAKER_SR,
+			SPEAKER_BC, SPEAKER_LFE },
+		[8] = { SPEAKER_FL, SPEAKER_FC, SPEAKER_FR, SPEAKER_SL, SPEAKER_SR,
+			SPEAKER_BL, SPEAKER_BR, SPEAKER_LFE }
+	}
+};
+
+/* Gain of each speaker in the left and right outputs, in 1/10000. */
+static const uint16_t speakerGains[][2] = {
+	[SPEAKER_FL] =	{ 10000, 0 },
+	[SPEAKER_FR] =	{ 0, 10000 },
+	[SPEAKER_FC] =	{ 7071, 7071 },
+	[SPEAKER_LFE] =	{ 0, 0 },
+	[SPEAKER_BL] =	{ 7071, 0 },
+	[SPEAKER_BR] =	{ 0, 7071 },
+	[SPEAKER_SL] =	{ 7071, 0 },
+	[SPEAKER_SR] =	{ 0, 7071 },
+	[SPEAKER_BC] =	{ 5000, 5000 }
+};
+
+static int16_t saturate16(int32_t val)
+{
+	if(val > INT16_MAX)
+		return INT16_MAX;
+
+	if(val < INT16_MIN)
+		return INT16_MIN;
+
+	return val;
+}
+
+void sampleSwap16Ref(int16_t* samples, size_t count)
+{
+	for(size_t i = 0; i < count; i++)
+		samples[i] = (int16_t)(((uint16_t)samples[i] << 8) |
+				((uint16_t)samples[i] >> 8));
+}
+
+#if defined __SSE2__
+void sampleSwap16(int16_t* samples, size_t count)
+{
+	size_t i;
+
+	for(i = 0; i + 8 <= count; i += 8)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i*)&samples[i]);
+
+		x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+		_mm_storeu_si128((__m128i*)&samples[i], x);
+	}
+
+	sampleSwap16Ref(&samples[i], count - i);
+}
+#else
+/**
+ * Swaps two samples at a time. GCC builds the inner loop as a REV16
+ * instruction on ARMv6.
+ */
+void sampleSwap16(int16_t* samples, size_t count)
+{
+	size_t i;
+
+	for(i = 0; i + 2 <= count; i += 2)
+	{
+		uint32_t pair;
+
+		memcpy(&pair, &samples[i], sizeof(pair));
+		pair = ((pair & 0x00FF00FF) << 8) | ((pair >> 8) & 0x00FF00FF);
+		memcpy(&samples[i], &pair, sizeof(pair));
+	}
+
+	sampleSwap16Ref(&samples[i], count - i);
+}
+#endif
+
+void sampleSign8Ref(int8_t* samples, size_t count)
+{
+	for(size_t i = 0; i < count; i++)
+		samples[i] = (int8_t)((uint8_t)samples[i] ^ 0x80);
+}
+
+#if defined __SSE2__
+void sampleSign8(int8_t* samples, size_t count)
+{
+	const __m128i sign = _mm_set1_epi8((char)0x80);
+	size_t i;
+
+	for(i = 0; i + 16 <= count; i += 16)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i*)&samples[i]);
+
+		_mm_storeu_si128((__m128i*)&samples[i], _mm_xor_si128(x, sign));
+	}
+
+	sampleSign8Ref(&samples[i], count - i);
+}
+#else
+/**
+ * Converts four samples at a time.
+ */
+void sampleSign8(int8_t* samples, size_t count)
+{
+	size_t i;
+
+	for(i = 0; i + 4 <= count; i += 4)
+	{
+		uint32_t quad;
+
+		memcpy(&quad, &samples[i], sizeof(quad));
+		quad ^= 0x80808080;
+		memcpy(&samples[i], &quad, sizeof(quad));
+	}
+
+	sampleSign8Ref(&samples[i], count - i);
+}
+#endif
+
+void sampleMonoToStereoRef(int16_t* out, const int16_t* in, size_t frames)
+{
+	/* Work backwards so that out may be the same as in. */
+	for(size_t i = frames; i-- > 0;)
+	{
+		int16_t sample = in[i];
+
+		out[2 * i] = sample;
+		out[2 * i + 1] = sample;
+	}
+}
+
+#if defined __SSE2__
+void sampleMonoToStereo(int16_t* out, const int16_t* in, size_t frames)
+{
+	size_t i = frames & ~(size_t)7;
+
+	sampleMonoToStereoRef(&out[2 * i], &in[i], frames - i);
+
+	while(i > 0)
+	{
+		__m128i x;
+
+		i -= 8;
+		x = _mm_loadu_si128((const __m128i*)&in[i]);
+		_mm_storeu_si128((__m128i*)&out[2 * i + 8], _mm_unpackhi_epi16(x, x));
+		_mm_storeu_si128((__m128i*)&out[2 * i], _mm_unpacklo_epi16(x, x));
+	}
+}
+#else
+void sampleMonoToStereo(int16_t* out, const int16_t* in, size_t frames)
+{
+	sampleMonoToStereoRef(out, in, frames);
+}
+#endif
+
+void sampleGainRef(int16_t* samples, size_t count, int16_t gain)
+{
+	for(size_t i = 0; i < count; i++)
+		samples[i] = saturate16((samples[i] * gain) >> SAMPLE_GAIN_SHIFT);
+}
+
+#if defined __SSE2__
+void sampleGain(int16_t* samples, size_t count, int16_t gain)
+{
+	const __m128i g = _mm_set1_epi16(gain);
+	size_t i;
+
+	for(i = 0; i + 8 <= count; i += 8)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i*)&samples[i]);
+		__m128i lo = _mm_mullo_epi16(x, g);
+		__m128i hi = _mm_mulhi_epi16(x, g);
+		__m128i a = _mm_srai_epi32(_mm_unpacklo_epi16(lo, hi),
+				SAMPLE_GAIN_SHIFT);
+		__m128i b = _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi),
+				SAMPLE_GAIN_SHIFT);
+
+		_mm_storeu_si128((__m128i*)&samples[i], _mm_packs_epi32(a, b));
+	}
+
+	sampleGainRef(&samples[i], count - i, gain);
+}
+#elif defined __ARM_FEATURE_SIMD32
+/**
+ * ARMv6 version. SMULWB and SMULWT multiply each half of a pair of samples by
+ * the gain in Q16 and drop the lower 16 bits, which is the same as the shift
+ * in the reference.
+ */
+void sampleGain(int16_t* samples, size_t count, int16_t gain)
+{
+	int32_t g = (int32_t)gain << (16 - SAMPLE_GAIN_SHIFT);
+	size_t i;
+
+	for(i = 0; i + 2 <= count; i += 2)
+	{
+		uint32_t pair;
+		int32_t lo, hi;
+
+		memcpy(&pair, &samples[i], sizeof(pair));
+		lo = __ssat(__smulwb(g, pair), 16);
+		hi = __ssat(__smulwt(g, pair), 16);
+		pair = (uint16_t)lo | (uint32_t)hi << 16;
+		memcpy(&samples[i], &pair, sizeof(pair));
+	}
+
+	sampleGainRef(&samples[i], count - i, gain);
+}
+#else
+void sampleGain(int16_t* samples, size_t count, int16_t gain)
+{
+	sampleGainRef(samples, count, gain);
+}
+#endif
+
+uint32_t sampleFadeStep(uint32_t frames)
+{
+	return ((uint32_t)SAMPLE_FADE_UNITY << 16) / frames;
+}
+
+/**
+ * Get the gain of the file fading in at a frame of a fade.
+ */
+static int32_t fadeGain(uint64_t pos, uint32_t step)
+{
+	uint64_t gain = (pos * step) >> 16;
+
+	return gain > SAMPLE_FADE_UNITY ? SAMPLE_FADE_UNITY : (int32_t)gain;
+}
+
+void sampleFadeRef(int16_t* out, const int16_t* in, size_t frames,
+		unsigned chans, uint64_t pos, uint32_t step)
+{
+	for(size_t i = 0; i < frames; i++, out += chans, in += chans)
+	{
+		int32_t gainIn = fadeGain(pos + i, step);
+		int32_t gainOut = SAMPLE_FADE_UNITY - gainIn;
+
+		for(unsigned c = 0; c < chans; c++)
+			out[c] = saturate16((out[c] * gainOut + in[c] * gainIn +
+						(1 << (SAMPLE_FADE_SHIFT - 1))) >> SAMPLE_FADE_SHIFT);
+	}
+}
+
+#if defined __SSE2__
+/**
+ * Multiplies and adds each pair of samples from out and in with PMADDWD, eight
+ * at a time, for frames that fit evenly in eight samples. The gains are kept
+ * as pos * step in each lane and stepped with PADDD, which is exact until
+ * pos * step no longer fits in 31 bits, well past the end of the fade.
+ */
+void sampleFade(int16_t* out, const int16_t* in, size_t frames,
+		unsigned chans, uint64_t pos, uint32_t step)
+{
+	const __m128i unity = _mm_set1_epi16(SAMPLE_FADE_UNITY);
+	const __m128i round = _mm_set1_epi32(1 << (SAMPLE_FADE_SHIFT - 1));
+	uint64_t posMax = step == 0 ? UINT64_MAX : INT32_MAX / step;
+	size_t block = 8 / chans;
+	size_t i = 0;
+	uint32_t acc[8];
+	__m128i accLo, accHi, accStep;
+
+	if(8 % chans != 0 || pos > posMax)
+	{
+		sampleFadeRef(out, in, frames, chans, pos, step);
+		return;
+	}
+
+	for(unsigned s = 0; s < 8; s++)
+		acc[s] = (pos + s / chans) * step;
+
+	accLo = _mm_loadu_si128((const __m128i*)&acc[0]);
+	accHi = _mm_loadu_si128((const __m128i*)&acc[4]);
+	accStep = _mm_set1_epi32(block * step);
+
+	for(; i + block <= frames && pos + i + block - 1 <= posMax; i += block)
+	{
+		__m128i a, b, gainIn, gainOut, lo, hi;
+
+		gainIn = _mm_packs_epi32(_mm_srli_epi32(accLo, 16),
+				_mm_srli_epi32(accHi, 16));
+		gainIn = _mm_min_epi16(gainIn, unity);
+		gainOut = _mm_sub_epi16(unity, gainIn);
+		accLo = _mm_add_epi32(accLo, accStep);
+		accHi = _mm_add_epi32(accHi, accStep);
+
+		a = _mm_loadu_si128((const __m128i*)&out[i * chans]);
+		b = _mm_loadu_si128((const __m128i*)&in[i * chans]);
+
+		lo = _mm_madd_epi16(_mm_unpacklo_epi16(a, b),
+				_mm_unpacklo_epi16(gainOut, gainIn));
+		hi = _mm_madd_epi16(_mm_unpackhi_epi16(a, b),
+				_mm_unpackhi_epi16(gainOut, gainIn));
+		lo = _mm_srai_epi32(_mm_add_epi32(lo, round), SAMPLE_FADE_SHIFT);
+		hi = _mm_srai_epi32(_mm_add_epi32(hi, round), SAMPLE_FADE_SHIFT);
+
+		_mm_storeu_si128((__m128i*)&out[i * chans], _mm_packs_epi32(lo, hi));
+	}
+
+	sampleFadeRef(&out[i * chans], &in[i * chans], frames - i, chans, pos + i,
+			step);
+}
+#elif defined __ARM_FEATURE_SIMD32
+/**
+ * ARMv6 version, which multiplies and adds each sample of out and in together
+ * with SMLAD.
+ */
+void sampleFade(int16_t* out, const int16_t* in, size_t frames,
+		unsigned chans, uint64_t pos, uint32_t step)
+{
+	for(size_t i = 0; i < frames; i++, out += chans, in += chans)
+	{
+		int32_t gainIn = fadeGain(pos + i, step);
+		uint32_t gains = (uint16_t)(SAMPLE_FADE_UNITY - gainIn) |
+			(uint32_t)gainIn << 16;
+
+		for(unsigned c = 0; c < chans; c++)
+		{
+			uint32_t pair = (uint16_t)out[c] | (uint32_t)(uint16_t)in[c] << 16;
+
+			out[c] = __ssat(__smlad(pair, gains,
+						1 << (SAMPLE_FADE_SHIFT - 1)) >> SAMPLE_FADE_SHIFT, 16);
+		}
+	}
+}
+#else
+void sampleFade(int16_t* out, const int16_t* in, size_t frames,
+		unsigned chans, uint64_t pos, uint32_t step)
+{
+	sampleFadeRef(out, in, frames, chans, pos, step);
+}
+#endif
+
+int sampleDownmixInit(struct downmix_t* mix, unsigned chans,
+		enum channel_order order)
+{
+	uint32_t sums[2] = { 0, 0 };
+	uint32_t scale;
+
+	if(chans < 3 || chans > SAMPLE_CHANNELS_MAX ||
+			order > CHANNEL_ORDER_VORBIS)
+		return -1;
+
+	memset(mix, 0, sizeof(*mix));
+	mix->chans = chans;
+
+	for(unsigned c = 0; c < chans; c++)
+	{
+		sums[0] += speakerGains[layouts[order][chans][c]][0];
+		sums[1] += speakerGains[layouts[order][chans][c]][1];
+	}
+
+	/* Scale so that the louder output is at most full scale. */
+	scale = sums[0] > sums[1] ? sums[0] : sums[1];
+
+	for(unsigned out = 0; out < 2; out++)
+	{
+		for(unsigned c = 0; c < chans; c++)
+		{
+			uint32_t gain = speakerGains[layouts[order][chans][c]][out];
+
+			mix->gains[out][c] = (gain * 32767 + scale / 2) / scale;
+		}
+
+		for(unsigned c = 0; c + 1 < chans; c += 2)
+			mix->pairs[out][c / 2] = (uint16_t)mix->gains[out][c] |
+				(uint32_t)(uint16_t)mix->gains[out][c + 1] << 16;
+	}
+
+	return 0;
+}
+
+void sampleDownmixRef(const struct downmix_t* mix, int16_t* out,
+		const int16_t* in, size_t frames)
+{
+	unsigned chans = mix->chans;
+
+	for(size_t i = 0; i < frames; i++, in += chans, out += 2)
+	{
+		int32_t left = 1 << 14;
+		int32_t right = 1 << 14;
+
+		for(unsigned c = 0; c < chans; c++)
+		{
+			left += in[c] * mix->gains[0][c];
+			right += in[c] * mix->gains[1][c];
+		}
+
+		/* The whole frame is read before out, which may overlap in. */
+		out[0] = saturate16(left >> 15);
+		out[1] = saturate16(right >> 15);
+	}
+}
+
+#if defined __SSE2__
+/**
+ * Multiplies and adds pairs of channels with PMADDWD. Each frame is loaded
+ * with the channels after it, which have no gain, so the last frames are left
+ * to the reference so as not to read past the end of in.
+ */
+void sampleDownmix(const struct downmix_t* mix, int16_t* out,
+		const int16_t* in, size_t frames)
+{
+	const __m128i gl = _mm_loadu_si128((const __m128i*)mix->gains[0]);
+	const __m128i gr = _mm_loadu_si128((const __m128i*)mix->gains[1]);
+	const __m128i round = _mm_set1_epi32(1 << 14);
+	unsigned chans = mix->chans;
+	size_t tail = (SAMPLE_CHANNELS_MAX + chans - 1) / chans;
+	size_t i;
+
+	for(i = 0; i + tail <= frames; i++, in += chans, out += 2)
+	{
+		__m128i x = _mm_loadu_si128((const __m128i*)in);
+		__m128i l = _mm_madd_epi16(x, gl);
+		__m128i r = _mm_madd_epi16(x, gr);
+		__m128i sum;
+		int32_t pair;
+
+		/* Sum each of l and r, leaving them in the two lowest words. */
+		sum = _mm_add_epi32(_mm_unpacklo_epi32(l, r),
+				_mm_unpackhi_epi32(l, r));
+		sum = _mm_add_epi32(sum, _mm_srli_si128(sum, 8));
+		sum = _mm_srai_epi32(_mm_add_epi32(sum, round), 15);
+
+		pair = _mm_cvtsi128_si32(_mm_packs_epi32(sum, sum));
+		memcpy(out, &pair, sizeof(pair));
+	}
+
+	sampleDownmixRef(mix, out, in, frames - i);
+}
+#elif defined __ARM_FEATURE_SIMD32
+/**
+ * ARMv6 version, which multiplies and adds two channels at a time with SMLAD.
+ */
+void sampleDownmix(const struct downmix_t* mix, int16_t* out,
+		const int16_t* in, size_t frames)
+{
+	unsigned chans = mix->chans;
+
+	for(size_t i = 0; i < frames; i++, in += chans, out += 2)
+	{
+		int32_t left = 1 << 14;
+		int32_t right = 1 << 14;
+		unsigned c;
+
+		for(c = 0; c + 1 < chans; c += 2)
+		{
+			int16x2_t pair;
+
+			memcpy(&pair, &in[c], sizeof(pair));
+			left = __smlad(pair, mix->pairs[0][c / 2], left);
+			right = __smlad(pair, mix->pairs[1][c / 2], right);
+		}
+
+		if(c < chans)
+		{
+			left += in[c] * mix->gains[0][c];
+			right += in[c] * mix->gains[1][c];
+		}
+
+		out[0] = __ssat(left >> 15, 16);
+		out[1] = __ssat(right >> 15, 16);
+	}
+}
+#else
+void sampleDownmix(const struct downmix_t* mix, int16_t* out,
+		const int16_t* in, size_t frames)
+{
+	sampleDownmixRef(mix, out, in, frames);
+}
+#endif
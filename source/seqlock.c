@@ -0,0 +1,100 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "seqlock.h"
+
+#define WORD_SIZE	sizeof(unsigned)
+
+/**
+ * Initialise lock, with the data set to zero.
+ *
+ * \param	lock	Lock to initialise.
+ * \param	size	Size of the data in bytes.
+ * \return			0 on success, else failure with errno set.
+ */
+int seqlockInit(struct seqlock_t* lock, size_t size)
+{
+	size_t count = (size + WORD_SIZE - 1) / WORD_SIZE;
+
+	if((lock->words = malloc(count * sizeof(atomic_uint))) == NULL)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for(size_t i = 0; i < count; i++)
+		atomic_init(&lock->words[i], 0);
+
+	lock->size = size;
+	atomic_init(&lock->seq, 0);
+
+	return 0;
+}
+
+/**
+ * Free lock memory. No thread may be using the lock.
+ */
+void seqlockExit(struct seqlock_t* lock)
+{
+	free(lock->words);
+	lock->words = NULL;
+}
+
+/**
+ * Replace the data. Must only be called by the writer.
+ *
+ * \param	lock	Lock.
+ * \param	data	Data to copy in.
+ */
+void seqlockWrite(struct seqlock_t* lock, const void* data)
+{
+	const unsigned char* src = data;
+	unsigned seq = atomic_load_explicit(&lock->seq, memory_order_relaxed);
+
+	/* Readers that see any of the new words also see the odd count. */
+	atomic_store_explicit(&lock->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	for(size_t i = 0; i * WORD_SIZE < lock->size; i++)
+	{
+		size_t len = lock->size - i * WORD_SIZE;
+		unsigned word = 0;
+
+		memcpy(&word, src + i * WORD_SIZE, len < WORD_SIZE ? len : WORD_SIZE);
+		atomic_store_explicit(&lock->words[i], word, memory_order_relaxed);
+	}
+
+	atomic_store_explicit(&lock->seq, seq + 2, memory_order_release);
+}
+
+/**
+ * Copy out the data as it was after a single write.
+ *
+ * \param	lock	Lock.
+ * \param	data	Location to copy data to.
+ */
+void seqlockRead(struct seqlock_t* lock, void* data)
+{
+	unsigned char* dst = data;
+	unsigned seq;
+
+	do
+	{
+		seq = atomic_load_explicit(&lock->seq, memory_order_acquire);
+
+		for(size_t i = 0; i * WORD_SIZE < lock->size; i++)
+		{
+			size_t len = lock->size - i * WORD_SIZE;
+			unsigned word = atomic_load_explicit(&lock->words[i],
+					memory_order_relaxed);
+
+			memcpy(dst + i * WORD_SIZE, &word,
+					len < WORD_SIZE ? len : WORD_SIZE);
+		}
+
+		/* The words must be read before the count is checked again. */
+		atomic_thread_fence(memory_order_acquire);
+	} while((seq & 1) != 0 ||
+			atomic_load_explicit(&lock->seq, memory_order_relaxed) != seq);
+}
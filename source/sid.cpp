@@ -1,3 +1,4 @@
+#include <atomic>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,12 +6,14 @@
 
 extern "C"
 {
+#include "file.h"
 #include "playback.h"
-static int initSid(const char* file);
-static uint32_t rateSid(void);
-static uint8_t channelSid(void);
-static uint64_t readSid(void* buffer);
-static void exitSid(void);
+static void* initSid(struct probe_t* probe);
+static uint32_t rateSid(void* ctx);
+static uint8_t channelSid(void* ctx);
+static uint64_t readSid(void* ctx, void* buffer);
+static void exitSid(void* ctx);
+static int seekSid(void* ctx, uint64_t sample);
 }
 
 static uint32_t		frequency = 44100;
@@ -22,8 +25,16 @@ static size_t		buffSize = 0.5*frequency*channels; // 0.5 seconds
 static int			sampleFormat = SIDEMU_SIGNED_PCM;
 static int			bitsPerSample = SIDEMU_16BIT;
 
-emuEngine	*myEmuEngine = NULL;
-sidTune		*myTune = NULL;
+struct sid_t
+{
+	emuEngine	*myEmuEngine;
+	sidTune		*myTune;
+	probe_t		*probe;
+};
+
+/* The emulator in libsidplay keeps its state in globals, so only one SID file
+ * may be open at a time. */
+static std::atomic_flag	inUse = ATOMIC_FLAG_INIT;
 
 /**
  * Set decoder parameters for SID.
@@ -38,40 +49,69 @@ extern "C" void setSid(struct decoder_fn* decoder)
 	decoder->buffSize = buffSize;
 	decoder->decode = &readSid;
 	decoder->exit = &exitSid;
+	decoder->seek = &seekSid;
 }
 
 /**
  * Initialise SID playback.
  *
- * \param	file	Location of SID file to play.
- * \return			0 on success, else failure.
+ * \param	probe	Probed SID file to play. Owned by the decoder on success.
+ * \return			Decoder context, or NULL on failure.
  */
-int initSid(const char* file)
+void* initSid(struct probe_t* probe)
 {
+	struct sid_t* sid;
+	ubyte* data;
+	size_t len;
+
+	if (inUse.test_and_set())
+		return NULL;
+
+	sid = new sid_t();
+
 	// init emuEngine
-	myEmuEngine = new emuEngine;
-	if ( !myEmuEngine )
-		return -1;
+	sid->myEmuEngine = new emuEngine;
+	if ( !sid->myEmuEngine )
+		goto err;
 
-	//configure emuEngine
-	struct emuConfig myEmuConfig;
-	myEmuEngine->getConfig(myEmuConfig);
-	myEmuConfig.frequency = frequency;
-	myEmuConfig.channels = channels;
-	myEmuConfig.bitsPerSample = bitsPerSample;
-	myEmuConfig.sampleFormat = sampleFormat;
-	myEmuEngine->setConfig(myEmuConfig);
-
-	// load the SID file
-	myTune=new sidTune ( file );
-	if ( !myTune )
-		return -1;
+	{
+		//configure emuEngine
+		struct emuConfig myEmuConfig;
+		sid->myEmuEngine->getConfig(myEmuConfig);
+		myEmuConfig.frequency = frequency;
+		myEmuConfig.channels = channels;
+		myEmuConfig.bitsPerSample = bitsPerSample;
+		myEmuConfig.sampleFormat = sampleFormat;
+		sid->myEmuEngine->setConfig(myEmuConfig);
+	}
+
+	// load the SID file, which is small enough to read whole
+	len = probe->st.st_size;
+	data = (ubyte*) malloc(len);
+	if ( !data )
+		goto err;
+
+	if ( probeRead(probe, data, len) != len )
+	{
+		free(data);
+		goto err;
+	}
+
+	sid->myTune=new sidTune ( data, len );
+	free(data);
+	if ( !sid->myTune || !sid->myTune->getStatus() )
+		goto err;
 
 	// init emuEngine with sidTune
-	if ( !sidEmuInitializeSong(*myEmuEngine,*myTune,selectedSong) )
-		return -1;
+	if ( !sidEmuInitializeSong(*sid->myEmuEngine,*sid->myTune,selectedSong) )
+		goto err;
 
-	return 0;
+	sid->probe = probe;
+	return sid;
+
+err:
+	exitSid(sid);
+	return NULL;
 }
 
 /**
@@ -79,8 +119,9 @@ int initSid(const char* file)
  *
  * \return	Sampling rate.
  */
-uint32_t rateSid(void)
+uint32_t rateSid(void* ctx)
 {
+	(void) ctx;
 	return (frequency);
 }
 
@@ -89,8 +130,9 @@ uint32_t rateSid(void)
  *
  * \return	Number of channels for opened file.
  */
-uint8_t channelSid(void)
+uint8_t channelSid(void* ctx)
 {
+	(void) ctx;
 	return channels;
 }
 
@@ -100,25 +142,65 @@ uint8_t channelSid(void)
  * \param buffer	Output.
  * \return			Samples read for each channel.
  */
-uint64_t readSid(void* buffer)
+uint64_t readSid(void* ctx, void* buffer)
 {
-	sidEmuFillBuffer( *myEmuEngine, *myTune, buffer, buffSize*bitsPerSample/8 );
-	if (myTune->getStatus())
+	struct sid_t* sid = (struct sid_t*) ctx;
+
+	sidEmuFillBuffer( *sid->myEmuEngine, *sid->myTune, buffer, buffSize*bitsPerSample/8 );
+	if (sid->myTune->getStatus())
 		return buffSize;
 	return 0;
 }
 
+/**
+ * Seek to a sample of open SID file. SID tunes are programs rather than
+ * recordings, so the tune is restarted and rendered up to the sample.
+ *
+ * \param sample	Sample for each channel to seek to.
+ * \return			0 on success, else failure.
+ */
+int seekSid(void* ctx, uint64_t sample)
+{
+	struct sid_t* sid = (struct sid_t*) ctx;
+	uint64_t skip = sample * channels;
+	int16_t* scratch;
+
+	if ( !sidEmuInitializeSong(*sid->myEmuEngine,*sid->myTune,selectedSong) )
+		return -1;
+
+	scratch = (int16_t*) malloc(buffSize * sizeof(int16_t));
+	if ( !scratch )
+		return -1;
+
+	while (skip > 0)
+	{
+		size_t len = skip < buffSize ? skip : buffSize;
+
+		sidEmuFillBuffer( *sid->myEmuEngine, *sid->myTune, scratch, len*bitsPerSample/8 );
+		skip -= len;
+	}
+
+	free(scratch);
+	return 0;
+}
+
 /**
  * Free Sid file.
  */
-void exitSid(void)
+void exitSid(void* ctx)
 {
-	if(myTune)
+	struct sid_t* sid = (struct sid_t*) ctx;
+
+	if(sid->myTune)
 	{
-		delete(myTune);
+		delete(sid->myTune);
 	}
-	if (myEmuEngine)
+	if (sid->myEmuEngine)
 	{
-		delete(myEmuEngine);
+		delete(sid->myEmuEngine);
 	}
+
+	probeClose(sid->probe);
+	delete(sid);
+	inUse.clear();
 }
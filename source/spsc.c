@@ -0,0 +1,105 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spsc.h"
+
+/**
+ * Initialise queue.
+ *
+ * \param	q			Queue to initialise.
+ * \param	capacity	Minimum number of elements the queue must hold.
+ * \param	elemSize	Size of each element in bytes.
+ * \return				0 on success, else failure with errno set.
+ */
+int spscInit(struct spsc_t* q, size_t capacity, size_t elemSize)
+{
+	size_t slots = 1;
+
+	/* Round up to a power of two so that indexes may be masked. */
+	while(slots < capacity)
+		slots <<= 1;
+
+	if((q->data = malloc(slots * elemSize)) == NULL)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+
+	q->elemSize = elemSize;
+	q->mask = slots - 1;
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+
+	return 0;
+}
+
+/**
+ * Free queue memory. No thread may be using the queue.
+ */
+void spscExit(struct spsc_t* q)
+{
+	free(q->data);
+	q->data = NULL;
+}
+
+/**
+ * Remove all elements from the queue. No thread may be using the queue.
+ */
+void spscClear(struct spsc_t* q)
+{
+	atomic_store(&q->head, atomic_load(&q->tail));
+}
+
+/**
+ * Add an element to the queue. Must only be called by the producer.
+ *
+ * \param	q		Queue.
+ * \param	elem	Element to copy into queue.
+ * \return			false if the queue is full, else true.
+ */
+bool spscPush(struct spsc_t* q, const void* elem)
+{
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+	if(tail - head > q->mask)
+		return false;
+
+	memcpy(q->data + (tail & q->mask) * q->elemSize, elem, q->elemSize);
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+
+	return true;
+}
+
+/**
+ * Remove the oldest element from the queue. Must only be called by the
+ * consumer.
+ *
+ * \param	q		Queue.
+ * \param	elem	Location to copy element to.
+ * \return			false if the queue is empty, else true.
+ */
+bool spscPop(struct spsc_t* q, void* elem)
+{
+	size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+
+	if(head == tail)
+		return false;
+
+	memcpy(elem, q->data + (head & q->mask) * q->elemSize, q->elemSize);
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+
+	return true;
+}
+
+/**
+ * Get number of elements in the queue. The result may be stale by the time it
+ * is used if the other thread is active.
+ */
+size_t spscCount(struct spsc_t* q)
+{
+	return atomic_load_explicit(&q->tail, memory_order_acquire) -
+		atomic_load_explicit(&q->head, memory_order_acquire);
+}
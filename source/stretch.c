@@ -0,0 +1,488 @@
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined __SSE2__
+#include <emmintrin.h>
+#elif defined __ARM_FEATURE_SIMD32
+#include <arm_acle.h>
+#endif
+
+#include "sample.h"
+#include "stretch.h"
+
+/* Lengths of each segment, of the overlap between segments and of the window
+ * searched for the start of each segment, in milliseconds. Segments of about
+ * the length of a syllable keep speech clear, and a window of a few pitch
+ * periods of a voice lets each segment be lined up with the one before. */
+#define STRETCH_SEGMENT_MS	40
+#define STRETCH_OVERLAP_MS	8
+#define STRETCH_WINDOW_MS	15
+
+/* The window is first searched at every STRETCH_SEARCH_STEP frames, and then
+ * at every frame either side of the best of those. */
+#define STRETCH_SEARCH_STEP	4
+
+/**
+ * Get a length in frames, rounded up to a multiple of 8.
+ */
+static unsigned msFrames(uint32_t rate, unsigned ms)
+{
+	uint64_t frames = ((uint64_t)rate * ms + 999) / 1000;
+
+	return frames < 8 ? 8 : (unsigned)(frames + 7) / 8 * 8;
+}
+
+/**
+ * Get the number of frames that the window of the next segment moves on by at
+ * a speed, with what is left over in Q16.
+ */
+static size_t segmentStep(const struct stretcher_t* st, uint32_t speed,
+		uint32_t* frac)
+{
+	uint64_t step = (uint64_t)(st->segLen - st->overlap) * speed + st->posFrac;
+
+	*frac = step & (STRETCH_SPEED_UNITY - 1);
+	return step >> STRETCH_SPEED_SHIFT;
+}
+
+/**
+ * Get the most input frames past pos that a segment may need, at any speed.
+ */
+static size_t segmentNeed(const struct stretcher_t* st)
+{
+	uint64_t step = ((uint64_t)(st->segLen - st->overlap) * STRETCH_SPEED_MAX >>
+			STRETCH_SPEED_SHIFT) + 1;
+	size_t need = st->window + st->segLen;
+
+	return step > need ? step : need;
+}
+
+int stretchInit(struct stretcher_t* st, uint32_t rate, unsigned chans,
+		size_t maxFrames)
+{
+	size_t need;
+
+	memset(st, 0, sizeof(*st));
+
+	if(rate == 0 || chans < 1 || chans > STRETCH_CHANNELS_MAX)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	st->chans = chans;
+	st->speed = STRETCH_SPEED_UNITY;
+	st->segLen = msFrames(rate, STRETCH_SEGMENT_MS);
+	st->overlap = msFrames(rate, STRETCH_OVERLAP_MS);
+	st->window = msFrames(rate, STRETCH_WINDOW_MS);
+	st->fadeStep = sampleFadeStep(st->overlap);
+
+	/* Keep each of the two lanes of the sums from overflowing, even with full
+	 * scale input. */
+	while(((uint64_t)st->overlap / 2 << (30 - 2 * st->monoShift)) > INT32_MAX)
+		st->monoShift++;
+
+	need = segmentNeed(st);
+	st->histSize = maxFrames + need;
+
+	if((st->hist = malloc(st->histSize * chans * sizeof(int16_t))) == NULL ||
+			(st->mono = malloc(st->histSize * sizeof(int16_t))) == NULL ||
+			(st->tail = malloc(st->overlap * chans *
+					sizeof(int16_t))) == NULL ||
+			(st->tailMono = malloc(st->overlap * sizeof(int16_t))) == NULL ||
+			(st->out = malloc(need * chans * sizeof(int16_t))) == NULL)
+	{
+		stretchExit(st);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	stretchReset(st);
+	return 0;
+}
+
+void stretchExit(struct stretcher_t* st)
+{
+	free(st->hist);
+	free(st->mono);
+	free(st->tail);
+	free(st->tailMono);
+	free(st->out);
+	st->hist = NULL;
+	st->mono = NULL;
+	st->tail = NULL;
+	st->tailMono = NULL;
+	st->out = NULL;
+}
+
+void stretchSetSpeed(struct stretcher_t* st, uint32_t speed)
+{
+	if(speed < STRETCH_SPEED_MIN)
+		speed = STRETCH_SPEED_MIN;
+	else if(speed > STRETCH_SPEED_MAX)
+		speed = STRETCH_SPEED_MAX;
+
+	st->speed = speed;
+}
+
+void stretchReset(struct stretcher_t* st)
+{
+	st->histLen = 0;
+	st->pos = 0;
+	st->posFrac = 0;
+	st->hasTail = false;
+	st->outLen = 0;
+	st->outNext = 0;
+	st->segSource = 0;
+	st->segStart = 0;
+	st->inPos = 0;
+	st->ended = false;
+}
+
+/**
+ * Make room at the end of the history by dropping the frames before the window
+ * of the next segment.
+ */
+static void compactHistory(struct stretcher_t* st)
+{
+	if(st->pos == 0)
+		return;
+
+	st->histLen -= st->pos;
+	memmove(st->hist, st->hist + st->pos * st->chans,
+			st->histLen * st->chans * sizeof(int16_t));
+	memmove(st->mono, st->mono + st->pos, st->histLen * sizeof(int16_t));
+	st->pos = 0;
+}
+
+void stretchWrite(struct stretcher_t* st, const int16_t* in, size_t frames)
+{
+	int16_t* mono;
+
+	compactHistory(st);
+
+	if(frames > st->histSize - st->histLen)
+		frames = st->histSize - st->histLen;
+
+	memcpy(st->hist + st->histLen * st->chans, in,
+			frames * st->chans * sizeof(int16_t));
+
+	mono = st->mono + st->histLen;
+	if(st->chans == 1)
+	{
+		for(size_t i = 0; i < frames; i++)
+			mono[i] = in[i] >> st->monoShift;
+	}
+	else
+	{
+		for(size_t i = 0; i < frames; i++)
+			mono[i] = (in[i * 2] + in[i * 2 + 1]) >> (st->monoShift + 1);
+	}
+
+	st->histLen += frames;
+	st->inPos += frames;
+}
+
+void stretchFlush(struct stretcher_t* st)
+{
+	st->ended = true;
+}
+
+uint64_t stretchSource(const struct stretcher_t* st)
+{
+	if(st->outLen == 0)
+		return st->segStart;
+
+	return st->segStart + (uint64_t)st->segSource * st->outNext / st->outLen;
+}
+
+/**
+ * Multiply and add the end of the segment before with a candidate start of
+ * the next segment, and the candidate with itself, in the mono mix.
+ */
+typedef void (*stretchCorr_fn)(const int16_t* tail, const int16_t* in,
+		unsigned len, int64_t* corr, int64_t* energy);
+
+static void corrRef(const int16_t* tail, const int16_t* in, unsigned len,
+		int64_t* corr, int64_t* energy)
+{
+	int64_t c = 0, e = 0;
+
+	for(unsigned k = 0; k < len; k++)
+	{
+		c += tail[k] * in[k];
+		e += in[k] * in[k];
+	}
+
+	*corr = c;
+	*energy = e;
+}
+
+#if defined __SSE2__
+/**
+ * Multiplies and adds eight frames at a time with PMADDWD. The four lanes of
+ * each sum are only added together at the end, in 64 bits.
+ */
+static void corrFast(const int16_t* tail, const int16_t* in, unsigned len,
+		int64_t* corr, int64_t* energy)
+{
+	__m128i	c = _mm_setzero_si128();
+	__m128i	e = _mm_setzero_si128();
+	int32_t	lanes[2][4];
+
+	for(unsigned k = 0; k < len; k += 8)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i*)&tail[k]);
+		__m128i b = _mm_loadu_si128((const __m128i*)&in[k]);
+
+		c = _mm_add_epi32(c, _mm_madd_epi16(a, b));
+		e = _mm_add_epi32(e, _mm_madd_epi16(b, b));
+	}
+
+	_mm_storeu_si128((__m128i*)lanes[0], c);
+	_mm_storeu_si128((__m128i*)lanes[1], e);
+	*corr = (int64_t)lanes[0][0] + lanes[0][1] + lanes[0][2] + lanes[0][3];
+	*energy = (int64_t)lanes[1][0] + lanes[1][1] + lanes[1][2] + lanes[1][3];
+}
+#elif defined __ARM_FEATURE_SIMD32
+/**
+ * ARMv6 version, which multiplies and adds two frames at a time with SMLAD,
+ * into two accumulators for each sum so that they all stay in registers.
+ */
+static void corrFast(const int16_t* tail, const int16_t* in, unsigned len,
+		int64_t* corr, int64_t* energy)
+{
+	int32_t c[2] = { 0 }, e[2] = { 0 };
+
+	for(unsigned k = 0; k < len; k += 4)
+	{
+		for(unsigned lane = 0; lane < 2; lane++)
+		{
+			int16x2_t a, b;
+
+			memcpy(&a, &tail[k + lane * 2], sizeof(a));
+			memcpy(&b, &in[k + lane * 2], sizeof(b));
+			c[lane] = __smlad(a, b, c[lane]);
+			e[lane] = __smlad(b, b, e[lane]);
+		}
+	}
+
+	*corr = (int64_t)c[0] + c[1];
+	*energy = (int64_t)e[0] + e[1];
+}
+#else
+static void corrFast(const int16_t* tail, const int16_t* in, unsigned len,
+		int64_t* corr, int64_t* energy)
+{
+	corrRef(tail, in, len, corr, energy);
+}
+#endif
+
+/**
+ * Score how well a candidate start of the next segment matches the end of the
+ * segment before, by their correlation normalised by the energy of the
+ * candidate. The score is squared, keeping its sign, to save a square root.
+ */
+static float scoreCandidate(const struct stretcher_t* st, size_t start,
+		stretchCorr_fn corr)
+{
+	int64_t c, e;
+
+	(*corr)(st->tailMono, st->mono + start, st->overlap, &c, &e);
+	return (float)c * fabsf((float)c) / ((float)e + 1);
+}
+
+/**
+ * Find the start of the next segment within the window.
+ *
+ * \param	st		Stretcher.
+ * \param	count	Number of candidates from pos, at least 1.
+ * \param	corr	Function used to score candidates.
+ * \return			Frame of the history at which the segment starts.
+ */
+static size_t findSegment(const struct stretcher_t* st, size_t count,
+		stretchCorr_fn corr)
+{
+	size_t	best = st->pos;
+	float	bestScore = scoreCandidate(st, best, corr);
+	size_t	first, last;
+
+	for(size_t i = STRETCH_SEARCH_STEP; i < count; i += STRETCH_SEARCH_STEP)
+	{
+		float score = scoreCandidate(st, st->pos + i, corr);
+
+		if(score > bestScore)
+		{
+			best = st->pos + i;
+			bestScore = score;
+		}
+	}
+
+	first = best - st->pos < STRETCH_SEARCH_STEP ?
+		st->pos : best - (STRETCH_SEARCH_STEP - 1);
+	last = best + (STRETCH_SEARCH_STEP - 1);
+	if(last > st->pos + count - 1)
+		last = st->pos + count - 1;
+
+	for(size_t i = first, centre = best; i <= last; i++)
+	{
+		float score;
+
+		if(i == centre)
+			continue;
+
+		if((score = scoreCandidate(st, i, corr)) > bestScore)
+		{
+			best = i;
+			bestScore = score;
+		}
+	}
+
+	return best;
+}
+
+/**
+ * Make the output of a segment, by fading out the end of the segment before
+ * over its start. If there was no segment before, the segment starts as it
+ * is.
+ *
+ * \param	st		Stretcher.
+ * \param	start	Frame of the history at which the segment starts.
+ * \param	len		Length of the segment, at least overlap unless there was
+ *					no segment before.
+ * \param	keep	If true, the end of the segment is kept to fade out over
+ *					the next segment, rather than put in the output.
+ */
+static void outputSegment(struct stretcher_t* st, size_t start, size_t len,
+		bool keep)
+{
+	const int16_t*	in = st->hist + start * st->chans;
+	size_t			chans = st->chans;
+	size_t			copied = 0;
+
+	if(st->hasTail == true)
+	{
+		memcpy(st->out, st->tail, st->overlap * chans * sizeof(int16_t));
+		sampleFade(st->out, in, st->overlap, chans, 0, st->fadeStep);
+		copied = st->overlap;
+	}
+
+	if(keep == true)
+	{
+		len -= st->overlap;
+		memcpy(st->tail, in + len * chans,
+				st->overlap * chans * sizeof(int16_t));
+		memcpy(st->tailMono, st->mono + start + len,
+				st->overlap * sizeof(int16_t));
+	}
+
+	memcpy(st->out + copied * chans, in + copied * chans,
+			(len - copied) * chans * sizeof(int16_t));
+
+	st->hasTail = keep;
+	st->outLen = len;
+	st->outNext = 0;
+}
+
+/**
+ * Make the next segment, if there is enough input for it. Once the input has
+ * ended, the last segment holds the rest of the input.
+ *
+ * \return	true if a segment was made.
+ */
+static bool makeSegment(struct stretcher_t* st, stretchCorr_fn corr)
+{
+	uint32_t	frac;
+	size_t		step = segmentStep(st, st->speed, &frac);
+	size_t		need = st->window + st->segLen;
+	size_t		start = st->pos;
+	size_t		rest = st->histLen - st->pos;
+
+	/* The window never moves past the input written so far. */
+	if(step > need)
+		need = step;
+
+	st->segStart += st->segSource;
+	st->segSource = 0;
+	st->outLen = 0;
+	st->outNext = 0;
+
+	if(rest >= need)
+	{
+		if(st->hasTail == true)
+			start = findSegment(st, st->window, corr);
+
+		outputSegment(st, start, st->segLen, true);
+		st->segSource = step;
+		st->pos += step;
+		st->posFrac = frac;
+		return true;
+	}
+
+	if(st->ended == false || (rest == 0 && st->hasTail == false))
+		return false;
+
+	/* Play out the end of the segment before, and then the rest of the input
+	 * as it is. */
+	if(st->hasTail == true && rest >= st->overlap)
+	{
+		size_t count = rest - st->overlap + 1;
+
+		start = findSegment(st, count < st->window ? count : st->window, corr);
+		outputSegment(st, start, st->histLen - start, false);
+	}
+	else if(st->hasTail == true)
+	{
+		memcpy(st->out, st->tail, st->overlap * st->chans * sizeof(int16_t));
+		st->hasTail = false;
+		st->outLen = st->overlap;
+	}
+	else
+		outputSegment(st, start, rest, false);
+
+	st->segSource = rest;
+	st->pos = st->histLen;
+	st->posFrac = 0;
+	return true;
+}
+
+/**
+ * Copy out the output of each segment, making the next segment whenever one
+ * runs out.
+ */
+static inline size_t readFrames(struct stretcher_t* st, int16_t* out,
+		size_t frames, stretchCorr_fn corr)
+{
+	size_t made = 0;
+
+	while(made < frames)
+	{
+		size_t len;
+
+		if(st->outNext == st->outLen && makeSegment(st, corr) == false)
+			break;
+
+		len = st->outLen - st->outNext;
+		if(len > frames - made)
+			len = frames - made;
+
+		memcpy(out + made * st->chans, st->out + st->outNext * st->chans,
+				len * st->chans * sizeof(int16_t));
+		made += len;
+		st->outNext += len;
+	}
+
+	return made;
+}
+
+size_t stretchReadRef(struct stretcher_t* st, int16_t* out, size_t frames)
+{
+	return readFrames(st, out, frames, corrRef);
+}
+
+size_t stretchRead(struct stretcher_t* st, int16_t* out, size_t frames)
+{
+	return readFrames(st, out, frames, corrFast);
+}
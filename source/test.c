@@ -1,95 +1,1344 @@
 #if defined __gnu_linux__
 #include <errno.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "cache.h"
 #include "error.h"
 #include "file.h"
-#include "flac.h"
-#include "mp3.h"
-#include "opus.h"
+#include "output.h"
+#include "platform.h"
 #include "playback.h"
-#include "vorbis.h"
+#include "resample.h"
+#include "sample.h"
+#include "stretch.h"
 #include "wav.h"
 
 /**
- * Test the various decoder modules in ctrmus.
+ * Play a file through the playback engine.
+ *
+ * \param	file		File to play.
+ * \param	next		File to play straight after file, or NULL.
+ * \param	info		Playback information given to playbackInit().
+ * \param	switchMs	If not 0, skip to next after this many milliseconds.
+ * \return				0 on success, else failure.
  */
-int main(int argc, char *argv[])
+static int testPlayback(const char *file, const char *next,
+		struct playbackInfo_t *info, unsigned long switchMs)
 {
-	struct decoder_fn	decoder;
-	enum file_types		ft;
-	const char			*file = argv[1];
-	int16_t				*buffer = NULL;
-	FILE				*out;
+	struct playbackEvent_t	event;
+	int				error = 0;
+	uint64_t		start, elapsed;
+	bool			switched = false, stopped = false;
+	struct ioStats_t	io, ioEnd;
+	struct playbackPosition_t	pos, last = { 0 };
+	size_t			reads = 0, backwards = 0, mostBack = 0;
+	size_t			underruns = 0;
 
-	if(argc != 2)
+	getIoStats(&io);
+	start = platformTime();
+
+	if(playbackPlay(file, next) != 0)
 	{
-		puts("FILE is required.");
-		printf("%s FILE\n", argv[0]);
-		return 0;
+		printf("Unable to play: %s\n", strerror(errno));
+		return -1;
 	}
 
-	switch(ft = getFileType(file))
+	/* Wait for playback to stop, checking that the position only moves on
+	 * between jumps. */
+	while(stopped == false)
 	{
-		case FILE_TYPE_WAV:
-			setWav(&decoder);
-			break;
+		playbackGetPosition(&pos);
+		reads++;
 
-		case FILE_TYPE_FLAC:
-			setFlac(&decoder);
-			break;
+		if(pos.serial == last.serial &&
+				pos.samples_played < last.samples_played)
+		{
+			backwards++;
+			if(last.samples_played - pos.samples_played > mostBack)
+				mostBack = last.samples_played - pos.samples_played;
+		}
 
-		case FILE_TYPE_OPUS:
-			setOpus(&decoder);
-			break;
+		last = pos;
 
-		case FILE_TYPE_MP3:
-			setMp3(&decoder);
-			break;
+		while(playbackGetEvent(&event) == true)
+		{
+			switch(event.type)
+			{
+			case PLAYBACK_EVENT_NEXT_TRACK:
+				printf("Next track %s started in %.3f ms with %u file "
+						"opens.\n", info->file, info->switch_ns / 1e6,
+						info->file_opens);
+				break;
+
+			case PLAYBACK_EVENT_UNDERRUN:
+				underruns++;
+				break;
+
+			case PLAYBACK_EVENT_ERROR:
+				error = event.error;
+				break;
+
+			case PLAYBACK_EVENT_STOPPED:
+				stopped = true;
+				break;
 
-		case FILE_TYPE_VORBIS:
-			setVorbis(&decoder);
+			default:
+				break;
+			}
+		}
+
+		if(switched == false && switchMs != 0 &&
+				platformTime() - start >= switchMs * 1000000)
+		{
+			switched = true;
+			playbackNext();
+		}
+
+		platformSleep(1000000);
+	}
+
+	elapsed = platformTime() - start;
+	getIoStats(&ioEnd);
+
+	if(error != 0)
+	{
+		printf("Error %d: %s\n", error, ctrmus_strerror(error));
+		return -1;
+	}
+
+	io.reads = ioEnd.reads - io.reads;
+	io.bytes = ioEnd.bytes - io.bytes;
+	playbackGetPosition(&pos);
+
+	printf("Played %zu samples of %s in %.3f s.\n", pos.samples_played,
+			info->file, elapsed / 1e9);
+	printf("Position: %zu reads, %zu went back (at most %zu samples)\n",
+			reads, backwards, mostBack);
+	printf("Buffers: %u, fewest queued: %u, underruns: %zu\n",
+			info->buffers_total, info->buffers_min_queued, underruns);
+	printf("Wakeups: %zu (%.1f/s)\n", info->wakeups,
+			info->wakeups / (elapsed / 1e9));
+	printf("Started in %.3f ms with %u file opens.\n", info->switch_ns / 1e6,
+			info->file_opens);
+	printf("Decoding: %.3f s (%.1f%% of the time)\n", info->decode_ns / 1e9,
+			100.0 * info->decode_ns / elapsed);
+	printf("File I/O: %lu opens, %lu reads, %lu seeks, %.1f KiB "
+			"(%.1f KiB per read)\n", ioEnd.opens - io.opens, io.reads,
+			ioEnd.seeks - io.seeks, io.bytes / 1024.0,
+			io.reads == 0 ? 0 : io.bytes / 1024.0 / io.reads);
+
+	return 0;
+}
+
+/**
+ * Time seeks to evenly spaced positions of a file, whilst paused.
+ *
+ * \param	file	File to seek in.
+ * \param	info	Playback information given to playbackInit().
+ * \param	steps	Number of positions to seek to.
+ * \return			0 on success, else failure.
+ */
+static int testSeek(const char *file, struct playbackInfo_t *info,
+		unsigned long steps)
+{
+	struct playbackEvent_t	event;
+	int				error = 0;
+	struct playbackPosition_t	pos;
+	size_t			total;
+	uint64_t		sum = 0;
+
+	if(playbackPlay(file, NULL) != 0)
+	{
+		printf("Unable to play: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* Stop the output from moving on between seeks. */
+	togglePlayback();
+
+	do
+	{
+		platformSleep(100000);
+		playbackGetPosition(&pos);
+	} while(pos.samples_per_second == 0 && isPlaying() == true);
+
+	/* Assume a minute if the length is unknown. */
+	if((total = pos.samples_total) == 0)
+		total = pos.samples_per_second * 60;
+
+	puts("Position\tSeek time");
+
+	for(unsigned long i = 0; i < steps && error == 0; i++)
+	{
+		size_t pos = total / steps * i;
+		bool moved = false;
+
+		playbackSeek(pos);
+
+		/* A failed seek is reported as an error and stops playback. */
+		while(moved == false && error == 0)
+		{
+			platformSleep(100000);
+
+			while(playbackGetEvent(&event) == true)
+			{
+				if(event.type == PLAYBACK_EVENT_POSITION)
+					moved = true;
+				else if(event.type == PLAYBACK_EVENT_ERROR)
+					error = event.error;
+			}
+		}
+
+		if(error != 0)
 			break;
 
-		default:
-			puts("Unsupported file.");
-			goto err;
+		printf("%5.1f%%\t\t%.3f ms\n", 100.0 * pos / total,
+				info->seek_ns / 1e6);
+		sum += info->seek_ns;
 	}
 
-	printf("Type: %s\n", fileToStr(ft));
+	stopPlayback();
+
+	while(isPlaying() == true)
+		platformSleep(100000);
 
-	if((*decoder.init)(file) != 0)
+	if(error != 0)
+	{
+		printf("Error %d: %s\n", error, ctrmus_strerror(error));
+		return -1;
+	}
+
+	printf("Mean seek time: %.3f ms\n", sum / 1e6 / steps);
+	return 0;
+}
+
+/**
+ * Decode a whole file as fast as possible, without any output, and time the
+ * CPU used for each second of audio.
+ *
+ * \param	file	File to decode.
+ * \param	name	Name of the way the file is decoded, printed with the time.
+ * \return			0 on success, else failure.
+ */
+static int timeDecode(const char *file, const char *name)
+{
+	struct probe_t		*probe;
+	struct decoder_fn	dec;
+	void				*ctx;
+	int16_t				*buf;
+	uint64_t			samples = 0;
+	uint64_t			read;
+	clock_t				start;
+	double				cpu, audio;
+
+	if((probe = probeOpen(file)) == NULL || probe->decoder == NULL)
+	{
+		puts("Unsupported file.");
+		probeClose(probe);
+		return -1;
+	}
+
+	memset(&dec, 0, sizeof(dec));
+	(*probe->decoder->set)(&dec);
+
+	if((ctx = (*dec.init)(probe)) == NULL)
 	{
 		puts("Unable to initialise decoder.");
-		goto err;
+		probeClose(probe);
+		return -1;
 	}
 
-	if((*decoder.channels)() > 2 || (*decoder.channels)() < 1)
+	if((buf = malloc(dec.buffSize * sizeof(int16_t))) == NULL)
 	{
-		puts("Unable to obtain number of channels.");
-		goto err;
+		(*dec.exit)(ctx);
+		return -1;
+	}
+
+	start = clock();
+
+	while((read = (*dec.decode)(ctx, buf)) > 0)
+		samples += read;
+
+	cpu = (double)(clock() - start) / CLOCKS_PER_SEC;
+	audio = (double)samples / (*dec.rate)(ctx) / (*dec.channels)(ctx);
+
+	printf("%s: %.3f s of audio with %.3f s of CPU "
+			"(%.3f ms per second of audio)\n", name, audio, cpu,
+			audio == 0 ? 0 : cpu * 1000 / audio);
+
+	free(buf);
+	(*dec.exit)(ctx);
+	return 0;
+}
+
+/**
+ * Time the CPU used to decode a whole file. WAV files are timed both with
+ * all samples converted by dr_wav and with 16-bit PCM read without
+ * conversion, so that the two may be compared.
+ *
+ * \param	file	File to decode.
+ * \return			0 on success, else failure.
+ */
+static int testDecode(const char *file)
+{
+	int ret;
+
+	if(getFileType(file) != FILE_TYPE_WAV)
+		return timeDecode(file, "Decoded");
+
+	setWavConvert(true);
+	ret = timeDecode(file, "Converted");
+	setWavConvert(false);
+
+	return ret != 0 ? ret : timeDecode(file, "Not converted");
+}
+
+/* Frames given to each sample conversion. Odd, so that the scalar tail of
+ * each vector loop is used. */
+#define KERNEL_FRAMES	4093
+
+/**
+ * A sample conversion, run as its scalar reference or its fast version. Those
+ * that convert in place are given out == in.
+ */
+struct kernel_t
+{
+	const char	*name;
+	void		(*run)(bool fast, int16_t *out, const int16_t *in,
+					size_t frames, const void *arg);
+	unsigned	inChans;
+	unsigned	outChans;
+	const void	*arg;
+};
+
+static void runSwap16(bool fast, int16_t *out, const int16_t *in,
+		size_t frames, const void *arg)
+{
+	(void)in;
+	(void)arg;
+	(fast ? sampleSwap16 : sampleSwap16Ref)(out, frames);
+}
+
+static void runSign8(bool fast, int16_t *out, const int16_t *in,
+		size_t frames, const void *arg)
+{
+	(void)in;
+	(void)arg;
+	(fast ? sampleSign8 : sampleSign8Ref)((int8_t *)out, frames * 2);
+}
+
+static void runMonoToStereo(bool fast, int16_t *out, const int16_t *in,
+		size_t frames, const void *arg)
+{
+	(void)arg;
+	(fast ? sampleMonoToStereo : sampleMonoToStereoRef)(out, in, frames);
+}
+
+static void runGain(bool fast, int16_t *out, const int16_t *in,
+		size_t frames, const void *arg)
+{
+	(void)in;
+	(fast ? sampleGain : sampleGainRef)(out, frames, *(const int16_t *)arg);
+}
+
+/**
+ * A crossfade given to sampleFade().
+ */
+struct fadeTest_t
+{
+	unsigned	chans;
+	uint64_t	pos;
+	uint32_t	step;
+};
+
+static void runFade(bool fast, int16_t *out, const int16_t *in,
+		size_t frames, const void *arg)
+{
+	const struct fadeTest_t *fade = arg;
+
+	(fast ? sampleFade : sampleFadeRef)(out, in, frames, fade->chans,
+			fade->pos, fade->step);
+}
+
+static void runDownmix(bool fast, int16_t *out, const int16_t *in,
+		size_t frames, const void *arg)
+{
+	(fast ? sampleDownmix : sampleDownmixRef)(arg, out, in, frames);
+}
+
+/**
+ * Time a sample conversion, in MiB of input per second.
+ */
+static double timeKernel(const struct kernel_t *k, bool fast, int16_t *buf)
+{
+	size_t		bytes = KERNEL_FRAMES * k->inChans * sizeof(int16_t);
+	unsigned	reps = (64 << 20) / bytes;
+	uint64_t	start = platformTime();
+
+	for(unsigned i = 0; i < reps; i++)
+		(*k->run)(fast, buf, buf, KERNEL_FRAMES, k->arg);
+
+	return (double)reps * bytes / (1 << 20) /
+		((platformTime() - start) / 1e9);
+}
+
+/**
+ * Check that the fast version of each sample conversion gives the same output
+ * as its scalar reference, in place and not, then time both.
+ *
+ * \return	0 if every conversion gave the same output, else failure.
+ */
+static int testKernels(void)
+{
+	static const int16_t	gains[] = { 0, SAMPLE_GAIN_UNITY / 2,
+		SAMPLE_GAIN_UNITY, 5793, INT16_MAX, -SAMPLE_GAIN_UNITY, INT16_MIN };
+	static struct downmix_t	mixes[2][SAMPLE_CHANNELS_MAX + 1];
+	static struct fadeTest_t	fades[SAMPLE_CHANNELS_MAX][2];
+	static struct kernel_t	kernels[64];
+	/* One extra sample so that each buffer may be misaligned by one. */
+	static int16_t			src[KERNEL_FRAMES * SAMPLE_CHANNELS_MAX + 1];
+	static int16_t			ref[KERNEL_FRAMES * SAMPLE_CHANNELS_MAX + 1];
+	static int16_t			fast[KERNEL_FRAMES * SAMPLE_CHANNELS_MAX + 1];
+	static char				names[64][24];
+	unsigned				n = 0;
+	int						ret = 0;
+
+	kernels[n++] = (struct kernel_t){ "swap16", runSwap16, 1, 1, NULL };
+	kernels[n++] = (struct kernel_t){ "sign8", runSign8, 1, 1, NULL };
+	kernels[n++] = (struct kernel_t){ "mono to stereo", runMonoToStereo, 1, 2,
+		NULL };
+
+	for(unsigned i = 0; i < sizeof(gains) / sizeof(gains[0]); i++)
+	{
+		snprintf(names[n], sizeof(names[n]), "gain %d", gains[i]);
+		kernels[n] = (struct kernel_t){ names[n], runGain, 1, 1, &gains[i] };
+		n++;
+	}
+
+	/* Fades that end part way through, to cover the end of the fade. */
+	for(unsigned chans = 1; chans <= 3; chans++)
+	{
+		for(unsigned half = 0; half < 2; half++)
+		{
+			struct fadeTest_t *fade = &fades[chans - 1][half];
+
+			fade->chans = chans;
+			fade->pos = half * KERNEL_FRAMES / 2;
+			fade->step = sampleFadeStep(KERNEL_FRAMES);
+			snprintf(names[n], sizeof(names[n]), "fade %u %s", chans,
+					half ? "end" : "start");
+			kernels[n] = (struct kernel_t){ names[n], runFade, chans, chans,
+				fade };
+			n++;
+		}
 	}
 
-	out = fopen("out", "wb");
-	buffer = malloc(decoder.buffSize * sizeof(int16_t));
+	for(unsigned order = CHANNEL_ORDER_WAV; order <= CHANNEL_ORDER_VORBIS;
+			order++)
+	{
+		for(unsigned chans = 3; chans <= SAMPLE_CHANNELS_MAX; chans++)
+		{
+			sampleDownmixInit(&mixes[order][chans], chans, order);
+			snprintf(names[n], sizeof(names[n]), "downmix %u %s", chans,
+					order == CHANNEL_ORDER_WAV ? "wav" : "vorbis");
+			kernels[n] = (struct kernel_t){ names[n], runDownmix, chans, 2,
+				&mixes[order][chans] };
+			n++;
+		}
+	}
+
+	/* Include full scale samples, which are most likely to overflow. */
+	srand(1);
+	for(size_t i = 0; i < sizeof(src) / sizeof(src[0]); i++)
+	{
+		if(i % 17 == 0)
+			src[i] = INT16_MIN;
+		else if(i % 19 == 0)
+			src[i] = INT16_MAX;
+		else
+			src[i] = (int16_t)rand();
+	}
+
+	puts("Conversion\t\tResult\tRef MiB/s\tFast MiB/s");
 
-	while(true)
+	for(unsigned i = 0; i < n; i++)
 	{
-		size_t read = (*decoder.decode)(&buffer[0]);
+		const struct kernel_t	*k = &kernels[i];
+		size_t					inLen = KERNEL_FRAMES * k->inChans;
+		size_t					outLen = KERNEL_FRAMES * k->outChans;
+		bool					same = true;
+
+		for(unsigned align = 0; align < 2; align++)
+		{
+			for(unsigned inPlace = 0; inPlace < 2; inPlace++)
+			{
+				int16_t *r = ref + align;
+				int16_t *f = fast + align;
+
+				/* Those that convert in place always take their input from
+				 * out. */
+				memcpy(r, src, inLen * sizeof(int16_t));
+				memcpy(f, src, inLen * sizeof(int16_t));
+				(*k->run)(false, r, inPlace ? r : src + align, KERNEL_FRAMES,
+						k->arg);
+				(*k->run)(true, f, inPlace ? f : src + align, KERNEL_FRAMES,
+						k->arg);
+
+				if(memcmp(r, f, outLen * sizeof(int16_t)) != 0)
+					same = false;
+			}
+		}
+
+		printf("%-24s%s\t%9.1f\t%10.1f\n", k->name, same ? "ok" : "DIFFERS",
+				timeKernel(k, false, ref), timeKernel(k, true, fast));
+
+		if(same == false)
+			ret = -1;
+	}
+
+	return ret;
+}
+
+/* Frames given to each resampleWrite() by testResample(), as from a decoder. */
+#define RESAMPLE_CHUNK	1152
+
+/* Length of each tone of the sweep, in seconds. */
+#define RESAMPLE_TONE_S	0.25
+
+/**
+ * Resample all of a signal, a chunk at a time, and then flush the resampler.
+ *
+ * \param	rs		Resampler, at the start of the file.
+ * \param	fast	Use resampleRead() rather than resampleReadRef().
+ * \param	in		Interleaved input frames.
+ * \param	frames	Number of input frames.
+ * \param	out		Room for resampleFrames() output frames.
+ * \return			Output frames made.
+ */
+static size_t resampleAll(struct resampler_t *rs, bool fast, const int16_t *in,
+		size_t frames, int16_t *out)
+{
+	size_t (*read)(struct resampler_t *, int16_t *, size_t) =
+		fast ? resampleRead : resampleReadRef;
+	size_t total = resampleFrames(rs, frames);
+	size_t made = 0;
+
+	for(size_t i = 0; i < frames; i += RESAMPLE_CHUNK)
+	{
+		size_t len = frames - i < RESAMPLE_CHUNK ? frames - i : RESAMPLE_CHUNK;
+
+		resampleWrite(rs, in + i * rs->chans, len);
+		made += (*read)(rs, out + made * rs->chans, total - made);
+	}
+
+	resampleFlush(rs);
+	return made + (*read)(rs, out + made * rs->chans, total - made);
+}
+
+/**
+ * Measure the THD+N of a resampled tone, by fitting a sine wave of its
+ * frequency to it and comparing what is left over with the sine wave. Frames
+ * near each end, where the filter runs into silence, are left out.
+ *
+ * \param	out		Resampled stereo frames. Only the left channel is used.
+ * \param	frames	Number of frames.
+ * \param	freq	Frequency of tone, in cycles per frame.
+ * \param	edge	Frames to leave out at each end.
+ * \return			THD+N in dB.
+ */
+static double toneThdN(const int16_t *out, size_t frames, double freq,
+		size_t edge)
+{
+	double m[3][4] = { { 0 } };
+	double fit[3];
+	double signal = 0, noise = 0;
+
+	/* Least squares fit of a cosine, a sine and DC. */
+	for(size_t i = edge; i + edge < frames; i++)
+	{
+		double basis[3] = { cos(2 * M_PI * freq * i),
+			sin(2 * M_PI * freq * i), 1 };
+
+		for(unsigned r = 0; r < 3; r++)
+		{
+			for(unsigned c = 0; c < 3; c++)
+				m[r][c] += basis[r] * basis[c];
+
+			m[r][3] += basis[r] * out[i * 2];
+		}
+	}
+
+	for(unsigned p = 0; p < 3; p++)
+	{
+		for(unsigned r = 0; r < 3; r++)
+		{
+			double f = m[r][p] / m[p][p];
+
+			if(r == p)
+				continue;
+
+			for(unsigned c = p; c < 4; c++)
+				m[r][c] -= f * m[p][c];
+		}
+	}
+
+	for(unsigned r = 0; r < 3; r++)
+		fit[r] = m[r][3] / m[r][r];
+
+	for(size_t i = edge; i + edge < frames; i++)
+	{
+		double tone = fit[0] * cos(2 * M_PI * freq * i) +
+			fit[1] * sin(2 * M_PI * freq * i);
+		double err = out[i * 2] - fit[2] - tone;
+
+		signal += tone * tone;
+		noise += err * err;
+	}
+
+	return 10 * log10(noise / signal);
+}
+
+/**
+ * Resample a sweep of tones between common rates at each quality, check that
+ * resampleRead() gives the same output as resampleReadRef(), and report the
+ * THD+N of the tones and how much faster than real time each version runs.
+ *
+ * \return	0 if every output was the same, else failure.
+ */
+static int testResample(void)
+{
+	static const uint32_t rates[][2] = {
+		{ 44100, 48000 }, { 48000, 44100 }, { 22050, 48000 },
+		{ 32000, 44100 }, { 96000, 48000 }, { 44100, 32728 }
+	};
+	static const char *qualities[] = { "low", "medium", "high" };
+	int ret = 0;
+
+	puts("Rates		Quality	Result	Worst THD+N		Mean THD+N	"
+			"Ref x RT	Fast x RT");
+
+	for(unsigned r = 0; r < sizeof(rates) / sizeof(rates[0]); r++)
+	{
+		uint32_t	inRate = rates[r][0];
+		uint32_t	outRate = rates[r][1];
+		uint32_t	lowRate = inRate < outRate ? inRate : outRate;
+		size_t		inLen = inRate * RESAMPLE_TONE_S;
+		size_t		outLen = outRate * RESAMPLE_TONE_S + 2;
+		int16_t		*in = malloc(inLen * 2 * sizeof(int16_t));
+		int16_t		*ref = malloc(outLen * 2 * sizeof(int16_t));
+		int16_t		*fast = malloc(outLen * 2 * sizeof(int16_t));
+
+		if(in == NULL || ref == NULL || fast == NULL)
+		{
+			free(in);
+			free(ref);
+			free(fast);
+			return -1;
+		}
 
-		if(read <= 0)
+		for(unsigned q = RESAMPLE_LOW; q <= RESAMPLE_HIGH; q++)
+		{
+			struct resampler_t	rs;
+			double				worst = -200, worstFreq = 0, sum = 0;
+			uint64_t			refNs = 0, fastNs = 0;
+			unsigned			tones = 0;
+			bool				same = true;
+			char				rateName[16];
+
+			/* A third of an octave apart, from 20 Hz up to 20 kHz or as far
+			 * as the lower rate allows. */
+			for(double freq = 20; freq <= 20000 && freq < lowRate * 0.45;
+					freq *= 1.2599)
+			{
+				size_t		made, madeRef;
+				uint64_t	start;
+				double		thdn;
+
+				/* A -1 dBFS tone on the left, and the same at -7 dBFS on the
+				 * right, so that the channels differ. */
+				for(size_t i = 0; i < inLen; i++)
+				{
+					double x = 0.891 * INT16_MAX *
+						sin(2 * M_PI * freq * i / inRate);
+
+					in[i * 2] = lrint(x);
+					in[i * 2 + 1] = lrint(x / 2);
+				}
+
+				if(resampleInit(&rs, inRate, outRate, 2, RESAMPLE_CHUNK,
+							q) != 0)
+				{
+					printf("Unable to resample: %s\n", strerror(errno));
+					ret = -1;
+					break;
+				}
+
+				start = platformTime();
+				madeRef = resampleAll(&rs, false, in, inLen, ref);
+				refNs += platformTime() - start;
+
+				resampleSeek(&rs, 0);
+				start = platformTime();
+				made = resampleAll(&rs, true, in, inLen, fast);
+				fastNs += platformTime() - start;
+
+				if(made != madeRef || made != resampleFrames(&rs, inLen) ||
+						memcmp(ref, fast, made * 2 * sizeof(int16_t)) != 0)
+					same = false;
+
+				thdn = toneThdN(fast, made, freq / outRate, rs.taps * 2);
+				resampleExit(&rs);
+
+				if(thdn > worst)
+				{
+					worst = thdn;
+					worstFreq = freq;
+				}
+
+				sum += thdn;
+				tones++;
+			}
+
+			if(tones == 0)
+				break;
+
+			snprintf(rateName, sizeof(rateName), "%u>%u", inRate, outRate);
+			printf("%-16s%s\t%s\t%6.1f dB at %5.0f Hz\t%6.1f dB\t"
+					"%8.1f\t%9.1f\n", rateName, qualities[q],
+					same ? "ok" : "DIFFERS", worst, worstFreq, sum / tones,
+					tones * RESAMPLE_TONE_S / (refNs / 1e9),
+					tones * RESAMPLE_TONE_S / (fastNs / 1e9));
+
+			if(same == false)
+				ret = -1;
+		}
+
+		free(in);
+		free(ref);
+		free(fast);
+	}
+
+	return ret;
+}
+
+/* Frames given to each stretchWrite() by testStretch(), as from a decoder. */
+#define STRETCH_CHUNK	1152
+
+/* Length of each tone stretched, in seconds. */
+#define STRETCH_TONE_S	1.0
+
+/**
+ * Stretch all of a signal, a chunk at a time, and then flush the stretcher.
+ *
+ * \param	st		Stretcher, at the start of the input.
+ * \param	fast	Use stretchRead() rather than stretchReadRef().
+ * \param	in		Interleaved input frames.
+ * \param	frames	Number of input frames.
+ * \param	out		Output frames.
+ * \param	room	Most output frames.
+ * \return			Output frames made.
+ */
+static size_t stretchAll(struct stretcher_t *st, bool fast, const int16_t *in,
+		size_t frames, int16_t *out, size_t room)
+{
+	size_t (*read)(struct stretcher_t *, int16_t *, size_t) =
+		fast ? stretchRead : stretchReadRef;
+	size_t made = 0;
+
+	for(size_t i = 0; i < frames; i += STRETCH_CHUNK)
+	{
+		size_t len = frames - i < STRETCH_CHUNK ? frames - i : STRETCH_CHUNK;
+
+		stretchWrite(st, in + i * st->chans, len);
+		made += (*read)(st, out + made * st->chans, room - made);
+	}
+
+	stretchFlush(st);
+	return made + (*read)(st, out + made * st->chans, room - made);
+}
+
+/**
+ * Stretch tones an octave apart to each speed, check that stretchRead() gives
+ * the same output as stretchReadRef(), and report how far each tone is from a
+ * pure tone of the same pitch, how far the length of the output is from that
+ * of the input at the speed, and how much faster than real time each version
+ * runs. Segments are lined up to the nearest frame, so the phase of a tone may
+ * move a little at each splice, and the THD+N is measured over the output of
+ * each segment on its own.
+ *
+ * \return	0 if every output was the same and stood for all of its input,
+ *			else failure.
+ */
+static int testStretch(void)
+{
+	static const unsigned speeds[] = { 75, 125, 150, 200 };
+	const uint32_t	rate = 44100;
+	size_t			inLen = rate * STRETCH_TONE_S;
+	size_t			room = inLen * 2;
+	int16_t			*in = malloc(inLen * 2 * sizeof(int16_t));
+	int16_t			*ref = malloc(room * 2 * sizeof(int16_t));
+	int16_t			*fast = malloc(room * 2 * sizeof(int16_t));
+	int				ret = 0;
+
+	if(in == NULL || ref == NULL || fast == NULL)
+	{
+		free(in);
+		free(ref);
+		free(fast);
+		return -1;
+	}
+
+	puts("Speed	Result	Worst THD+N		Mean THD+N	Length error	"
+			"Ref x RT	Fast x RT");
+
+	for(unsigned s = 0; s < sizeof(speeds) / sizeof(speeds[0]); s++)
+	{
+		struct stretcher_t	st;
+		double				worst = -200, worstFreq = 0, sum = 0;
+		double				worstMs = 0;
+		uint64_t			refNs = 0, fastNs = 0;
+		unsigned			tones = 0;
+		bool				same = true;
+
+		for(double freq = 100; freq <= 6400; freq *= 2)
+		{
+			size_t		made, madeRef, hop;
+			uint64_t	start;
+			double		thdn, ms, noise = 0;
+			unsigned	segs = 0;
+
+			/* As for testResample(), with the channels at different levels. */
+			for(size_t i = 0; i < inLen; i++)
+			{
+				double x = 0.891 * INT16_MAX * sin(2 * M_PI * freq * i / rate);
+
+				in[i * 2] = lrint(x);
+				in[i * 2 + 1] = lrint(x / 2);
+			}
+
+			if(stretchInit(&st, rate, 2, STRETCH_CHUNK) != 0)
+			{
+				printf("Unable to stretch: %s\n", strerror(errno));
+				ret = -1;
+				break;
+			}
+
+			stretchSetSpeed(&st, speeds[s] * STRETCH_SPEED_UNITY / 100);
+
+			start = platformTime();
+			madeRef = stretchAll(&st, false, in, inLen, ref, room);
+			refNs += platformTime() - start;
+
+			stretchReset(&st);
+			start = platformTime();
+			made = stretchAll(&st, true, in, inLen, fast, room);
+			fastNs += platformTime() - start;
+
+			if(made != madeRef || stretchSource(&st) != inLen ||
+					memcmp(ref, fast, made * 2 * sizeof(int16_t)) != 0)
+				same = false;
+
+			ms = fabs(made - inLen * 100.0 / speeds[s]) * 1000 / rate;
+			if(ms > worstMs)
+				worstMs = ms;
+
+			/* The first segment has nothing to be lined up with. */
+			hop = st.segLen - st.overlap;
+			for(size_t i = hop; i + hop <= made; i += hop, segs++)
+				noise += pow(10, toneThdN(fast + i * 2, hop, freq / rate,
+							0) / 10);
+
+			thdn = 10 * log10(noise / segs);
+			stretchExit(&st);
+
+			if(thdn > worst)
+			{
+				worst = thdn;
+				worstFreq = freq;
+			}
+
+			sum += thdn;
+			tones++;
+		}
+
+		if(tones == 0)
 			break;
 
-		fwrite(buffer, read * sizeof(int16_t), 1, out);
+		printf("%u%%\t%s\t%6.1f dB at %4.0f Hz\t%6.1f dB\t%6.1f ms\t"
+				"%8.1f\t%9.1f\n", speeds[s], same ? "ok" : "DIFFERS",
+				worst, worstFreq, sum / tones, worstMs,
+				tones * STRETCH_TONE_S / (refNs / 1e9),
+				tones * STRETCH_TONE_S / (fastNs / 1e9));
+
+		if(same == false)
+			ret = -1;
 	}
 
-	(*decoder.exit)();
-	free(buffer);
-	fclose(out);
+	free(in);
+	free(ref);
+	free(fast);
+	return ret;
+}
 
-	return 0;
+/* Length of the file that is faded out by testFade(), and of each file faded
+ * into it, in seconds. */
+#define FADE_FIRST_S	3
+#define FADE_NEXT_S		1
+
+/* Output that wraps the null output, counting the frames queued to it. */
+static struct output_fn	countBase;
+static size_t			countFrames;
+
+static void queueCount(struct outputBuf *buf)
+{
+	countFrames += buf->nsamples;
+	(*countBase.queue)(buf);
+}
+
+/**
+ * Write a stereo 16-bit WAV file of a 440 Hz tone, through the wav output.
+ *
+ * \param	file	File to write.
+ * \param	rate	Sampling rate.
+ * \param	frames	Length of the tone in frames.
+ * \return			0 on success, else failure.
+ */
+static int writeTone(const char *file, uint32_t rate, size_t frames)
+{
+	struct output_fn	wav;
+	struct outputBuf	buf;
+	int					ret = -1;
+
+	setOutputWav(&wav);
+	setOutputWavFile(file);
+
+	if((*wav.init)() != 0 ||
+			(*wav.setFormat)(rate, 2, OUTPUT_FORMAT_PCM16) != 0)
+		return -1;
+
+	if((*wav.alloc)(&buf, frames * 2 * sizeof(int16_t)) == 0)
+	{
+		for(size_t i = 0; i < frames; i++)
+		{
+			double x = 0.5 * INT16_MAX * sin(2 * M_PI * 440 * i / rate);
+
+			buf.data[i * 2] = buf.data[i * 2 + 1] = lrint(x);
+		}
+
+		buf.nsamples = frames;
+		(*wav.queue)(&buf);
+		(*wav.free)(&buf);
+		ret = 0;
+	}
+
+	(*wav.exit)();
+	setOutputWavFile("out.wav");
+	return ret;
+}
+
+/**
+ * Crossfade a file into files at the same and at other sampling rates, over
+ * fades from a tenth of a second up to longer than the files faded into, and
+ * check that the output stream is as long as the files less the overlap. The
+ * samples of resampled files that are decoded ahead are held for longer than
+ * those of files at the rate of the stream, so this is best run with
+ * AddressSanitizer.
+ *
+ * \return	0 if every output was as long as it should be, else failure.
+ */
+static int testFade(void)
+{
+	static const uint32_t	rates[] = { 44100, 22050, 32000, 48000 };
+	static struct playbackInfo_t	info;
+	struct output_fn	output;
+	const uint32_t		rate = 44100;
+	const char			*first = "fade-first.wav";
+	const char			*next = "fade-next.wav";
+	int					ret = -1;
+
+	if(writeTone(first, rate, rate * FADE_FIRST_S) != 0)
+	{
+		printf("Unable to write %s: %s\n", first, strerror(errno));
+		return -1;
+	}
+
+	setOutputNull(&countBase);
+	output = countBase;
+	output.queue = &queueCount;
+	setPlaybackOutput(&output);
+
+	if(playbackInit(&info) != 0)
+	{
+		printf("Unable to start playback: %s\n", strerror(errno));
+		goto out;
+	}
+
+	puts("Rates		Result	Worst length error");
+
+	for(unsigned r = 0; r < sizeof(rates) / sizeof(rates[0]); r++)
+	{
+		size_t	nextFrames = (size_t)rates[r] * FADE_NEXT_S;
+		long	worst = 0;
+		char	rateName[16];
+
+		if(writeTone(next, rates[r], nextFrames) != 0)
+		{
+			printf("Unable to write %s: %s\n", next, strerror(errno));
+			goto exit;
+		}
+
+		/* Frames of the next file at the rate of the stream, which is that
+		 * of the first file. */
+		nextFrames = (size_t)rate * FADE_NEXT_S;
+
+		for(unsigned ms = 100; ms <= FADE_NEXT_S * 1500; ms += 100)
+		{
+			struct playbackEvent_t	event;
+			size_t	fadeFrames = (size_t)rate * ms / 1000;
+			size_t	expected = rate * FADE_FIRST_S - fadeFrames +
+				(nextFrames > fadeFrames ? nextFrames : fadeFrames);
+			bool	stopped = false;
+			long	diff;
+
+			setPlaybackCrossfade(ms);
+			countFrames = 0;
+
+			if(playbackPlay(first, next) != 0)
+			{
+				printf("Unable to play: %s\n", strerror(errno));
+				goto exit;
+			}
+
+			while(stopped == false)
+			{
+				platformSleep(1000000);
+
+				while(playbackGetEvent(&event) == true)
+				{
+					if(event.type == PLAYBACK_EVENT_ERROR)
+					{
+						printf("Error %d: %s\n", event.error,
+								ctrmus_strerror(event.error));
+						goto exit;
+					}
+
+					if(event.type == PLAYBACK_EVENT_STOPPED)
+						stopped = true;
+				}
+			}
+
+			diff = (long)countFrames - (long)expected;
+			if(labs(diff) > labs(worst))
+				worst = diff;
+		}
+
+		snprintf(rateName, sizeof(rateName), "%u>%u", rates[r], rate);
+		printf("%-16s%s\t%ld frames\n", rateName,
+				labs(worst) <= 1 ? "ok" : "WRONG", worst);
+
+		if(labs(worst) > 1)
+			goto exit;
+	}
+
+	ret = 0;
+
+exit:
+	playbackExit();
+out:
+	setPlaybackCrossfade(0);
+	remove(first);
+	remove(next);
+	return ret;
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [OPTIONS] FILE [NEXT]\n", name);
+	printf("       %s -t\n", name);
+	printf("       %s -q\n", name);
+	printf("       %s -y\n", name);
+	printf("       %s -F\n", name);
+	puts("Play FILE, followed by NEXT without a gap where possible, through\n"
+			"the ctrmus playback engine.\n"
+			"  -o OUTPUT\tOne of wav (default), null or sim.\n"
+			"  -w FILE\tFile written by the wav output (default out.wav).\n"
+			"  -x SPEED\tSpeed multiplier of the sim output (default 1).\n"
+			"  -n COUNT\tPlay FILE COUNT times (default 1).\n"
+			"  -s MS\t\tSkip to NEXT after MS milliseconds.\n"
+			"  -b\t\tTime the CPU used to decode FILE instead of playing\n"
+			"\t\tit. WAV files are timed with and without converting\n"
+			"\t\t16-bit PCM.\n"
+			"  -k STEPS\tTime seeks to STEPS positions in FILE instead of\n"
+			"\t\tplaying it.\n"
+			"  -r KIB\tSize of each read from a file (default 64).\n"
+			"  -p KIB\tRead ahead of decoders by KIB in an I/O thread, or 0\n"
+			"\t\tto read when decoders need data (default 256).\n"
+			"  -c MIB\tTranscode FILE into a cache of up to MIB before\n"
+			"\t\tplaying it.\n"
+			"  -m KIB\tRead files of up to KIB in total whole into memory\n"
+			"\t\t(default 8192).\n"
+			"  -l MIN:MAX\tDelay every read by MIN to MAX milliseconds.\n"
+			"  -f MS\t\tCrossfade FILE into NEXT over MS milliseconds.\n"
+			"  -g MODE\tNormalise with ReplayGain MODE, one of off, track\n"
+			"\t\t(default) or album.\n"
+			"  -R RATE\tResample every file to RATE Hz, rather than files\n"
+			"\t\tthat follow on from a file at another rate.\n"
+			"  -Q QUALITY\tResample at QUALITY, one of low, medium (default)\n"
+			"\t\tor high.\n"
+			"  -S PERCENT\tPlay at PERCENT of the speed of each file,\n"
+			"\t\tkeeping its pitch (default 100).\n"
+			"  -t\t\tCheck the sample conversions against their scalar\n"
+			"\t\treferences and time them.\n"
+			"  -q\t\tCheck the resampler against its scalar reference,\n"
+			"\t\ttime it and measure its THD+N over a sweep of tones.\n"
+			"  -y\t\tCheck the time-stretch against its scalar reference,\n"
+			"\t\ttime it and measure how well it keeps the pitch of\n"
+			"\t\ttones.\n"
+			"  -F\t\tCheck the length of crossfades into files at the same\n"
+			"\t\tand at other sampling rates.");
+}
+
+/**
+ * Test the various decoder modules in ctrmus.
+ */
+int main(int argc, char *argv[])
+{
+	static struct playbackInfo_t	info;
+	struct output_fn	output;
+	enum file_types		ft;
+	const char			*outputName = "wav";
+	const char			*file;
+	const char			*next = NULL;
+	unsigned long		count = 1;
+	unsigned long		switchMs = 0;
+	unsigned long		seekSteps = 0;
+	bool				bench = false;
+	unsigned long		cacheMiB = 0;
+	unsigned long		rate = 0;
+	enum resample_quality	quality = RESAMPLE_MEDIUM;
+	unsigned long		speed = 100;
+	int					opt;
+	int					ret = -1;
+
+	while((opt = getopt(argc, argv,
+					"o:w:x:n:bs:k:r:p:m:c:l:f:g:R:Q:S:tqyF")) != -1)
+	{
+		switch(opt)
+		{
+			case 'o':
+				outputName = optarg;
+				break;
+
+			case 'w':
+				setOutputWavFile(optarg);
+				break;
+
+			case 'x':
+				setOutputSimSpeed(strtoul(optarg, NULL, 10));
+				break;
+
+			case 'n':
+				count = strtoul(optarg, NULL, 10);
+				break;
+
+			case 's':
+				switchMs = strtoul(optarg, NULL, 10);
+				break;
+
+			case 'b':
+				bench = true;
+				break;
+
+			case 'k':
+				seekSteps = strtoul(optarg, NULL, 10);
+				break;
+
+			case 'r':
+				setReadAhead(strtoul(optarg, NULL, 10) * 1024);
+				break;
+
+			case 'p':
+				setPrefetch(strtoul(optarg, NULL, 10) * 1024);
+				break;
+
+			case 'c':
+				cacheMiB = strtoul(optarg, NULL, 10);
+				break;
+
+			case 'm':
+				setMemoryBudget(strtoul(optarg, NULL, 10) * 1024);
+				break;
+
+			case 'l':
+			{
+				char *end;
+				unsigned long minMs = strtoul(optarg, &end, 10);
+				unsigned long maxMs = minMs;
+
+				if(*end == ':')
+					maxMs = strtoul(end + 1, NULL, 10);
+
+				setReadDelay(minMs * 1000000, maxMs * 1000000);
+				break;
+			}
+
+			case 'f':
+				setPlaybackCrossfade(strtoul(optarg, NULL, 10));
+				break;
+
+			case 'g':
+				if(strcmp(optarg, "off") == 0)
+					setPlaybackGain(REPLAYGAIN_OFF, 0);
+				else if(strcmp(optarg, "track") == 0)
+					setPlaybackGain(REPLAYGAIN_TRACK, 0);
+				else if(strcmp(optarg, "album") == 0)
+					setPlaybackGain(REPLAYGAIN_ALBUM, 0);
+				else
+				{
+					usage(argv[0]);
+					return -1;
+				}
+				break;
+
+			case 'R':
+				rate = strtoul(optarg, NULL, 10);
+				break;
+
+			case 'Q':
+				if(strcmp(optarg, "low") == 0)
+					quality = RESAMPLE_LOW;
+				else if(strcmp(optarg, "medium") == 0)
+					quality = RESAMPLE_MEDIUM;
+				else if(strcmp(optarg, "high") == 0)
+					quality = RESAMPLE_HIGH;
+				else
+				{
+					usage(argv[0]);
+					return -1;
+				}
+				break;
+
+			case 'S':
+				speed = strtoul(optarg, NULL, 10);
+				break;
+
+			case 't':
+				return testKernels();
+
+			case 'q':
+				return testResample();
+
+			case 'y':
+				return testStretch();
+
+			case 'F':
+				return testFade();
+
+			default:
+				usage(argv[0]);
+				return -1;
+		}
+	}
+
+	if(optind != argc - 1 && optind != argc - 2)
+	{
+		usage(argv[0]);
+		return 0;
+	}
+
+	file = argv[optind];
+	if(optind == argc - 2)
+		next = argv[optind + 1];
+
+	if(strcmp(outputName, "wav") == 0)
+		setOutputWav(&output);
+	else if(strcmp(outputName, "null") == 0)
+		setOutputNull(&output);
+	else if(strcmp(outputName, "sim") == 0)
+		setOutputSim(&output);
+	else
+	{
+		usage(argv[0]);
+		return -1;
+	}
+
+	if((ft = getFileType(file)) == FILE_TYPE_ERROR)
+	{
+		puts("Unsupported file.");
+		goto err;
+	}
+
+	printf("Type: %s\n", fileToStr(ft));
+
+	if(cacheMiB != 0)
+	{
+		char		cached[PATH_MAX];
+		uint64_t	start = platformTime();
+
+		if(cacheInit(cacheMiB * 1024 * 1024, 0, -2) != 0)
+		{
+			puts("Unable to start cache.");
+			goto err;
+		}
+
+		cacheAdd(file);
+
+		while(cacheIsIdle() == false)
+			platformSleep(1000000);
+
+		if(cacheLookup(file, cached, sizeof(cached)) == true)
+			printf("Transcoded to %s in %.3f s.\n", cached,
+					(platformTime() - start) / 1e9);
+		else
+			puts("Not transcoded.");
+	}
+
+	if(bench == true)
+	{
+		while(count-- > 0)
+		{
+			if(testDecode(file) != 0)
+				goto err;
+		}
+
+		return 0;
+	}
+
+	setPlaybackOutput(&output);
+	setPlaybackRate(rate, quality);
+	setPlaybackSpeed(speed);
+
+	if(playbackInit(&info) != 0)
+	{
+		printf("Unable to start playback: %s\n", strerror(errno));
+		goto err;
+	}
+
+	while(count-- > 0)
+	{
+		if(seekSteps != 0)
+		{
+			if(testSeek(file, &info, seekSteps) != 0)
+				goto out;
+		}
+		else if(testPlayback(file, next, &info, switchMs) != 0)
+			goto out;
+	}
+
+	ret = 0;
+
+out:
+	cacheExit();
+	playbackExit();
+
+	if(ret == 0)
+		return 0;
 
 err:
 	puts("Error");
@@ -2,20 +2,28 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "file.h"
 #include "vorbis.h"
 #include "playback.h"
 
-static OggVorbis_File	vorbisFile;
-static vorbis_info		*vi;
-static FILE				*f;
 static const size_t		buffSize = 8 * 4096;
 
-static int initVorbis(const char* file);
-static uint32_t rateVorbis(void);
-static uint8_t channelVorbis(void);
-static uint64_t decodeVorbis(void* buffer);
-static void exitVorbis(void);
-static uint64_t fillVorbisBuffer(char* bufferOut);
+struct vorbis_t
+{
+	OggVorbis_File	vorbisFile;
+	vorbis_info		*vi;
+	int				currentSection;
+	struct probe_t*	probe;
+};
+
+static void* initVorbis(struct probe_t* probe);
+static uint32_t rateVorbis(void* ctx);
+static uint8_t channelVorbis(void* ctx);
+static uint64_t decodeVorbis(void* ctx, void* buffer);
+static void exitVorbis(void* ctx);
+static int seekVorbis(void* ctx, uint64_t sample);
+static void getGainVorbis(void* ctx, struct replaygain_t* gain);
+static uint64_t fillVorbisBuffer(struct vorbis_t* vorbis, char* bufferOut);
 
 /**
  * Set decoder parameters for Vorbis.
@@ -28,33 +36,67 @@ void setVorbis(struct decoder_fn* decoder)
 	decoder->rate = &rateVorbis;
 	decoder->channels = &channelVorbis;
 	decoder->buffSize = buffSize;
+	decoder->order = CHANNEL_ORDER_VORBIS;
 	decoder->decode = &decodeVorbis;
 	decoder->exit = &exitVorbis;
+	decoder->seek = &seekVorbis;
+	decoder->getGain = &getGainVorbis;
+}
+
+static size_t onReadVorbis(void* ptr, size_t size, size_t nmemb, void* src)
+{
+	if(size == 0)
+		return 0;
+
+	return probeRead(src, ptr, size * nmemb) / size;
+}
+
+static int onSeekVorbis(void* src, ogg_int64_t offset, int whence)
+{
+	return probeSeek(src, offset, whence);
+}
+
+static long onTellVorbis(void* src)
+{
+	return probeTell(src);
 }
 
 /**
  * Initialise Vorbis decoder.
  *
- * \param	file	Location of vorbis file to play.
- * \return			0 on success, else failure.
+ * \param	probe	Probed vorbis file to play. Owned by the decoder on
+ *					success.
+ * \return			Decoder context, or NULL on failure.
  */
-int initVorbis(const char* file)
+static void* initVorbis(struct probe_t* probe)
 {
-	int err = -1;
-
-	if((f = fopen(file, "rb")) == NULL)
-		goto out;
-
-	if(ov_open(f, &vorbisFile, NULL, 0) < 0)
-		goto out;
-
-	if((vi = ov_info(&vorbisFile, -1)) == NULL)
-		goto out;
+	static const ov_callbacks cb = {
+		.read_func = &onReadVorbis,
+		.seek_func = &onSeekVorbis,
+		.close_func = NULL,
+		.tell_func = &onTellVorbis
+	};
+	struct vorbis_t* vorbis;
+
+	if((vorbis = calloc(1, sizeof(struct vorbis_t))) == NULL)
+		return NULL;
+
+	/* The probe is closed by exitVorbis(), not by ov_clear(). */
+	if(ov_open_callbacks(probe, &vorbis->vorbisFile, NULL, 0, cb) < 0)
+		goto err;
+
+	if((vorbis->vi = ov_info(&vorbis->vorbisFile, -1)) == NULL)
+	{
+		ov_clear(&vorbis->vorbisFile);
+		goto err;
+	}
 
-	err = 0;
+	vorbis->probe = probe;
+	return vorbis;
 
-out:
-	return err;
+err:
+	free(vorbis);
+	return NULL;
 }
 
 /**
@@ -62,9 +104,11 @@ out:
  *
  * \return	Sampling rate.
  */
-uint32_t rateVorbis(void)
+static uint32_t rateVorbis(void* ctx)
 {
-	return vi->rate;
+	struct vorbis_t* vorbis = ctx;
+
+	return vorbis->vi->rate;
 }
 
 /**
@@ -72,9 +116,11 @@ uint32_t rateVorbis(void)
  *
  * \return	Number of channels for opened file.
  */
-uint8_t channelVorbis(void)
+static uint8_t channelVorbis(void* ctx)
 {
-	return vi->channels;
+	struct vorbis_t* vorbis = ctx;
+
+	return vorbis->vi->channels;
 }
 
 /**
@@ -84,39 +130,71 @@ uint8_t channelVorbis(void)
  * \return			Samples read for each channel. 0 for end of file, negative
  *					for error.
  */
-uint64_t decodeVorbis(void* buffer)
+static uint64_t decodeVorbis(void* ctx, void* buffer)
 {
-	return fillVorbisBuffer(buffer);
+	return fillVorbisBuffer(ctx, buffer);
+}
+
+/**
+ * Seek to a sample of open Vorbis file.
+ *
+ * \param sample	Sample for each channel to seek to.
+ * \return			0 on success, else failure.
+ */
+static int seekVorbis(void* ctx, uint64_t sample)
+{
+	struct vorbis_t* vorbis = ctx;
+
+	return ov_pcm_seek(&vorbis->vorbisFile, sample) == 0 ? 0 : -1;
+}
+
+/**
+ * Read the ReplayGain of Vorbis file from its comments.
+ *
+ * \param gain	ReplayGain to fill in.
+ */
+static void getGainVorbis(void* ctx, struct replaygain_t* gain)
+{
+	struct vorbis_t* vorbis = ctx;
+	vorbis_comment* vc = ov_comment(&vorbis->vorbisFile, -1);
+
+	if(vc == NULL)
+		return;
+
+	for(int i = 0; i < vc->comments; i++)
+		replaygainParse(gain, vc->user_comments[i], vc->comment_lengths[i]);
 }
 
 /**
  * Free Vorbis decoder.
  */
-void exitVorbis(void)
+static void exitVorbis(void* ctx)
 {
-	ov_clear(&vorbisFile);
-	fclose(f);
+	struct vorbis_t* vorbis = ctx;
+
+	ov_clear(&vorbis->vorbisFile);
+	probeClose(vorbis->probe);
+	free(vorbis);
 }
 
 /**
  * Decode Vorbis file to fill buffer.
  *
- * \param opusFile		File to decode.
+ * \param vorbis		File to decode.
  * \param bufferOut		Pointer to buffer.
  * \return				Samples read per channel.
  */
-uint64_t fillVorbisBuffer(char* bufferOut)
+static uint64_t fillVorbisBuffer(struct vorbis_t* vorbis, char* bufferOut)
 {
 	uint64_t samplesRead = 0;
 	int samplesToRead = buffSize;
 
 	while(samplesToRead > 0)
 	{
-		static int current_section;
 		int samplesJustRead =
-			ov_read(&vorbisFile, bufferOut,
+			ov_read(&vorbis->vorbisFile, bufferOut,
 					samplesToRead > 4096 ? 4096	: samplesToRead,
-					&current_section);
+					&vorbis->currentSection);
 
 		if(samplesJustRead < 0)
 			return samplesJustRead;
@@ -135,23 +213,13 @@ uint64_t fillVorbisBuffer(char* bufferOut)
 }
 
 /**
- * Checks if the input file is Vorbis.
+ * Score the start of a file as a Vorbis file.
  *
- * \param in	Input file.
- * \return		0 if Vorbis file, else not or failure.
+ * \param	head	First bytes of file.
+ * \param	len		Number of bytes in head.
+ * \return			100 if an Ogg Vorbis file, else 0.
  */
-int isVorbis(const char *in)
+int probeVorbis(const uint8_t* head, size_t len)
 {
-	FILE *ft = fopen(in, "r");
-	OggVorbis_File testvf;
-	int err;
-
-	if(ft == NULL)
-		return -1;
-
-	err = ov_test(ft, &testvf, NULL, 0);
-
-	ov_clear(&testvf);
-	fclose(ft);
-	return err;
+	return oggPacketIs(head, len, "\x01" "vorbis", 7) ? 100 : 0;
 }
@@ -1,3 +1,5 @@
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,18 +7,45 @@
 #define DR_WAV_IMPLEMENTATION
 #include <dr_libs/dr_wav.h>
 
+#include "cache.h"
+#include "file.h"
 #include "wav.h"
 #include "playback.h"
+#include "sample.h"
 
-static drwav wav;
 static const size_t buffSize = 16 * 1024;
 
-static int initWav(const char* file);
-static uint32_t rateWav(void);
-static uint8_t channelWav(void);
-static uint64_t readWav(void* buffer);
-static void exitWav(void);
-static size_t getFileSamplesWav(void);
+/* Whether 16-bit PCM goes through drwav_read_pcm_frames_s16() too. */
+static bool convertAll = false;
+
+#if DRWAV_VERSION_MINOR < 14
+#define DRWAV_SEEK_CUR	drwav_seek_origin_current
+#endif
+
+struct wav_t
+{
+	drwav			wav;
+	struct probe_t*	probe;
+
+	/* Whether samples are plain 16-bit PCM, and whether they are big-endian. */
+	bool			pcm16;
+	bool			swap;
+
+	/* Whether 8-bit samples are given as they are, and whether they are
+	 * unsigned in the file. */
+	bool			pcm8;
+	bool			unsign;
+};
+
+static void* initWav(struct probe_t* probe);
+static uint32_t rateWav(void* ctx);
+static uint8_t channelWav(void* ctx);
+static enum output_format formatWav(void* ctx, enum output_format format);
+static uint64_t readWav(void* ctx, void* buffer);
+static void exitWav(void* ctx);
+static size_t getFileSamplesWav(void* ctx);
+static int seekWav(void* ctx, uint64_t sample);
+static void getGainWav(void* ctx, struct replaygain_t* gain);
 
 /**
  * Set decoder parameters for WAV.
@@ -29,25 +58,101 @@ void setWav(struct decoder_fn* decoder)
 	decoder->rate = &rateWav;
 	decoder->channels = &channelWav;
 	decoder->buffSize = buffSize;
+	decoder->setFormat = &formatWav;
 	decoder->decode = &readWav;
 	decoder->exit = &exitWav;
 	decoder->getFileSamples = &getFileSamplesWav;
+	decoder->seek = &seekWav;
+	decoder->getGain = &getGainWav;
+}
+
+/**
+ * Set whether 16-bit PCM is converted by dr_wav like other formats.
+ *
+ * \param	convert	true to convert all samples.
+ */
+void setWavConvert(bool convert)
+{
+	convertAll = convert;
+}
+
+static size_t onReadWav(void* user, void* buffer, size_t size)
+{
+	return probeRead(user, buffer, size);
 }
 
+static drwav_bool32 onSeekWav(void* user, int offset, drwav_seek_origin origin)
+{
+	int whence = SEEK_SET;
+
+	if(origin == DRWAV_SEEK_CUR)
+		whence = SEEK_CUR;
+#if DRWAV_VERSION_MINOR >= 14
+	else if(origin == DRWAV_SEEK_END)
+		whence = SEEK_END;
+#endif
+
+	return probeSeek(user, offset, whence) == 0;
+}
+
+#if DRWAV_VERSION_MINOR >= 14
+static drwav_bool32 onTellWav(void* user, drwav_int64* cursor)
+{
+	*cursor = probeTell(user);
+	return DRWAV_TRUE;
+}
+#endif
+
 /**
  * Initialise WAV playback.
  *
- * \param	file	Location of WAV file to play.
- * \return			0 on success, else failure.
+ * \param	probe	Probed WAV file to play. Owned by the decoder on success.
+ * \return			Decoder context, or NULL on failure.
  */
-int initWav(const char* file)
+static void* initWav(struct probe_t* probe)
 {
-	return !drwav_init_file(&wav, file, NULL);
+	struct wav_t* wav;
+
+	if((wav = malloc(sizeof(struct wav_t))) == NULL)
+		return NULL;
+
+#if DRWAV_VERSION_MINOR >= 14
+	if(!drwav_init(&wav->wav, &onReadWav, &onSeekWav, &onTellWav, probe, NULL))
+#else
+	if(!drwav_init(&wav->wav, &onReadWav, &onSeekWav, probe, NULL))
+#endif
+	{
+		free(wav);
+		return NULL;
+	}
+
+	wav->probe = probe;
+	wav->pcm16 = convertAll == false &&
+		wav->wav.translatedFormatTag == DR_WAVE_FORMAT_PCM &&
+		wav->wav.bitsPerSample == 16;
+	wav->swap = false;
+	wav->pcm8 = false;
+	wav->unsign = true;
+
+#if DRWAV_VERSION_MINOR >= 13
+	if(wav->wav.container == drwav_container_rifx ||
+			(wav->wav.container == drwav_container_aiff &&
+			 !wav->wav.aiff.isLE))
+		wav->swap = true;
+
+	/* 8-bit samples in AIFF are normally signed. */
+	if(wav->wav.container == drwav_container_aiff)
+		wav->unsign = wav->wav.aiff.isUnsigned;
+#endif
+
+	return wav;
 }
 
-static size_t getFileSamplesWav(void)
+static size_t getFileSamplesWav(void* ctx)
 {
-	return wav.totalPCMFrameCount * (size_t)wav.channels;
+	drwav* wav = &((struct wav_t*)ctx)->wav;
+
+	return wav->totalPCMFrameCount * (size_t)wav->channels;
 }
 
 /**
@@ -55,9 +160,11 @@ static size_t getFileSamplesWav(void)
  *
  * \return	Sampling rate.
  */
-uint32_t rateWav(void)
+static uint32_t rateWav(void* ctx)
 {
-	return wav.sampleRate;
+	drwav* wav = &((struct wav_t*)ctx)->wav;
+
+	return wav->sampleRate;
 }
 
 /**
@@ -65,9 +172,30 @@ uint32_t rateWav(void)
  *
  * \return	Number of channels for opened file.
  */
-uint8_t channelWav(void)
+static uint8_t channelWav(void* ctx)
 {
-	return wav.channels;
+	drwav* wav = &((struct wav_t*)ctx)->wav;
+
+	return wav->channels;
+}
+
+/**
+ * Give 8-bit PCM as it is if allowed, so that it takes half the memory.
+ * ADPCM in WAV files is not the DSP-ADPCM that the 3DS plays, so is always
+ * decoded.
+ *
+ * \param	format	Most compact format that may be given.
+ * \return			Format of samples that readWav() will give.
+ */
+static enum output_format formatWav(void* ctx, enum output_format format)
+{
+	struct wav_t* wav = ctx;
+
+	wav->pcm8 = format == OUTPUT_FORMAT_PCM8 &&
+		wav->wav.translatedFormatTag == DR_WAVE_FORMAT_PCM &&
+		wav->wav.bitsPerSample == 8;
+
+	return wav->pcm8 ? OUTPUT_FORMAT_PCM8 : OUTPUT_FORMAT_PCM16;
 }
 
 /**
@@ -76,21 +204,74 @@ uint8_t channelWav(void)
  * \param buffer	Output.
  * \return			Samples read for each channel.
  */
-uint64_t readWav(void* buffer)
+static uint64_t readWav(void* ctx, void* buffer)
 {
+	struct wav_t* wav = ctx;
 	size_t buffSizeFrames;
 	uint64_t samplesRead;
 
-	buffSizeFrames = buffSize / (size_t)wav.channels;
-	samplesRead = drwav_read_pcm_frames_s16(&wav, buffSizeFrames, buffer);
-	samplesRead *= (uint64_t)wav.channels;
+	buffSizeFrames = buffSize / (size_t)wav->wav.channels;
+
+	/*
+	 * Plain 16-bit PCM is read straight into the buffer without conversion.
+	 * Reading big-endian samples as big-endian stops dr_wav from swapping
+	 * them one at a time, so that they are swapped here instead.
+	 */
+	if(wav->pcm8 == true)
+		samplesRead = drwav_read_pcm_frames(&wav->wav, buffSizeFrames,
+				buffer);
+	else if(wav->pcm16 == false)
+		samplesRead = drwav_read_pcm_frames_s16(&wav->wav, buffSizeFrames,
+				buffer);
+	else if(wav->swap == false)
+		samplesRead = drwav_read_pcm_frames_le(&wav->wav, buffSizeFrames,
+				buffer);
+	else
+		samplesRead = drwav_read_pcm_frames_be(&wav->wav, buffSizeFrames,
+				buffer);
+
+	samplesRead *= (uint64_t)wav->wav.channels;
+
+	if(wav->pcm8 == true && wav->unsign == true)
+		sampleSign8(buffer, samplesRead);
+	else if(wav->pcm16 == true && wav->swap == true)
+		sampleSwap16(buffer, samplesRead);
+
 	return samplesRead;
 }
 
+/**
+ * Seek to a sample of open Wav file.
+ *
+ * \param sample	Sample for each channel to seek to.
+ * \return			0 on success, else failure.
+ */
+static int seekWav(void* ctx, uint64_t sample)
+{
+	struct wav_t* wav = ctx;
+
+	return drwav_seek_to_pcm_frame(&wav->wav, sample) ? 0 : -1;
+}
+
+/**
+ * Get the ReplayGain of Wav file. Only transcoded copies of other files carry
+ * one, taken from the file they were made from.
+ */
+static void getGainWav(void* ctx, struct replaygain_t* gain)
+{
+	struct wav_t* wav = ctx;
+
+	cacheReadGain(wav->probe, gain);
+}
+
 /**
  * Free Wav file.
  */
-void exitWav(void)
+static void exitWav(void* ctx)
 {
-	drwav_uninit(&wav);
+	struct wav_t* wav = ctx;
+
+	drwav_uninit(&wav->wav);
+	probeClose(wav->probe);
+	free(wav);
 }